@@ -0,0 +1,754 @@
+// Microbenchmarks for the matrix kernels and the layer/backprop primitives.
+//
+// Every benchmark runs once per BLAS backend, over layer shapes from the
+// iris network (4 x 24) up to the pokemon network (290 x 230) and batch
+// sizes from 1 to 1024.  Arguments are batch/in/out, where a layer maps
+// in units to out units.  FLOP/s and bytes/s are reported as counters, so
+//
+//   ./nn_bench --benchmark_filter='accum_A_BCt/native'
+//
+// compares one kernel across shapes.
+
+#include "benchmark/benchmark.h"
+
+#include "../src/matrix.hpp"
+#include "../src/sparse.hpp"
+#include "../src/blas.hpp"
+#include "../src/network.hpp"
+#include "../src/train.hpp"
+#include "../src/inference.hpp"
+#include "../src/modelfile.hpp"
+#include "../src/recurrent.hpp"
+#include "../src/predictor.hpp"
+
+#include <cstdio>
+#include <functional>
+#include <random>
+
+
+namespace
+{
+
+using nn::realscalar;
+using nn::realmatrix;
+using nn::realvector;
+
+const int shapes[][2] = { { 4, 24 }, { 24, 24 }, { 24, 3 }, { 64, 64 }, { 230, 230 }, { 290, 230 } };
+const int batch_sizes[] = { 1, 4, 16, 64, 256, 1024 };
+
+
+realmatrix RandomMatrix(int rows, int cols)
+{
+  std::mt19937 rng(rows * 7919 + cols);
+  std::uniform_real_distribution<realscalar> dist(-1, 1);
+
+  realmatrix A(rows, cols, realmatrix::PaddedLd(cols));
+  for (int row = 0; row < rows; ++row) {
+    auto r = A.GetRow(row);
+    for (auto& x : r) {
+      x = dist(rng);
+    }
+  }
+  return A;
+}
+
+
+realvector RandomVector(int n)
+{
+  auto A = RandomMatrix(1, n);
+  return A.GetRowValues(0);
+}
+
+
+// flops and bytes moved by one call, reported as rates
+void SetRates(benchmark::State& state, double flops, double elements)
+{
+  state.counters["FLOP/s"] = benchmark::Counter(flops, benchmark::Counter::kIsIterationInvariantRate);
+  state.SetBytesProcessed(int64_t(state.iterations() * elements * sizeof(realscalar)));
+}
+
+
+// a network in -> out -> out with a bound input batch, and its backprop
+// counterparts, laid out the way BackpropTrainingAlgorithm does it.  The
+// specialized variant is built from DenseLayers.
+struct BackpropFixture
+{
+  BackpropFixture(int batch, int in, int out, bool specialized = false,
+                  std::shared_ptr<nn::ErrorFunction> error_fn = std::make_shared<nn::SquaredError>())
+    : network(batch, error_fn),
+      ntr(AddLayers(network, in, out, specialized)),
+      input(RandomMatrix(batch, in)),
+      target(RandomMatrix(batch, out)),
+      params{ 0.001, 0.9, 0.0001, true, 1, 0 }
+  {
+    for (auto& layer : ntr.GetLayers()) {
+      bp_layers.push_back(std::make_shared<nn::train::BackpropLayer>(ntr, params, layer.get(),
+                                                                     ntr.GetErrorFunction().get()));
+    }
+    // default connections join consecutive layers
+    auto connections = ntr.GetConnections();
+    for (size_t c = 0; c < connections.size(); ++c) {
+      bp_connections.push_back(std::make_shared<nn::train::BackpropConnection>(
+        connections[c], bp_layers[c].get(), bp_layers[c + 1].get(), params));
+    }
+    for (size_t l = 1; l < bp_layers.size(); ++l) {
+      bp_layers[l]->AddToWorkspace(workspace, "layer" + std::to_string(l));
+    }
+    for (size_t c = 0; c < bp_connections.size(); ++c) {
+      bp_connections[c]->AddToWorkspace(workspace, "connection" + std::to_string(c));
+    }
+    workspace.Allocate();
+
+    for (auto& c : ntr.GetConnections()) {
+      c->GetWeights() = RandomMatrix(c->Rows(), c->Cols());
+    }
+    network.FeedForward(input);
+    bp_layers[2]->CalculateDelta(target);
+    bp_layers[1]->CalculateDelta();
+  }
+
+  // the trainer plans the workspace of the finished network
+  static nn::Network& AddLayers(nn::Network& network, int in, int out, bool specialized)
+  {
+    if (specialized) {
+      network.AddLayer<nn::TanhActivation>(in);
+      network.AddLayer<nn::TanhActivation>(out);
+      network.AddLayer<nn::SigmoidActivation, nn::SquaredError>(out, 0, 1);
+    } else {
+      auto tanh = std::make_shared<nn::TanhActivation>();
+      network.AddLayer(in, tanh);
+      network.AddLayer(out, tanh);
+      network.AddLayer(out, std::make_shared<nn::SigmoidActivation>(0, 1));
+    }
+    network.AddDefaultConnections();
+    return network;
+  }
+
+  nn::Network network;
+  nn::train::NetworkTrainer ntr;
+  realmatrix input;
+  realmatrix target;
+  nn::train::BackpropTrainingParameters params;
+  nn::Workspace workspace;
+
+  std::vector<std::shared_ptr<nn::train::BackpropLayer>> bp_layers;
+  std::vector<std::shared_ptr<nn::train::BackpropConnection>> bp_connections;
+};
+
+
+
+// matrix kernels
+
+void BM_accum_A_BCt(benchmark::State& state, int batch, int in, int out)
+{
+  auto X = RandomMatrix(batch, in);
+  auto W = RandomMatrix(out, in);
+  auto A = RandomMatrix(batch, out);
+  for (auto _ : state) {
+    nn::accum_A_BCt(A, X, W);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*in*out, batch*in + out*in + 2.0*batch*out);
+}
+
+
+void BM_accum_A_BC(benchmark::State& state, int batch, int in, int out)
+{
+  auto D = RandomMatrix(batch, out);
+  auto W = RandomMatrix(out, in);
+  auto A = RandomMatrix(batch, in);
+  for (auto _ : state) {
+    nn::accum_A_BC(A, D, W);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*in*out, batch*out + out*in + 2.0*batch*in);
+}
+
+
+void BM_accum_A_BtC(benchmark::State& state, int batch, int in, int out)
+{
+  auto D = RandomMatrix(batch, out);
+  auto X = RandomMatrix(batch, in);
+  auto A = RandomMatrix(out, in);
+  for (auto _ : state) {
+    nn::accum_A_BtC(A, D, X);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*in*out, batch*out + batch*in + 2.0*out*in);
+}
+
+
+void BM_accum_y_Atx(benchmark::State& state, int batch, int, int out)
+{
+  auto D = RandomMatrix(batch, out);
+  auto x = RandomVector(batch);
+  auto y = RandomVector(out);
+  for (auto _ : state) {
+    nn::accum_y_Atx(y, D, x);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*out, batch*out + batch + 2.0*out);
+}
+
+
+void BM_accum_A_alphaB(benchmark::State& state, int, int in, int out)
+{
+  auto B = RandomMatrix(out, in);
+  auto A = RandomMatrix(out, in);
+  for (auto _ : state) {
+    nn::accum_A_alphaB(A, realscalar(1e-6), B);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*out*in, 3.0*out*in);
+}
+
+
+void BM_accum_y_alphax(benchmark::State& state, int, int, int out)
+{
+  auto x = RandomVector(out);
+  auto y = RandomVector(out);
+  for (auto _ : state) {
+    nn::accum_y_alphax(y, realscalar(1e-6), x);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*out, 3.0*out);
+}
+
+
+void BM_accum_A_xyT(benchmark::State& state, int, int in, int out)
+{
+  auto x = RandomVector(out);
+  auto y = RandomVector(in);
+  auto A = RandomMatrix(out, in);
+  for (auto _ : state) {
+    nn::accum_A_xyT(A, x, y);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 1.0*out*in, out + in + 1.0*out*in);
+}
+
+
+// one-hot style input, two non-zeros per row
+nn::realsparsematrix OneHot(int batch, int in)
+{
+  nn::realsparsematrix S(batch, in);
+  for (int row = 0; row < batch; ++row) {
+    realvector x(in, 0);
+    x[row % in] = 1;
+    x[(7*row + 3) % in] = 1;
+    S.SetRowValues(row, x);
+  }
+  return S;
+}
+
+
+void BM_accum_A_SBt(benchmark::State& state, int batch, int in, int out)
+{
+  auto S = OneHot(batch, in);
+  auto W = RandomMatrix(out, in);
+  auto A = RandomMatrix(batch, out);
+  for (auto _ : state) {
+    nn::accum_A_SBt(A, S, W);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*S.NonZeros()*out, 2.0*S.NonZeros() + S.NonZeros()*out + 2.0*batch*out);
+}
+
+
+void BM_accum_A_BtS(benchmark::State& state, int batch, int in, int out)
+{
+  auto S = OneHot(batch, in);
+  auto D = RandomMatrix(batch, out);
+  auto A = RandomMatrix(out, in);
+  for (auto _ : state) {
+    nn::accum_A_BtS(A, D, S);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*S.NonZeros()*out, 2.0*S.NonZeros() + batch*out + 2.0*S.NonZeros()*out);
+}
+
+
+void BM_Normalize(benchmark::State& state, int, int in, int out)
+{
+  auto A = RandomMatrix(out, in);
+  for (auto _ : state) {
+    A.Normalize();
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 3.0*out*in, 2.0*out*in);
+}
+
+
+void BM_NormalizeEachRow(benchmark::State& state, int, int in, int out)
+{
+  auto A = RandomMatrix(out, in);
+  for (auto _ : state) {
+    A.NormalizeEachRow(0.7);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 3.0*out*in, 2.0*out*in);
+}
+
+
+
+// layer and backprop steps
+
+void LayerCalculateActivation(benchmark::State& state, int batch, int in, int out, bool specialized)
+{
+  BackpropFixture fx(batch, in, out, specialized);
+  auto layer = fx.ntr.GetLayers()[1];
+  for (auto _ : state) {
+    layer->CalculateActivation();
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*in*out + 2.0*batch*out, batch*in + out*in + 3.0*batch*out);
+}
+
+
+void LayerTotalError(benchmark::State& state, int batch, int out, std::shared_ptr<nn::ErrorFunction> error_fn_use)
+{
+  BackpropFixture fx(batch, out, out, false, error_fn_use);
+  auto layer = fx.ntr.GetLayers()[2];
+  auto error_fn = fx.ntr.GetErrorFunction().get();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(layer->TotalError(fx.target, error_fn));
+  }
+  SetRates(state, 3.0*batch*out, 2.0*batch*out);
+}
+
+
+void BM_Layer_TotalError(benchmark::State& state, int batch, int, int out)
+{
+  LayerTotalError(state, batch, out, std::make_shared<nn::SquaredError>());
+}
+
+
+void BM_Layer_TotalError_CrossEntropy(benchmark::State& state, int batch, int, int out)
+{
+  LayerTotalError(state, batch, out, std::make_shared<nn::CrossEntropyError>());
+}
+
+
+// the whole in -> out -> out forward pass, through the Network and through
+// an InferenceModel compiled from it
+void BM_Network_FeedForward(benchmark::State& state, int batch, int in, int out)
+{
+  BackpropFixture fx(batch, in, out);
+  for (auto _ : state) {
+    fx.network.FeedForward(fx.input);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*out*(in + out), batch*in + out*(in + out) + 4.0*batch*out);
+}
+
+
+// a single pattern through a network sized for the full batch; the cost
+// shouldn't depend on the batch size
+void BM_Network_FeedForward_OneRow(benchmark::State& state, int batch, int in, int out)
+{
+  BackpropFixture fx(batch, in, out);
+  nn::constrealview row = nn::constrealview(fx.input).Row(0);
+  for (auto _ : state) {
+    fx.network.FeedForward(row);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*out*(in + out), in + out*(in + out) + 4.0*out);
+}
+
+
+// in -> four independent out-wide branches -> out, run one branch after
+// another or side by side on a pool of four threads
+void NetworkBranches(benchmark::State& state, int batch, int in, int out, int workers)
+{
+  const int branches = 4;
+  nn::Network network(batch, std::make_shared<nn::SquaredError>());
+  network.AddLayer(in, std::make_shared<nn::LinearActivation>());
+  for (int b = 0; b < branches; ++b) {
+    network.AddLayer<nn::TanhActivation>(out);
+    network.AddConnection(0, b + 1);
+  }
+  network.AddLayer<nn::LinearActivation>(out);
+  for (int b = 0; b < branches; ++b) {
+    network.AddConnection(b + 1, branches + 1);
+  }
+  if (workers > 0) {
+    network.SetThreadPool(std::make_shared<nn::utility::ThreadPool>(workers));
+  }
+
+  auto input = RandomMatrix(batch, in);
+  for (auto _ : state) {
+    network.FeedForward(input);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*branches*out*(in + out), batch*in + branches*out*(in + out) + 2.0*branches*batch*out);
+}
+
+
+void BM_Network_FeedForward_Branches(benchmark::State& state, int batch, int in, int out)
+{
+  NetworkBranches(state, batch, in, out, 0);
+}
+
+
+void BM_Network_FeedForward_Branches_Pool(benchmark::State& state, int batch, int in, int out)
+{
+  NetworkBranches(state, batch, in, out, 3);
+}
+
+
+// in -> out -> ... -> out, six layers after the input, whole or pipelined
+// in micro-batches of a sixteenth of the batch over four threads
+void NetworkDeep(benchmark::State& state, int batch, int in, int out, bool pipelined)
+{
+  const int depth = 6;
+  nn::Network network(batch, std::make_shared<nn::SquaredError>());
+  network.AddLayer(in, std::make_shared<nn::LinearActivation>());
+  for (int l = 0; l < depth; ++l) {
+    network.AddLayer<nn::TanhActivation>(out);
+  }
+  network.AddDefaultConnections();
+  if (pipelined) {
+    network.SetThreadPool(std::make_shared<nn::utility::ThreadPool>(3));
+    network.SetPipeline(std::max(1, batch/16));
+  }
+
+  auto input = RandomMatrix(batch, in);
+  for (auto _ : state) {
+    network.FeedForward(input);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*out*(in + (depth - 1)*out), batch*in + out*(in + (depth - 1)*out) + 2.0*depth*batch*out);
+}
+
+
+void BM_Network_FeedForward_Deep(benchmark::State& state, int batch, int in, int out)
+{
+  NetworkDeep(state, batch, in, out, false);
+}
+
+
+void BM_Network_FeedForward_Deep_Pipelined(benchmark::State& state, int batch, int in, int out)
+{
+  NetworkDeep(state, batch, in, out, true);
+}
+
+
+// in -> out -> out with 90% of the weights pruned, run from the sparse
+// weights or from the dense ones holding the zeros; the rates count only
+// the weights kept
+void NetworkPruned(benchmark::State& state, int batch, int in, int out, bool sparse)
+{
+  nn::Network network({ size_t(in), size_t(out), size_t(out) }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+  nn::train::NetworkTrainer ntr(network);
+  ntr.GetConnections()[0]->GetWeights() = RandomMatrix(out, in);
+  ntr.GetConnections()[1]->GetWeights() = RandomMatrix(out, out);
+  network.SetSparseBreakEven(sparse ? 1 : 0);
+  network.PruneToSparsity(0.9);
+
+  auto input = RandomMatrix(batch, in);
+  for (auto _ : state) {
+    network.FeedForward(input);
+    benchmark::ClobberMemory();
+  }
+  const double kept = 0.1*out*(in + out);
+  SetRates(state, 2.0*batch*kept, batch*in + (sparse ? 2 : 10)*kept + 4.0*batch*out);
+}
+
+
+void BM_Network_FeedForward_Pruned(benchmark::State& state, int batch, int in, int out)
+{
+  NetworkPruned(state, batch, in, out, true);
+}
+
+
+void BM_Network_FeedForward_Pruned_Dense(benchmark::State& state, int batch, int in, int out)
+{
+  NetworkPruned(state, batch, in, out, false);
+}
+
+
+// 16 steps of batch sequences through an Elman network with an out-wide
+// hidden layer and output
+void BM_SimpleRecurrentNetwork_FeedForward(benchmark::State& state, int batch, int in, int out)
+{
+  const int steps = 16;
+  nn::SimpleRecurrentNetwork network(in, out, out, batch, steps,
+                                     std::make_shared<nn::TanhActivation>(),
+                                     std::make_shared<nn::LinearActivation>(),
+                                     std::make_shared<nn::SquaredError>());
+  network.GetInputWeights() = RandomMatrix(out, in);
+  network.GetContextWeights() = RandomMatrix(out, out);
+  network.GetOutputWeights() = RandomMatrix(out, out);
+
+  auto input = RandomMatrix(steps*batch, in);
+  for (auto _ : state) {
+    network.ResetContext(batch);
+    network.FeedForward(input, steps);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*steps*batch*out*(in + 2*out), steps*batch*(in + 4.0*out) + out*(in + 2.0*out));
+}
+
+
+// single in-wide patterns from 8 closed-loop clients, coalesced into
+// batches of up to batch rows for an in -> out -> out network; reports the
+// latencies and the throughput the clients saw
+void BM_BatchingPredictor_Submit(benchmark::State& state, int batch, int in, int out)
+{
+  const int clients = 8, requests = 32;
+  nn::Network network({ size_t(in), size_t(out), size_t(out) }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+  nn::BatchingPredictor predictor(network, batch, std::chrono::microseconds(100));
+
+  auto input = RandomMatrix(64, in);
+  std::vector<nn::realvector> patterns;
+  for (int row = 0; row < input.Rows(); ++row) {
+    patterns.emplace_back(input.GetRowPtr(row), input.GetRowPtr(row) + in);
+  }
+
+  double p50 = 0, p99 = 0, rate = 0, batch_size = 0;
+  for (auto _ : state) {
+    auto stats = nn::GenerateLoad(predictor, patterns, clients, requests);
+    p50 += stats.p50_latency;
+    p99 += stats.p99_latency;
+    rate += stats.requests_per_second;
+    batch_size += stats.mean_batch_size;
+  }
+  const double n = state.iterations();
+  state.counters["p50_us"] = p50 / n;
+  state.counters["p99_us"] = p99 / n;
+  state.counters["requests/s"] = rate / n;
+  state.counters["mean_batch"] = batch_size / n;
+}
+
+
+void BM_InferenceModel_Predict(benchmark::State& state, int batch, int in, int out)
+{
+  BackpropFixture fx(batch, in, out);
+  nn::InferenceModel model(fx.network);
+  realmatrix output(batch, out, realmatrix::PaddedLd(out));
+  for (auto _ : state) {
+    model.Predict(fx.input, output);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*out*(in + out), batch*in + out*(in + out) + 4.0*batch*out);
+}
+
+
+// loading a saved in -> out -> out network, with the weights mapped or
+// copied; the bytes are those of the weights
+void NetworkLoad(benchmark::State& state, int in, int out, bool map_weights)
+{
+  const std::string file_name = "nn_bench.model";
+  {
+    BackpropFixture fx(1, in, out);
+    fx.network.Save(file_name);
+  }
+  for (auto _ : state) {
+    nn::Network network(file_name, 1, map_weights);
+    benchmark::DoNotOptimize(&network);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations() * double(out) * (in + out) * sizeof(realscalar)));
+  std::remove(file_name.c_str());
+}
+
+
+void BM_Network_Load(benchmark::State& state, int, int in, int out)
+{
+  NetworkLoad(state, in, out, true);
+}
+
+
+void BM_Network_Load_Copy(benchmark::State& state, int, int in, int out)
+{
+  NetworkLoad(state, in, out, false);
+}
+
+
+void BackpropLayerOutputDelta(benchmark::State& state, int batch, int out, bool specialized)
+{
+  BackpropFixture fx(batch, out, out, specialized);
+  for (auto _ : state) {
+    fx.bp_layers[2]->CalculateDelta(fx.target);
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 4.0*batch*out, 4.0*batch*out);
+}
+
+
+void BackpropLayerHiddenDelta(benchmark::State& state, int batch, int in, int out, bool specialized)
+{
+  BackpropFixture fx(batch, in, out, specialized);
+  for (auto _ : state) {
+    fx.bp_layers[1]->CalculateDelta();
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*out*out + 2.0*batch*out, 2.0*batch*out + out*out + 3.0*batch*out);
+}
+
+
+void BM_Layer_CalculateActivation(benchmark::State& state, int batch, int in, int out)
+{
+  LayerCalculateActivation(state, batch, in, out, false);
+}
+
+
+void BM_DenseLayer_CalculateActivation(benchmark::State& state, int batch, int in, int out)
+{
+  LayerCalculateActivation(state, batch, in, out, true);
+}
+
+
+void BM_BackpropLayer_OutputDelta(benchmark::State& state, int batch, int, int out)
+{
+  BackpropLayerOutputDelta(state, batch, out, false);
+}
+
+
+void BM_DenseBackpropLayer_OutputDelta(benchmark::State& state, int batch, int, int out)
+{
+  BackpropLayerOutputDelta(state, batch, out, true);
+}
+
+
+void BM_BackpropLayer_HiddenDelta(benchmark::State& state, int batch, int in, int out)
+{
+  BackpropLayerHiddenDelta(state, batch, in, out, false);
+}
+
+
+void BM_DenseBackpropLayer_HiddenDelta(benchmark::State& state, int batch, int in, int out)
+{
+  BackpropLayerHiddenDelta(state, batch, in, out, true);
+}
+
+
+void BM_BackpropLayer_Bias(benchmark::State& state, int batch, int in, int out)
+{
+  BackpropFixture fx(batch, in, out);
+  for (auto _ : state) {
+    fx.bp_layers[1]->AccumulateBiasGradient();
+    fx.bp_layers[1]->UpdateBias();
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*out + 2.0*out, batch*out + batch + 5.0*out);
+}
+
+
+void BM_BackpropConnection_AccumulateGradients(benchmark::State& state, int batch, int in, int out)
+{
+  BackpropFixture fx(batch, in, out);
+  for (auto _ : state) {
+    fx.bp_connections[0]->AccumulateGradients();
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 2.0*batch*in*out, batch*out + batch*in + 2.0*out*in);
+}
+
+
+void BM_BackpropConnection_UpdateWeights(benchmark::State& state, int batch, int in, int out)
+{
+  BackpropFixture fx(batch, in, out);
+  for (auto _ : state) {
+    fx.bp_connections[0]->UpdateWeights();
+    benchmark::ClobberMemory();
+  }
+  SetRates(state, 9.0*out*in, 6.0*out*in);
+}
+
+
+
+typedef void (*BenchmarkFn)(benchmark::State&, int, int, int);
+
+struct Entry
+{
+  const char* name;
+  BenchmarkFn fn;
+  bool batched;     // false if the batch size doesn't matter
+};
+
+const Entry benchmarks[] = {
+  { "accum_A_BCt", BM_accum_A_BCt, true },
+  { "accum_A_BC", BM_accum_A_BC, true },
+  { "accum_A_BtC", BM_accum_A_BtC, true },
+  { "accum_y_Atx", BM_accum_y_Atx, true },
+  { "accum_A_alphaB", BM_accum_A_alphaB, false },
+  { "accum_y_alphax", BM_accum_y_alphax, false },
+  { "accum_A_xyT", BM_accum_A_xyT, false },
+  { "accum_A_SBt", BM_accum_A_SBt, true },
+  { "accum_A_BtS", BM_accum_A_BtS, true },
+  { "Matrix::Normalize", BM_Normalize, false },
+  { "Matrix::NormalizeEachRow", BM_NormalizeEachRow, false },
+  { "Layer::CalculateActivation", BM_Layer_CalculateActivation, true },
+  { "DenseLayer::CalculateActivation", BM_DenseLayer_CalculateActivation, true },
+  { "Layer::TotalError", BM_Layer_TotalError, true },
+  { "Layer::TotalError/cross-entropy", BM_Layer_TotalError_CrossEntropy, true },
+  { "Network::FeedForward", BM_Network_FeedForward, true },
+  { "Network::FeedForward/one-row", BM_Network_FeedForward_OneRow, true },
+  { "Network::FeedForward/branches", BM_Network_FeedForward_Branches, true },
+  { "Network::FeedForward/branches-pool", BM_Network_FeedForward_Branches_Pool, true },
+  { "Network::FeedForward/deep", BM_Network_FeedForward_Deep, true },
+  { "Network::FeedForward/deep-pipelined", BM_Network_FeedForward_Deep_Pipelined, true },
+  { "Network::FeedForward/pruned", BM_Network_FeedForward_Pruned, true },
+  { "Network::FeedForward/pruned-dense", BM_Network_FeedForward_Pruned_Dense, true },
+  { "InferenceModel::Predict", BM_InferenceModel_Predict, true },
+  { "BatchingPredictor::Submit", BM_BatchingPredictor_Submit, true },
+  { "SimpleRecurrentNetwork::FeedForward", BM_SimpleRecurrentNetwork_FeedForward, true },
+  { "Network(file_name)", BM_Network_Load, false },
+  { "Network(file_name)/copy", BM_Network_Load_Copy, false },
+  { "BackpropLayer::CalculateDelta(target)", BM_BackpropLayer_OutputDelta, true },
+  { "BackpropLayer::CalculateDelta(target)/dense", BM_DenseBackpropLayer_OutputDelta, true },
+  { "BackpropLayer::CalculateDelta", BM_BackpropLayer_HiddenDelta, true },
+  { "BackpropLayer::CalculateDelta/dense", BM_DenseBackpropLayer_HiddenDelta, true },
+  { "BackpropLayer::Bias", BM_BackpropLayer_Bias, true },
+  { "BackpropConnection::AccumulateGradients", BM_BackpropConnection_AccumulateGradients, true },
+  { "BackpropConnection::UpdateWeights", BM_BackpropConnection_UpdateWeights, false },
+};
+
+
+void RegisterAll()
+{
+  for (auto& backend : nn::blas::AvailableBackends()) {
+    for (auto& entry : benchmarks) {
+      for (auto& shape : shapes) {
+        for (int batch : batch_sizes) {
+          if (!entry.batched && batch != batch_sizes[0]) {
+            continue;
+          }
+          auto fn = entry.fn;
+          int in = shape[0], out = shape[1];
+          std::string name = std::string(entry.name) + "/" + backend;
+          benchmark::RegisterBenchmark(name.c_str(),
+                                       [=](benchmark::State& state) {
+                                         nn::blas::SelectBackend(backend);
+                                         fn(state, batch, in, out);
+                                       })
+            ->Args({ batch, in, out })
+            ->ArgNames({ "batch", "in", "out" });
+        }
+      }
+    }
+  }
+}
+
+}
+
+
+
+int
+main(int argc, char* argv[])
+{
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  RegisterAll();
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
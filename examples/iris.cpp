@@ -1,5 +1,6 @@
 #include "../src/network.hpp"
 #include "../src/train.hpp"
+#include "../src/inference.hpp"
 #include "../src/input.hpp"
 
 #include "../src/trainingdata.hpp"
@@ -98,9 +99,9 @@ void IrisNetwork()
   }
 
   auto hid_act = std::make_shared<nn::TanhActivation>();
-  auto out_act = std::make_shared<nn::SigmoidActivation>(0, 1);
+  auto out_act = std::make_shared<nn::SoftmaxActivation>();
 
-  auto err_function = std::make_shared<nn::CrossEntropyError>();
+  auto err_function = std::make_shared<nn::CategoricalCrossEntropyError>();
 
   //nn::Network network({4, 240, 240, 3}, 151, hid_act, out_act, err_function);
   nn::Network network({ 4, 24, 24, 3 }, BATCH_SIZE, hid_act, out_act, err_function);
@@ -113,24 +114,33 @@ void IrisNetwork()
   network.Attach(&err_stats);
   network.Attach(&err_printer);
 
-  nn::train::BackpropTrainingParameters params{ 0.001, 0.9, 0, true, 100000, 0.1 };
+  nn::train::BackpropTrainingParameters params{ 0.001, 0.9, 0, true, 100000, 0.1, 10 };
 
   auto tr = std::make_unique<nn::train::BackpropTrainingAlgorithm>(network, params);
 
   tr->InitializeNetwork();
   tr->SetTrainingData(&training_data.Batches());
 
+  std::cout << "Network workspace:" << std::endl;
+  network.GetWorkspace().Report(std::cout);
+  std::cout << "Training workspace:" << std::endl;
+  tr->GetWorkspace().Report(std::cout);
+
   train_timer.Start();
   tr->Train();
   train_timer.Stop();
 
+  nn::InferenceModel model(network);
+  std::cout << "Inference model: " << model.ParameterBytes() << " bytes of parameters" << std::endl;
+
   for (const auto& batch : training_data.Batches()) {
     auto& in = batch.Input();
     auto& targ = batch.Output();
 
     std::cout << "Batch Size == " << in.Rows() << std::endl;
 
-    const auto& output = network.FeedForward(in);
+    nn::realmatrix output(in.Rows(), model.OutputSize());
+    model.Predict(in, output);
 
     for (int pattern = 0; pattern < output.Rows(); ++pattern) {
       //auto& in_p = input_encoder.Decode(in.GetRowValues(pattern));
@@ -144,7 +144,7 @@ PokemonNetwork()
   auto err_function = std::make_shared<nn::CrossEntropyError>();
 
   nn::Network network({ input_encoder.Length(), 290, 230, output_encoder.Length() }, BATCH_SIZE, hid_act, out_act, err_function);
-  nn::train::BackpropTrainingParameters params{ 0.0005, 0.5, 0, false, 10'000, 0.1 };
+  nn::train::BackpropTrainingParameters params{ 0.0005, 0.5, 0, false, 10'000, 0.1, 25 };
 
   //nn::ErrorStatistics<double> err_stats(10, network);
   nn::ErrorPrinter err_printer(25, network, &train_timer);
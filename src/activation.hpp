@@ -1,8 +1,13 @@
 #pragma once
 
+#include "matrix.hpp"
+#include "error.hpp"
+#include "fastmath.hpp"
+
 #include <algorithm>
 #include <numeric>
 #include <cmath>
+#include <cstddef>
 
 namespace nn
 {
@@ -12,8 +17,51 @@ namespace nn
 class ActivationFunction
 {
 public:
-  virtual double f(double x) const = 0;
-  virtual double df(double x, double fx) const = 0;
+  ActivationFunction() : accuracy(fastmath::Accuracy::Exact) {}
+  virtual ~ActivationFunction() {}
+
+  virtual realscalar f(realscalar x) const = 0;
+  virtual realscalar df(realscalar x, realscalar fx) const = 0;
+
+  // Batched versions, so a layer makes one virtual call per batch rather
+  // than one per element.  The defaults loop over f and df; the built-in
+  // activations override them with plain loops the compiler can vectorize.
+
+  // out[i] = f(in[i])
+  virtual void Apply(const realscalar* in, realscalar* out, size_t n) const
+  {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = f(in[i]);
+    }
+  }
+
+  // out[i] = df(x[i], fx[i])
+  virtual void Derivative(const realscalar* x, const realscalar* fx, realscalar* out, size_t n) const
+  {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = df(x[i], fx[i]);
+    }
+  }
+
+  // If this is the canonical activation for error_fn, so that
+  // dE(f(x), t) * f'(x) == scale * (f(x) - t), returns scale, otherwise 0.
+  // The trainer then computes the output delta directly from that.
+  virtual realscalar CanonicalDeltaScale(const ErrorFunction& error_fn) const { return 0; }
+
+  // If f'(x) is neg_slope for x <= 0 and pos_slope for x > 0, with f(x) > 0
+  // exactly when x > 0 (the ReLU family), returns true and the slopes.
+  // The trainer then selects the slope from the sign of the activation,
+  // so it needs no activation_df buffer and dead ReLU units get a zero
+  // delta without a multiply.
+  virtual bool StepDerivative(realscalar& neg_slope, realscalar& pos_slope) const { return false; }
+
+  // How closely Apply follows f; activations without an approximation
+  // ignore it.  f itself is always exact.
+  void SetAccuracy(fastmath::Accuracy accuracy_use) { accuracy = accuracy_use; }
+  fastmath::Accuracy GetAccuracy() const { return accuracy; }
+
+protected:
+  fastmath::Accuracy accuracy;
 };
 
 
@@ -21,28 +69,65 @@ public:
 class SigmoidActivation : public ActivationFunction
 {
 public:
-  SigmoidActivation(double min_val, double max_val, double slope = 1.0)
+  SigmoidActivation(realscalar min_val, realscalar max_val, realscalar slope = 1.0)
     : gamma(max_val - min_val),
       eta(-min_val),
       sigma(slope),
       sigma_over_gamma(sigma/gamma)
   {}
   
-  double f(double x) const override
+  realscalar f(realscalar x) const override
   {
     return (gamma/(1 + std::exp(-sigma*x)) - eta);
   }
 
-  double df(double x, double fx) const override
+  realscalar df(realscalar x, realscalar fx) const override
   {
     return sigma_over_gamma*(eta + fx)*(gamma - eta - fx);
   }
 
+  void Apply(const realscalar* in, realscalar* out, size_t n) const override
+  {
+    switch (accuracy) {
+    case fastmath::Accuracy::Exact: ApplyWith<fastmath::Accuracy::Exact>(in, out, n); break;
+    case fastmath::Accuracy::High:  ApplyWith<fastmath::Accuracy::High>(in, out, n);  break;
+    case fastmath::Accuracy::Fast:  ApplyWith<fastmath::Accuracy::Fast>(in, out, n);  break;
+    }
+  }
+
+  void Derivative(const realscalar* x, const realscalar* fx, realscalar* out, size_t n) const override
+  {
+    const realscalar g = gamma, e = eta, k = sigma_over_gamma;
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = k*(e + fx[i])*(g - e - fx[i]);
+    }
+  }
+
+  // the logistic function (min 0, max 1) with cross-entropy
+  realscalar CanonicalDeltaScale(const ErrorFunction& error_fn) const override
+  {
+    bool logistic = (gamma == 1 && eta == 0);
+    return (logistic && dynamic_cast<const CrossEntropyError*>(&error_fn)) ? sigma : 0;
+  }
+
+  realscalar MinValue() const { return -eta; }
+  realscalar MaxValue() const { return gamma - eta; }
+  realscalar Slope() const { return sigma; }
+
 private:
-  double gamma;
-  double eta;
-  double sigma;
-  const double sigma_over_gamma;
+  realscalar gamma;
+  realscalar eta;
+  realscalar sigma;
+
+  template <fastmath::Accuracy A>
+  void ApplyWith(const realscalar* in, realscalar* out, size_t n) const
+  {
+    const realscalar g = gamma, e = eta, s = sigma;
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = g*fastmath::Sigmoid<A>(s*in[i]) - e;
+    }
+  }
+  const realscalar sigma_over_gamma;
 };
 
 
@@ -50,13 +135,33 @@ private:
 class LinearActivation : public ActivationFunction
 {
 public:
-  explicit LinearActivation(double slope_use = 1.0) : slope(slope_use) {}
+  explicit LinearActivation(realscalar slope_use = 1.0) : slope(slope_use) {}
+
+  realscalar f(realscalar x) const override { return slope * x; }
+  realscalar df(realscalar x, realscalar fx) const override { return slope; }
+
+  void Apply(const realscalar* in, realscalar* out, size_t n) const override
+  {
+    const realscalar a = slope;
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = a*in[i];
+    }
+  }
 
-  double f(double x) const override { return slope * x; }
-  double df(double x, double fx) const override { return slope; }
+  void Derivative(const realscalar* x, const realscalar* fx, realscalar* out, size_t n) const override
+  {
+    std::fill_n(out, n, slope);
+  }
+
+  realscalar CanonicalDeltaScale(const ErrorFunction& error_fn) const override
+  {
+    return dynamic_cast<const SquaredError*>(&error_fn) ? slope : 0;
+  }
+
+  realscalar Slope() const { return slope; }
 
 private:
-  double slope;
+  realscalar slope;
 };
 
 
@@ -64,15 +169,212 @@ private:
 class TanhActivation : public ActivationFunction
 {
 public:
-  double f(double x) const override
+  realscalar f(realscalar x) const override
   {
-    return tanh(x);
+    return std::tanh(x);
   }
 
-  double df(double x, double fx) const override
+  realscalar df(realscalar x, realscalar fx) const override
   {
     return (1 - fx*fx);
   }
+
+  void Apply(const realscalar* in, realscalar* out, size_t n) const override
+  {
+    switch (accuracy) {
+    case fastmath::Accuracy::Exact: ApplyWith<fastmath::Accuracy::Exact>(in, out, n); break;
+    case fastmath::Accuracy::High:  ApplyWith<fastmath::Accuracy::High>(in, out, n);  break;
+    case fastmath::Accuracy::Fast:  ApplyWith<fastmath::Accuracy::Fast>(in, out, n);  break;
+    }
+  }
+
+  void Derivative(const realscalar* x, const realscalar* fx, realscalar* out, size_t n) const override
+  {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = 1 - fx[i]*fx[i];
+    }
+  }
+
+private:
+  template <fastmath::Accuracy A>
+  void ApplyWith(const realscalar* in, realscalar* out, size_t n) const
+  {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = fastmath::Tanh<A>(in[i]);
+    }
+  }
+};
+
+
+
+// max(0, x)
+class ReLUActivation : public ActivationFunction
+{
+public:
+  realscalar f(realscalar x) const override { return (x > 0) ? x : 0; }
+  realscalar df(realscalar x, realscalar fx) const override { return (x > 0) ? 1 : 0; }
+
+  void Apply(const realscalar* in, realscalar* out, size_t n) const override
+  {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = (in[i] > 0) ? in[i] : 0;
+    }
+  }
+
+  void Derivative(const realscalar* x, const realscalar* fx, realscalar* out, size_t n) const override
+  {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = (x[i] > 0) ? 1 : 0;
+    }
+  }
+
+  bool StepDerivative(realscalar& neg_slope, realscalar& pos_slope) const override
+  {
+    neg_slope = 0;
+    pos_slope = 1;
+    return true;
+  }
+};
+
+
+
+// x for x > 0, alpha*x otherwise
+class LeakyReLUActivation : public ActivationFunction
+{
+public:
+  explicit LeakyReLUActivation(realscalar alpha_use = 0.01) : alpha(alpha_use) {}
+
+  realscalar f(realscalar x) const override { return (x > 0) ? x : alpha*x; }
+  realscalar df(realscalar x, realscalar fx) const override { return (x > 0) ? 1 : alpha; }
+
+  void Apply(const realscalar* in, realscalar* out, size_t n) const override
+  {
+    const realscalar a = alpha;
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = (in[i] > 0) ? in[i] : a*in[i];
+    }
+  }
+
+  void Derivative(const realscalar* x, const realscalar* fx, realscalar* out, size_t n) const override
+  {
+    const realscalar a = alpha;
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = (x[i] > 0) ? 1 : a;
+    }
+  }
+
+  bool StepDerivative(realscalar& neg_slope, realscalar& pos_slope) const override
+  {
+    neg_slope = alpha;
+    pos_slope = 1;
+    return alpha >= 0;     // otherwise the sign of f(x) doesn't follow x
+  }
+
+  realscalar Alpha() const { return alpha; }
+
+private:
+  realscalar alpha;
+};
+
+
+
+// log(1 + e^x), a smooth ReLU.  f'(x) is the logistic function, which
+// follows from the activation as 1 - e^-f(x).
+class SoftplusActivation : public ActivationFunction
+{
+public:
+  realscalar f(realscalar x) const override
+  {
+    return fastmath::Softplus<fastmath::Accuracy::Exact>(x);
+  }
+
+  realscalar df(realscalar x, realscalar fx) const override
+  {
+    return -std::expm1(-fx);
+  }
+
+  void Apply(const realscalar* in, realscalar* out, size_t n) const override
+  {
+    switch (accuracy) {
+    case fastmath::Accuracy::Exact: ApplyWith<fastmath::Accuracy::Exact>(in, out, n); break;
+    case fastmath::Accuracy::High:  ApplyWith<fastmath::Accuracy::High>(in, out, n);  break;
+    case fastmath::Accuracy::Fast:  ApplyWith<fastmath::Accuracy::Fast>(in, out, n);  break;
+    }
+  }
+
+  void Derivative(const realscalar* x, const realscalar* fx, realscalar* out, size_t n) const override
+  {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = -std::expm1(-fx[i]);
+    }
+  }
+
+private:
+  template <fastmath::Accuracy A>
+  void ApplyWith(const realscalar* in, realscalar* out, size_t n) const
+  {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = fastmath::Softplus<A>(in[i]);
+    }
+  }
+};
+
+
+
+// Softmax over each row of a layer, for the output layer of a classifier
+// together with CategoricalCrossEntropyError.  It isn't elementwise, so
+// layers with this activation are SoftmaxLayers, which call ApplyRow once
+// per pattern.  f and df are only the elementwise parts: exp(x) and the
+// diagonal of the Jacobian, p(1 - p).
+class SoftmaxActivation : public ActivationFunction
+{
+public:
+  realscalar f(realscalar x) const override
+  {
+    return std::exp(x);
+  }
+
+  realscalar df(realscalar x, realscalar fx) const override
+  {
+    return fx*(1 - fx);
+  }
+
+  // the n values are a single row
+  void Apply(const realscalar* in, realscalar* out, size_t n) const override
+  {
+    ApplyRow(in, out, n);
+  }
+
+  // out = softmax(in), shifted by the row maximum so exp can't overflow.
+  // Returns log(sum(exp(in))), from which the loss follows without log(0).
+  realscalar ApplyRow(const realscalar* in, realscalar* out, size_t n) const
+  {
+    switch (accuracy) {
+    case fastmath::Accuracy::Exact: return ApplyRowWith<fastmath::Accuracy::Exact>(in, out, n);
+    case fastmath::Accuracy::High:  return ApplyRowWith<fastmath::Accuracy::High>(in, out, n);
+    case fastmath::Accuracy::Fast:  return ApplyRowWith<fastmath::Accuracy::Fast>(in, out, n);
+    }
+    return 0;
+  }
+
+private:
+  template <fastmath::Accuracy A>
+  realscalar ApplyRowWith(const realscalar* in, realscalar* out, size_t n) const
+  {
+    const realscalar max = *std::max_element(in, in + n);
+
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = fastmath::Exp<A>(in[i] - max);
+    }
+    const realscalar sum = std::accumulate(out, out + n, realscalar(0));
+
+    const realscalar scale = 1 / sum;
+    for (size_t i = 0; i < n; ++i) {
+      out[i] *= scale;
+    }
+
+    return max + std::log(sum);
+  }
 };
 
 
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <new>
+#include <limits>
+
+#include <cstddef>
+#include <cstdlib>
+
+#ifdef _WIN32
+#  include <malloc.h>
+#endif
+
+
+namespace nn
+{
+
+// Size of a cache line, and the widest vector register we target (AVX-512).
+const size_t CACHE_LINE_SIZE = 64;
+
+
+
+// Allocator returning storage aligned to an Alignment-byte boundary, so that
+// matrix rows can start on cache-line/vector boundaries.
+template <typename T, size_t Alignment = CACHE_LINE_SIZE>
+class AlignedAllocator
+{
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+  AlignedAllocator() {}
+
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(size_t n)
+  {
+    if (n == 0) {
+      return nullptr;
+    }
+    if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+      throw std::bad_alloc();
+    }
+
+    void* p = nullptr;
+#ifdef _WIN32
+    p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+    if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) {
+      p = nullptr;
+    }
+#endif
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t)
+  {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+};
+
+
+template <typename T, typename U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return true; }
+
+template <typename T, typename U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return false; }
+
+
+}
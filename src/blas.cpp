@@ -0,0 +1,111 @@
+#include "blas.hpp"
+
+#include <map>
+#include <iostream>
+
+#include <cstdlib>
+
+
+namespace nn
+{
+namespace blas
+{
+
+namespace
+{
+
+class Registry
+{
+public:
+  Registry()
+  {
+    auto cblas = MakeCblasBackend();
+    if (cblas) {
+      Add(cblas);
+    }
+    for (auto& native : MakeNativeBackends()) {
+      Add(native);
+    }
+
+    current = cblas ? cblas : backends["native"];
+
+    const char* requested = std::getenv("NN_BLAS_BACKEND");
+    if (requested && !Select(requested)) {
+      std::cerr << "Unknown BLAS backend " << requested
+                << ", using " << current->Name() << std::endl;
+    }
+  }
+
+  bool Select(const std::string& name)
+  {
+    auto p = backends.find(name);
+    if (p == backends.end()) {
+      return false;
+    }
+    current = p->second;
+    return true;
+  }
+
+  std::shared_ptr<const Backend> Get(const std::string& name) const
+  {
+    auto p = backends.find(name);
+    return (p == backends.end()) ? nullptr : p->second;
+  }
+
+  std::vector<std::string> Names() const { return order; }
+
+  const Backend& Current() const { return *current; }
+
+private:
+  std::map<std::string, std::shared_ptr<const Backend>> backends;
+  std::vector<std::string> order;
+  std::shared_ptr<const Backend> current;
+
+  void Add(std::shared_ptr<const Backend> backend)
+  {
+    backends.insert(std::make_pair(backend->Name(), backend));
+    order.push_back(backend->Name());
+  }
+};
+
+
+Registry& GetRegistry()
+{
+  static Registry registry;
+  return registry;
+}
+
+}
+
+
+
+std::vector<std::string>
+AvailableBackends()
+{
+  return GetRegistry().Names();
+}
+
+
+bool
+SelectBackend(const std::string& name)
+{
+  return GetRegistry().Select(name);
+}
+
+
+const Backend&
+CurrentBackend()
+{
+  return GetRegistry().Current();
+}
+
+
+std::shared_ptr<const Backend>
+GetBackend(const std::string& name)
+{
+  return GetRegistry().Get(name);
+}
+
+
+} // namespace blas
+} // namespace nn
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace nn
+{
+namespace blas
+{
+
+// The accum_* matrix operations are forwarded to a BLAS backend chosen at
+// run time.  Two kinds are available:
+//
+//   cblas     the CBLAS library the program was linked against (ATLAS,
+//             OpenBLAS, BLIS, MKL, ...); only present when built with
+//             NN_USE_CBLAS (always on Windows, where MKL is used).
+//   native    built-in kernels, compiled for generic x86-64, AVX2 and
+//             AVX-512 with the best one picked from the CPU at start up.
+//             native-generic, native-avx2 and native-avx512 force one ISA.
+//
+// The default is cblas when present, otherwise native.  Setting the
+// NN_BLAS_BACKEND environment variable overrides the default.
+//
+// All matrices are row major.
+
+enum Transpose { NoTrans, Trans };
+
+
+class Backend
+{
+public:
+  virtual ~Backend() {}
+
+  virtual std::string Name() const = 0;
+
+  // C = alpha op(A) op(B) + beta C, where C is m x n and the inner dimension is k
+  virtual void Gemm(Transpose trans_a, Transpose trans_b, int m, int n, int k,
+                    float alpha, const float* A, int lda, const float* B, int ldb,
+                    float beta, float* C, int ldc) const = 0;
+  virtual void Gemm(Transpose trans_a, Transpose trans_b, int m, int n, int k,
+                    double alpha, const double* A, int lda, const double* B, int ldb,
+                    double beta, double* C, int ldc) const = 0;
+
+  // y = alpha op(A) x + beta y, where A is m x n
+  virtual void Gemv(Transpose trans_a, int m, int n, float alpha, const float* A, int lda,
+                    const float* x, float beta, float* y) const = 0;
+  virtual void Gemv(Transpose trans_a, int m, int n, double alpha, const double* A, int lda,
+                    const double* x, double beta, double* y) const = 0;
+
+  // A += alpha x y^T, where A is m x n
+  virtual void Ger(int m, int n, float alpha, const float* x, const float* y, float* A, int lda) const = 0;
+  virtual void Ger(int m, int n, double alpha, const double* x, const double* y, double* A, int lda) const = 0;
+
+  // y += alpha x
+  virtual void Axpy(int n, float alpha, const float* x, float* y) const = 0;
+  virtual void Axpy(int n, double alpha, const double* x, double* y) const = 0;
+
+  // x *= alpha
+  virtual void Scal(int n, float alpha, float* x) const = 0;
+  virtual void Scal(int n, double alpha, double* x) const = 0;
+
+  // ||x||_2
+  virtual float Nrm2(int n, const float* x) const = 0;
+  virtual double Nrm2(int n, const double* x) const = 0;
+};
+
+
+// names of the backends usable on this machine
+std::vector<std::string> AvailableBackends();
+
+// makes name the backend used by the accum_* functions.  Returns false (and
+// keeps the current backend) if there is no such backend.  Not thread safe;
+// call it before training or inference starts.
+bool SelectBackend(const std::string& name);
+
+// backend currently used by the accum_* functions
+const Backend& CurrentBackend();
+
+// a backend by name, or nullptr, without selecting it
+std::shared_ptr<const Backend> GetBackend(const std::string& name);
+
+
+// factories used by the registry, one per translation unit
+std::shared_ptr<const Backend> MakeCblasBackend();  // nullptr without NN_USE_CBLAS
+std::vector<std::shared_ptr<const Backend>> MakeNativeBackends();
+
+
+} // namespace blas
+} // namespace nn
@@ -0,0 +1,105 @@
+#include "blas.hpp"
+
+#if defined(_WIN32) && !defined(NN_USE_CBLAS)
+#  define NN_USE_CBLAS
+#endif
+
+#ifdef NN_USE_CBLAS
+#  ifdef _WIN32
+#    include <mkl_cblas.h>
+#  else
+extern "C" {
+#    include <cblas.h>
+}
+#  endif
+#endif
+
+
+namespace nn
+{
+namespace blas
+{
+
+#ifdef NN_USE_CBLAS
+
+namespace
+{
+
+CBLAS_TRANSPOSE ToCblas(Transpose t) { return (t == Trans) ? CblasTrans : CblasNoTrans; }
+
+
+class CblasBackend : public Backend
+{
+public:
+  std::string Name() const override { return "cblas"; }
+
+  void Gemm(Transpose trans_a, Transpose trans_b, int m, int n, int k,
+            float alpha, const float* A, int lda, const float* B, int ldb,
+            float beta, float* C, int ldc) const override
+  {
+    cblas_sgemm(CblasRowMajor, ToCblas(trans_a), ToCblas(trans_b), m, n, k,
+                alpha, A, lda, B, ldb, beta, C, ldc);
+  }
+
+  void Gemm(Transpose trans_a, Transpose trans_b, int m, int n, int k,
+            double alpha, const double* A, int lda, const double* B, int ldb,
+            double beta, double* C, int ldc) const override
+  {
+    cblas_dgemm(CblasRowMajor, ToCblas(trans_a), ToCblas(trans_b), m, n, k,
+                alpha, A, lda, B, ldb, beta, C, ldc);
+  }
+
+  void Gemv(Transpose trans_a, int m, int n, float alpha, const float* A, int lda,
+            const float* x, float beta, float* y) const override
+  {
+    cblas_sgemv(CblasRowMajor, ToCblas(trans_a), m, n, alpha, A, lda, x, 1, beta, y, 1);
+  }
+
+  void Gemv(Transpose trans_a, int m, int n, double alpha, const double* A, int lda,
+            const double* x, double beta, double* y) const override
+  {
+    cblas_dgemv(CblasRowMajor, ToCblas(trans_a), m, n, alpha, A, lda, x, 1, beta, y, 1);
+  }
+
+  void Ger(int m, int n, float alpha, const float* x, const float* y, float* A, int lda) const override
+  {
+    cblas_sger(CblasRowMajor, m, n, alpha, x, 1, y, 1, A, lda);
+  }
+
+  void Ger(int m, int n, double alpha, const double* x, const double* y, double* A, int lda) const override
+  {
+    cblas_dger(CblasRowMajor, m, n, alpha, x, 1, y, 1, A, lda);
+  }
+
+  void Axpy(int n, float alpha, const float* x, float* y) const override { cblas_saxpy(n, alpha, x, 1, y, 1); }
+  void Axpy(int n, double alpha, const double* x, double* y) const override { cblas_daxpy(n, alpha, x, 1, y, 1); }
+
+  void Scal(int n, float alpha, float* x) const override { cblas_sscal(n, alpha, x, 1); }
+  void Scal(int n, double alpha, double* x) const override { cblas_dscal(n, alpha, x, 1); }
+
+  float Nrm2(int n, const float* x) const override { return cblas_snrm2(n, x, 1); }
+  double Nrm2(int n, const double* x) const override { return cblas_dnrm2(n, x, 1); }
+};
+
+}
+
+
+std::shared_ptr<const Backend>
+MakeCblasBackend()
+{
+  return std::make_shared<CblasBackend>();
+}
+
+#else
+
+std::shared_ptr<const Backend>
+MakeCblasBackend()
+{
+  return nullptr;
+}
+
+#endif
+
+
+} // namespace blas
+} // namespace nn
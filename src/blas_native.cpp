@@ -0,0 +1,384 @@
+#include "blas.hpp"
+#include "allocator.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define NN_NATIVE_X86
+#endif
+
+#if defined(__GNUC__)
+#  define NN_ALWAYS_INLINE inline __attribute__((always_inline))
+#  define NN_RESTRICT __restrict__
+#elif defined(_MSC_VER)
+#  define NN_ALWAYS_INLINE __forceinline
+#  define NN_RESTRICT __restrict
+#else
+#  define NN_ALWAYS_INLINE inline
+#  define NN_RESTRICT
+#endif
+
+
+namespace nn
+{
+namespace blas
+{
+namespace
+{
+
+// The kernels below are plain loops written so that the compiler can
+// vectorize them.  They are force-inlined into one set of entry points per
+// instruction set (see NN_NATIVE_KERNELS), so the same source is compiled
+// for SSE2, AVX2+FMA and AVX-512, and the backend picks one at run time.
+
+const int GEMM_ROW_BLOCK = 4;     // rows of C updated together
+const int GEMM_COL_BLOCK = 256;   // columns of C per block
+const int GEMM_DEPTH_BLOCK = 256; // inner dimension per block
+
+const int DOT_LANES = 16;         // independent partial sums in dot products
+
+
+// c + a*b, fused when the instruction set has FMA
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE T madd(T a, T b, T c) { return Fma ? std::fma(a, b, c) : c + a*b; }
+
+
+// y += alpha x
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE void axpy_kernel(int n, T alpha, const T* NN_RESTRICT x, T* NN_RESTRICT y)
+{
+  for (int i = 0; i < n; ++i) {
+    y[i] = madd<Fma>(alpha, x[i], y[i]);
+  }
+}
+
+
+// c0..c3 += a0..a3 * b
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE void axpy4_kernel(int n, T a0, T a1, T a2, T a3, const T* NN_RESTRICT b,
+                                   T* NN_RESTRICT c0, T* NN_RESTRICT c1,
+                                   T* NN_RESTRICT c2, T* NN_RESTRICT c3)
+{
+  for (int j = 0; j < n; ++j) {
+    const T bj = b[j];
+    c0[j] = madd<Fma>(a0, bj, c0[j]);
+    c1[j] = madd<Fma>(a1, bj, c1[j]);
+    c2[j] = madd<Fma>(a2, bj, c2[j]);
+    c3[j] = madd<Fma>(a3, bj, c3[j]);
+  }
+}
+
+
+// x . y, using separate partial sums so the loop vectorizes without
+// reassociating floating point math
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE T dot_kernel(int n, const T* NN_RESTRICT x, const T* NN_RESTRICT y)
+{
+  T partial[DOT_LANES] = {};
+  int i = 0;
+  for (; i + DOT_LANES <= n; i += DOT_LANES) {
+    for (int l = 0; l < DOT_LANES; ++l) {
+      partial[l] = madd<Fma>(x[i + l], y[i + l], partial[l]);
+    }
+  }
+  T sum = 0;
+  for (; i < n; ++i) {
+    sum = madd<Fma>(x[i], y[i], sum);
+  }
+  for (int l = 0; l < DOT_LANES; ++l) {
+    sum += partial[l];
+  }
+  return sum;
+}
+
+
+template <typename T>
+NN_ALWAYS_INLINE void scale_kernel(int n, T alpha, T* NN_RESTRICT x)
+{
+  if (alpha == T(0)) {
+    std::fill(x, x + n, T(0));  // also clears NaNs, as BLAS does for beta == 0
+  } else if (alpha != T(1)) {
+    for (int i = 0; i < n; ++i) {
+      x[i] *= alpha;
+    }
+  }
+}
+
+
+// C += alpha a(i, p) B for a rows x k block of A, where a(i, p) is
+// A[i*a_row + p*a_col] so that the same kernel reads A or A^T.
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE void gemm_block(int rows, int n, int k, T alpha,
+                                 const T* A, int a_row, int a_col,
+                                 const T* B, int ldb, T* C, int ldc)
+{
+  int i = 0;
+  for (; i + GEMM_ROW_BLOCK <= rows; i += GEMM_ROW_BLOCK) {
+    const T* a = A + i*a_row;
+    T* c = C + i*ldc;
+    for (int p = 0; p < k; ++p, a += a_col) {
+      axpy4_kernel<Fma>(n, alpha*a[0], alpha*a[a_row], alpha*a[2*a_row], alpha*a[3*a_row],
+                        B + p*ldb, c, c + ldc, c + 2*ldc, c + 3*ldc);
+    }
+  }
+  for (; i < rows; ++i) {
+    const T* a = A + i*a_row;
+    for (int p = 0; p < k; ++p, a += a_col) {
+      axpy_kernel<Fma>(n, alpha*a[0], B + p*ldb, C + i*ldc);
+    }
+  }
+}
+
+
+// C = alpha op(A) op(B) + beta C
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE void gemm_impl(Transpose trans_a, Transpose trans_b, int m, int n, int k,
+                                T alpha, const T* A, int lda, const T* B, int ldb,
+                                T beta, T* C, int ldc)
+{
+  for (int i = 0; i < m; ++i) {
+    scale_kernel(n, beta, C + i*ldc);
+  }
+  if (alpha == T(0) || k == 0) {
+    return;
+  }
+
+  // the blocked kernel streams rows of B, so B^T is packed first
+  thread_local std::vector<T, AlignedAllocator<T>> packed;
+  if (trans_b == Trans) {
+    packed.resize(size_t(k) * n);
+    for (int j = 0; j < n; ++j) {
+      const T* b = B + j*ldb;
+      for (int p = 0; p < k; ++p) {
+        packed[size_t(p)*n + j] = b[p];
+      }
+    }
+    B = packed.data();
+    ldb = n;
+  }
+
+  const int a_row = (trans_a == Trans) ? 1 : lda;
+  const int a_col = (trans_a == Trans) ? lda : 1;
+
+  for (int j0 = 0; j0 < n; j0 += GEMM_COL_BLOCK) {
+    const int nb = std::min(GEMM_COL_BLOCK, n - j0);
+    for (int p0 = 0; p0 < k; p0 += GEMM_DEPTH_BLOCK) {
+      const int kb = std::min(GEMM_DEPTH_BLOCK, k - p0);
+      gemm_block<Fma>(m, nb, kb, alpha, A + p0*a_col, a_row, a_col,
+                      B + p0*ldb + j0, ldb, C + j0, ldc);
+    }
+  }
+}
+
+
+// y = alpha op(A) x + beta y
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE void gemv_impl(Transpose trans_a, int m, int n, T alpha, const T* A, int lda,
+                                const T* x, T beta, T* y)
+{
+  if (trans_a == NoTrans) {
+    for (int i = 0; i < m; ++i) {
+      T yi = (beta == T(0)) ? T(0) : beta*y[i];
+      y[i] = madd<Fma>(alpha, dot_kernel<Fma>(n, A + i*lda, x), yi);
+    }
+  } else {
+    scale_kernel(n, beta, y);
+    for (int r = 0; r < m; ++r) {
+      axpy_kernel<Fma>(n, alpha*x[r], A + r*lda, y);
+    }
+  }
+}
+
+
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE void ger_impl(int m, int n, T alpha, const T* x, const T* y, T* A, int lda)
+{
+  for (int i = 0; i < m; ++i) {
+    axpy_kernel<Fma>(n, alpha*x[i], y, A + i*lda);
+  }
+}
+
+
+template <bool Fma, typename T>
+NN_ALWAYS_INLINE T nrm2_impl(int n, const T* x)
+{
+  T sum_sq = dot_kernel<Fma>(n, x, x);
+  if (std::isfinite(sum_sq) && sum_sq > std::numeric_limits<T>::min()) {
+    return std::sqrt(sum_sq);
+  }
+
+  // overflowed or underflowed: scale by the largest magnitude and retry
+  T scale = 0;
+  for (int i = 0; i < n; ++i) {
+    scale = std::max(scale, std::fabs(x[i]));
+  }
+  if (scale == T(0) || !std::isfinite(scale)) {
+    return scale;
+  }
+  T scaled_sq = 0;
+  for (int i = 0; i < n; ++i) {
+    T xi = x[i] / scale;
+    scaled_sq += xi*xi;
+  }
+  return scale * std::sqrt(scaled_sq);
+}
+
+
+// One set of entry points per instruction set.
+#define NN_NATIVE_KERNELS(ISA, FMA, TARGET)                                             \
+namespace ISA                                                                           \
+{                                                                                       \
+template <typename T> TARGET                                                            \
+void Gemm(Transpose trans_a, Transpose trans_b, int m, int n, int k, T alpha,           \
+          const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc)              \
+{                                                                                       \
+  gemm_impl<FMA>(trans_a, trans_b, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);       \
+}                                                                                       \
+template <typename T> TARGET                                                            \
+void Gemv(Transpose trans_a, int m, int n, T alpha, const T* A, int lda,                \
+          const T* x, T beta, T* y)                                                     \
+{                                                                                       \
+  gemv_impl<FMA>(trans_a, m, n, alpha, A, lda, x, beta, y);                             \
+}                                                                                       \
+template <typename T> TARGET                                                            \
+void Ger(int m, int n, T alpha, const T* x, const T* y, T* A, int lda)                  \
+{                                                                                       \
+  ger_impl<FMA>(m, n, alpha, x, y, A, lda);                                             \
+}                                                                                       \
+template <typename T> TARGET                                                            \
+void Axpy(int n, T alpha, const T* x, T* y) { axpy_kernel<FMA>(n, alpha, x, y); }       \
+template <typename T> TARGET                                                            \
+void Scal(int n, T alpha, T* x) { scale_kernel(n, alpha, x); }                          \
+template <typename T> TARGET                                                            \
+T Nrm2(int n, const T* x) { return nrm2_impl<FMA>(n, x); }                              \
+}
+
+NN_NATIVE_KERNELS(generic, false, )
+#ifdef NN_NATIVE_X86
+NN_NATIVE_KERNELS(avx2, true, __attribute__((target("avx2,fma"))))
+NN_NATIVE_KERNELS(avx512, true, __attribute__((target("avx512f,avx2,fma"))))
+#endif
+
+#undef NN_NATIVE_KERNELS
+
+
+
+// Kernel entry points for one scalar type.
+template <typename T>
+struct KernelTable
+{
+  void (*gemm)(Transpose, Transpose, int, int, int, T, const T*, int, const T*, int, T, T*, int);
+  void (*gemv)(Transpose, int, int, T, const T*, int, const T*, T, T*);
+  void (*ger)(int, int, T, const T*, const T*, T*, int);
+  void (*axpy)(int, T, const T*, T*);
+  void (*scal)(int, T, T*);
+  T    (*nrm2)(int, const T*);
+};
+
+// entry points of one instruction set
+#define NN_KERNEL_TABLE(ISA, T) \
+  KernelTable<T>{ ISA::Gemm<T>, ISA::Gemv<T>, ISA::Ger<T>, ISA::Axpy<T>, ISA::Scal<T>, ISA::Nrm2<T> }
+
+
+class NativeBackend : public Backend
+{
+public:
+  NativeBackend(const std::string& name_use, KernelTable<float> s_use, KernelTable<double> d_use)
+    : name(name_use),
+      s(s_use),
+      d(d_use)
+  {}
+
+  std::string Name() const override { return name; }
+
+  void Gemm(Transpose trans_a, Transpose trans_b, int m, int n, int k,
+            float alpha, const float* A, int lda, const float* B, int ldb,
+            float beta, float* C, int ldc) const override
+  {
+    s.gemm(trans_a, trans_b, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+  }
+
+  void Gemm(Transpose trans_a, Transpose trans_b, int m, int n, int k,
+            double alpha, const double* A, int lda, const double* B, int ldb,
+            double beta, double* C, int ldc) const override
+  {
+    d.gemm(trans_a, trans_b, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+  }
+
+  void Gemv(Transpose trans_a, int m, int n, float alpha, const float* A, int lda,
+            const float* x, float beta, float* y) const override
+  {
+    s.gemv(trans_a, m, n, alpha, A, lda, x, beta, y);
+  }
+
+  void Gemv(Transpose trans_a, int m, int n, double alpha, const double* A, int lda,
+            const double* x, double beta, double* y) const override
+  {
+    d.gemv(trans_a, m, n, alpha, A, lda, x, beta, y);
+  }
+
+  void Ger(int m, int n, float alpha, const float* x, const float* y, float* A, int lda) const override
+  {
+    s.ger(m, n, alpha, x, y, A, lda);
+  }
+
+  void Ger(int m, int n, double alpha, const double* x, const double* y, double* A, int lda) const override
+  {
+    d.ger(m, n, alpha, x, y, A, lda);
+  }
+
+  void Axpy(int n, float alpha, const float* x, float* y) const override { s.axpy(n, alpha, x, y); }
+  void Axpy(int n, double alpha, const double* x, double* y) const override { d.axpy(n, alpha, x, y); }
+
+  void Scal(int n, float alpha, float* x) const override { s.scal(n, alpha, x); }
+  void Scal(int n, double alpha, double* x) const override { d.scal(n, alpha, x); }
+
+  float Nrm2(int n, const float* x) const override { return s.nrm2(n, x); }
+  double Nrm2(int n, const double* x) const override { return d.nrm2(n, x); }
+
+private:
+  std::string name;
+  KernelTable<float> s;
+  KernelTable<double> d;
+};
+
+}
+
+
+
+std::vector<std::shared_ptr<const Backend>>
+MakeNativeBackends()
+{
+  std::vector<std::shared_ptr<const Backend>> backends;
+
+  KernelTable<float> best_s = NN_KERNEL_TABLE(generic, float);
+  KernelTable<double> best_d = NN_KERNEL_TABLE(generic, double);
+  backends.push_back(std::make_shared<NativeBackend>("native-generic", best_s, best_d));
+
+#ifdef NN_NATIVE_X86
+  __builtin_cpu_init();
+  const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (has_avx2) {
+    best_s = NN_KERNEL_TABLE(avx2, float);
+    best_d = NN_KERNEL_TABLE(avx2, double);
+    backends.push_back(std::make_shared<NativeBackend>("native-avx2", best_s, best_d));
+  }
+  if (has_avx2 && __builtin_cpu_supports("avx512f")) {
+    best_s = NN_KERNEL_TABLE(avx512, float);
+    best_d = NN_KERNEL_TABLE(avx512, double);
+    backends.push_back(std::make_shared<NativeBackend>("native-avx512", best_s, best_d));
+  }
+#endif
+
+  // "native" is whichever of the above suits this CPU best
+  backends.insert(backends.begin(), std::make_shared<NativeBackend>("native", best_s, best_d));
+  return backends;
+}
+
+
+} // namespace blas
+} // namespace nn
@@ -1,45 +1,152 @@
 #pragma once
 
+#include "matrix.hpp"
+#include "fastmath.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
 namespace nn
 {
 
+// sum of e(i), i < n, kept in SUM_LANES partial sums that are combined
+// pairwise at the end.  The lanes are independent, so the loop vectorizes
+// without reassociating floating point, and the error grows more slowly
+// than with one running sum.
+const size_t SUM_LANES = 8;
+
+template <typename Fn>
+inline double LaneSum(size_t n, Fn e)
+{
+  if (n < SUM_LANES) {
+    realscalar sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      sum += e(i);
+    }
+    return sum;
+  }
+
+  realscalar lanes[SUM_LANES] = {};
+
+  size_t i = 0;
+  for (; i + SUM_LANES <= n; i += SUM_LANES) {
+    for (size_t j = 0; j < SUM_LANES; ++j) {
+      lanes[j] += e(i + j);
+    }
+  }
+  for (size_t j = 0; i + j < n; ++j) {
+    lanes[j] += e(i + j);
+  }
+
+  for (size_t width = SUM_LANES/2; width > 0; width /= 2) {
+    for (size_t j = 0; j < width; ++j) {
+      lanes[j] += lanes[j + width];
+    }
+  }
+  return lanes[0];
+}
+
+
 class ErrorFunction
 {
 public:
-  virtual double E(double actual, double target) const = 0;
-  virtual double dE(double actual, double target) const = 0;
+  virtual ~ErrorFunction() {}
+
+  virtual realscalar E(realscalar actual, realscalar target) const = 0;
+  virtual realscalar dE(realscalar actual, realscalar target) const = 0;
+
+  // sum of E over n elements, for a row of a batch.  The built-in error
+  // functions override this with loops that inline E and vectorize.
+  virtual double Sum(const realscalar* actual, const realscalar* target, size_t n) const
+  {
+    return LaneSum(n, [=](size_t i) { return E(actual[i], target[i]); });
+  }
 };
 
 
 class SquaredError : public ErrorFunction
 {
-  double E(double actual, double target) const override
+public:
+  realscalar E(realscalar actual, realscalar target) const override
   {
     return 0.5*(actual - target)*(actual - target);
   }
 
-  double dE(double actual, double target) const override
+  realscalar dE(realscalar actual, realscalar target) const override
   {
     return (actual - target);
   }
+
+  double Sum(const realscalar* actual, const realscalar* target, size_t n) const override
+  {
+    return LaneSum(n, [=](size_t i) {
+      realscalar d = actual[i] - target[i];
+      return realscalar(0.5)*d*d;
+    });
+  }
 };
 
 class CrossEntropyError : public ErrorFunction
 {
-  double E(double actual, double target) const override
+public:
+  realscalar E(realscalar actual, realscalar target) const override
   {
     //if (fabs(actual - target) < 0.2) { return 0; }
-    return ((actual > 0) ? -target*log(actual) : 0) - (actual < 1  ? (1 - target)*log(1 - actual) : 0);
+    return ((actual > 0) ? -target*std::log(actual) : 0) - (actual < 1  ? (1 - target)*std::log(1 - actual) : 0);
   }
 
-  double dE(double actual, double target) const override
+  realscalar dE(realscalar actual, realscalar target) const override
   {
     //if (fabs(actual - target) < 0.2) { return 0; }
-    return (fabs(actual - 1) < TOLERANCE) ? 0.0
-                                          : (actual - target) / (actual*(1 - actual));
+    return (std::fabs(actual - 1) < TOLERANCE) ? 0.0
+                                               : (actual - target) / (actual*(1 - actual));
+  }
+  // as E, with the fastmath log; arguments below the smallest normal
+  // number are clamped to it
+  double Sum(const realscalar* actual, const realscalar* target, size_t n) const override
+  {
+    using fastmath::Accuracy;
+    const realscalar min_normal = fastmath::FloatTraits<realscalar>::min_normal;
+
+    return LaneSum(n, [=](size_t i) {
+      realscalar a = actual[i], t = target[i];
+      // log(1) = 0 stands in for the terms E leaves out
+      realscalar p = (a > 0) ? std::max(a, min_normal) : 1;
+      realscalar q = (a < 1) ? std::max(1 - a, min_normal) : 1;
+      return -t*fastmath::Log<Accuracy::High>(p) - (1 - t)*fastmath::Log<Accuracy::High>(q);
+    });
   }
+
 private:
-  double TOLERANCE = 1e-10;
+  realscalar TOLERANCE = 1e-10;
+};
+
+// -sum(t log p) over a row of class probabilities.  Meant for a softmax
+// output layer (SoftmaxLayer), which computes the loss from the net input
+// and the delta as p - t without calling these.
+class CategoricalCrossEntropyError : public ErrorFunction
+{
+public:
+  realscalar E(realscalar actual, realscalar target) const override
+  {
+    return (target != 0) ? -target*std::log(actual) : 0;
+  }
+
+  realscalar dE(realscalar actual, realscalar target) const override
+  {
+    return -target / actual;
+  }
+
+  double Sum(const realscalar* actual, const realscalar* target, size_t n) const override
+  {
+    const realscalar min_normal = fastmath::FloatTraits<realscalar>::min_normal;
+
+    return LaneSum(n, [=](size_t i) {
+      realscalar p = (target[i] != 0) ? std::max(actual[i], min_normal) : 1;
+      return -target[i]*fastmath::Log<fastmath::Accuracy::High>(p);
+    });
+  }
 };
 
 
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "matrix.hpp"
+
+#include <utility>
+
+namespace nn
+{
+namespace expr
+{
+
+// Lazily evaluated elementwise expressions over matrices.  Building an
+// expression only records the operands; assigning it to a matrix evaluates
+// the whole tree in one loop over the destination, so
+//
+//   delta = Map(dE, Ref(activation), Ref(target)) * Map(df, Ref(net_in), Ref(activation));
+//
+// reads each operand once and writes delta once, with no temporaries.  The
+// loops run row by row over the logical columns, so operands may have
+// different leading dimensions, and the destination may also be an operand.
+
+
+
+template <typename E>
+struct Expression
+{
+  const E& Self() const { return static_cast<const E&>(*this); }
+};
+
+
+// a matrix operand
+template <typename T>
+class Reference : public Expression<Reference<T>>
+{
+public:
+  typedef T ValueType;
+
+  explicit Reference(ConstMatrixView<T> m_use) : m(m_use) {}
+
+  T operator()(int row, int col) const { return m.GetRowPtr(row)[col]; }
+
+private:
+  ConstMatrixView<T> m;
+};
+
+
+// a constant
+template <typename T>
+class Scalar : public Expression<Scalar<T>>
+{
+public:
+  typedef T ValueType;
+
+  explicit Scalar(T value_use) : value(value_use) {}
+
+  T operator()(int, int) const { return value; }
+
+private:
+  T value;
+};
+
+
+// f(a(i, j))
+template <typename F, typename A>
+class UnaryMap : public Expression<UnaryMap<F, A>>
+{
+public:
+  typedef typename A::ValueType ValueType;
+
+  UnaryMap(F f_use, const A& a_use) : f(f_use), a(a_use) {}
+
+  ValueType operator()(int row, int col) const { return f(a(row, col)); }
+
+private:
+  F f;
+  A a;
+};
+
+
+// f(a(i, j), b(i, j))
+template <typename F, typename A, typename B>
+class BinaryMap : public Expression<BinaryMap<F, A, B>>
+{
+public:
+  typedef typename A::ValueType ValueType;
+
+  BinaryMap(F f_use, const A& a_use, const B& b_use) : f(f_use), a(a_use), b(b_use) {}
+
+  ValueType operator()(int row, int col) const { return f(a(row, col), b(row, col)); }
+
+private:
+  F f;
+  A a;
+  B b;
+};
+
+
+
+template <typename T> Reference<T> Ref(const Matrix<T>& m) { return Reference<T>(m); }
+template <typename T> Reference<T> Ref(MatrixView<T> m) { return Reference<T>(m); }
+template <typename T> Reference<T> Ref(MatrixView<const T> m) { return Reference<T>(m); }
+
+template <typename F, typename A>
+UnaryMap<F, A> Map(F f, const Expression<A>& a) { return UnaryMap<F, A>(f, a.Self()); }
+
+template <typename F, typename A, typename B>
+BinaryMap<F, A, B> Map(F f, const Expression<A>& a, const Expression<B>& b)
+{
+  return BinaryMap<F, A, B>(f, a.Self(), b.Self());
+}
+
+
+struct Plus       { template <typename T> T operator()(T x, T y) const { return x + y; } };
+struct Minus      { template <typename T> T operator()(T x, T y) const { return x - y; } };
+struct Multiplies { template <typename T> T operator()(T x, T y) const { return x * y; } };
+struct Divides    { template <typename T> T operator()(T x, T y) const { return x / y; } };
+
+
+#define nn_EXPRESSION_OPERATOR(op, Functor)                                             \
+  template <typename A, typename B>                                                     \
+  BinaryMap<Functor, A, B> operator op(const Expression<A>& a, const Expression<B>& b)  \
+  {                                                                                     \
+    return BinaryMap<Functor, A, B>(Functor(), a.Self(), b.Self());                     \
+  }                                                                                     \
+  template <typename A>                                                                 \
+  BinaryMap<Functor, A, Scalar<typename A::ValueType>>                                  \
+  operator op(const Expression<A>& a, typename A::ValueType s)                          \
+  {                                                                                     \
+    typedef Scalar<typename A::ValueType> S;                                            \
+    return BinaryMap<Functor, A, S>(Functor(), a.Self(), S(s));                         \
+  }                                                                                     \
+  template <typename B>                                                                 \
+  BinaryMap<Functor, Scalar<typename B::ValueType>, B>                                  \
+  operator op(typename B::ValueType s, const Expression<B>& b)                          \
+  {                                                                                     \
+    typedef Scalar<typename B::ValueType> S;                                            \
+    return BinaryMap<Functor, S, B>(Functor(), S(s), b.Self());                         \
+  }
+
+nn_EXPRESSION_OPERATOR(+, Plus)
+nn_EXPRESSION_OPERATOR(-, Minus)
+nn_EXPRESSION_OPERATOR(*, Multiplies)
+nn_EXPRESSION_OPERATOR(/, Divides)
+
+#undef nn_EXPRESSION_OPERATOR
+
+
+
+// dst(i, j) = e(i, j)
+template <typename T, typename E>
+void Assign(MatrixView<T> dst, const Expression<E>& e)
+{
+  const E& expr = e.Self();
+  const int rows = dst.Rows();
+  const int cols = dst.Cols();
+
+  for (int row = 0; row < rows; ++row) {
+    T* out = dst.GetRowPtr(row);
+    for (int col = 0; col < cols; ++col) {
+      out[col] = expr(row, col);
+    }
+  }
+}
+
+
+
+template <typename T> MatrixView<T> AsView(Matrix<T>& m) { return MatrixView<T>(m); }
+template <typename T> ConstMatrixView<T> AsView(const Matrix<T>& m) { return ConstMatrixView<T>(m); }
+template <typename T> MatrixView<T> AsView(MatrixView<T> m) { return m; }
+
+
+template <typename F, typename... Ptrs>
+void ForEachInRow(F& f, int cols, Ptrs... ptrs)
+{
+  for (int col = 0; col < cols; ++col) {
+    f(ptrs[col]...);
+  }
+}
+
+
+// f(a(i, j), b(i, j), ...) for every element, for updates that write more
+// than one matrix in the same pass.  f takes the elements by reference.
+template <typename F, typename First, typename... Rest>
+void ForEach(F f, First&& first, Rest&&... rest)
+{
+  auto a = AsView(first);
+  const int rows = a.Rows();
+  const int cols = a.Cols();
+
+  for (int row = 0; row < rows; ++row) {
+    ForEachInRow(f, cols, a.GetRowPtr(row), AsView(rest).GetRowPtr(row)...);
+  }
+}
+
+
+} // namespace expr
+
+
+
+template <typename T>
+template <typename E>
+Matrix<T>& Matrix<T>::operator=(const expr::Expression<E>& e)
+{
+  expr::Assign(MatrixView<T>(*this), e);
+  return *this;
+}
+
+
+} // namespace nn
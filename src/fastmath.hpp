@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace nn
+{
+namespace fastmath
+{
+
+// How closely the activation functions follow libm.  The approximations
+// are branch-free polynomials, so loops over them vectorize.
+enum class Accuracy
+{
+  Exact,   // libm
+  High,    // relative error ~1e-7
+  Fast     // relative error ~1e-4
+};
+
+
+
+template <typename T> struct FloatTraits;
+
+template <> struct FloatTraits<float>
+{
+  typedef uint32_t IntType;
+  static const int mantissa_bits = 23;
+  static const int exponent_bias = 127;
+  static constexpr float round_shift = 12582912.0f;   // 1.5 * 2^23
+  static constexpr float max_arg = 87.0f;
+  static constexpr float min_arg = -87.0f;
+  static constexpr float int_shift = 8388608.0f;      // 2^23
+  static constexpr float min_normal = 1.17549435e-38f;
+};
+
+template <> struct FloatTraits<double>
+{
+  typedef uint64_t IntType;
+  static const int mantissa_bits = 52;
+  static const int exponent_bias = 1023;
+  static constexpr double round_shift = 6755399441055744.0;   // 1.5 * 2^52
+  static constexpr double max_arg = 708.0;
+  static constexpr double min_arg = -708.0;
+  static constexpr double int_shift = 4503599627370496.0;   // 2^52
+  static constexpr double min_normal = 2.2250738585072014e-308;
+};
+
+
+
+// Taylor polynomial of e^r of the given degree, |r| <= ln(2)/2
+template <int Degree, typename T> inline T ExpPoly(T r);
+
+template <> inline float ExpPoly<4>(float r)
+{
+  return 1 + r*(1 + r*(1.0f/2 + r*(1.0f/6 + r*(1.0f/24))));
+}
+
+template <> inline double ExpPoly<4>(double r)
+{
+  return 1 + r*(1 + r*(1.0/2 + r*(1.0/6 + r*(1.0/24))));
+}
+
+template <> inline float ExpPoly<6>(float r)
+{
+  return 1 + r*(1 + r*(1.0f/2 + r*(1.0f/6 + r*(1.0f/24 + r*(1.0f/120 + r*(1.0f/720))))));
+}
+
+template <> inline double ExpPoly<6>(double r)
+{
+  return 1 + r*(1 + r*(1.0/2 + r*(1.0/6 + r*(1.0/24 + r*(1.0/120 + r*(1.0/720))))));
+}
+
+
+// e^x = 2^n e^r with n = round(x / ln 2), r = x - n ln 2.  Arguments are
+// clamped to the range where 2^n is a normal number.
+template <int Degree, typename T>
+inline T ExpApprox(T x)
+{
+  typedef FloatTraits<T> Traits;
+  typedef typename Traits::IntType IntType;
+
+  const T log2e  = T(1.4426950408889634);
+  const T ln2_hi = T(0.693145751953125);
+  const T ln2_lo = T(1.4286068203094172e-06);
+
+  const T min_arg = Traits::min_arg;
+  const T max_arg = Traits::max_arg;
+  const T round_shift = Traits::round_shift;
+
+  x = (x < min_arg) ? min_arg : x;
+  x = (x > max_arg) ? max_arg : x;
+
+  // adding round_shift rounds x / ln 2 to an integer n held in the low
+  // mantissa bits, so 2^n can be built from those bits without a
+  // float-to-int conversion (which doesn't vectorize for double before AVX-512)
+  T shifted = x*log2e + round_shift;
+  T n = shifted - round_shift;
+  T r = (x - n*ln2_hi) - n*ln2_lo;
+
+  IntType bits;
+  std::memcpy(&bits, &shifted, sizeof(bits));
+  bits = (bits + Traits::exponent_bias) << Traits::mantissa_bits;
+  T scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+
+  return ExpPoly<Degree>(r) * scale;
+}
+
+
+
+// log(x) = k ln 2 + log(m) with m in [sqrt(1/2), sqrt(2)), and
+// log(m) = 2 atanh(s), s = (m - 1)/(m + 1), as an odd series in s.  Only
+// for positive normal x; callers clamp.
+template <int Terms, typename T>
+inline T LogApprox(T x)
+{
+  typedef FloatTraits<T> Traits;
+  typedef typename Traits::IntType IntType;
+
+  const IntType one = 1;
+  const IntType mantissa_mask = (one << Traits::mantissa_bits) - 1;
+  const IntType exponent_mask = (IntType(2*Traits::exponent_bias + 1)) << Traits::mantissa_bits;
+
+  IntType bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+
+  // m in [1, 2), and the biased exponent as a float: OR-ing it into the
+  // mantissa of 2^mantissa_bits avoids an int-to-float conversion
+  IntType m_bits = (bits & mantissa_mask) | (IntType(Traits::exponent_bias) << Traits::mantissa_bits);
+  IntType k_bits = ((bits & exponent_mask) >> Traits::mantissa_bits) | (IntType(Traits::exponent_bias + Traits::mantissa_bits) << Traits::mantissa_bits);
+  T m, k;
+  std::memcpy(&m, &m_bits, sizeof(m));
+  std::memcpy(&k, &k_bits, sizeof(k));
+  k = k - Traits::int_shift - Traits::exponent_bias;
+
+  const T sqrt2 = T(1.4142135623730951);
+  k = (m > sqrt2) ? k + 1 : k;
+  m = (m > sqrt2) ? m*T(0.5) : m;
+
+  const T s = (m - 1) / (m + 1);
+  const T s2 = s*s;
+  T series = T(1) / (2*Terms - 1);
+  for (int j = Terms - 1; j > 0; --j) {
+    series = T(1) / (2*j - 1) + s2*series;
+  }
+
+  const T ln2 = T(0.6931471805599453);
+  return k*ln2 + 2*s*series;
+}
+
+
+
+template <Accuracy A, typename T> inline T Exp(T x);
+
+template <> inline float  Exp<Accuracy::Exact>(float x)  { return std::exp(x); }
+template <> inline double Exp<Accuracy::Exact>(double x) { return std::exp(x); }
+template <> inline float  Exp<Accuracy::High>(float x)   { return ExpApprox<6>(x); }
+template <> inline double Exp<Accuracy::High>(double x)  { return ExpApprox<6>(x); }
+template <> inline float  Exp<Accuracy::Fast>(float x)   { return ExpApprox<4>(x); }
+template <> inline double Exp<Accuracy::Fast>(double x)  { return ExpApprox<4>(x); }
+
+
+// 1 / (1 + e^-x)
+template <Accuracy A, typename T>
+inline T Sigmoid(T x)
+{
+  return 1 / (1 + Exp<A>(-x));
+}
+
+
+// tanh(x) = 1 - 2/(e^2x + 1), which cancels to nothing near 0, so for
+// |x| < 1/2 the odd Taylor series x + x^3 p(x^2) with the given number of
+// terms instead.  Both are computed and one selected, which vectorizes.
+template <Accuracy A, int Terms, typename T>
+inline T TanhApprox(T x)
+{
+  static const double coeffs[] = { 1.0, -1.0/3, 2.0/15, -17.0/315, 62.0/2835, -1382.0/155925,
+                                   21844.0/6081075, -929569.0/638512875 };
+  static_assert(Terms <= 8, "TanhApprox has coefficients for 8 terms");
+
+  const T x2 = x*x;
+  T series = T(coeffs[Terms - 1]);
+  for (int j = Terms - 2; j >= 0; --j) {
+    series = T(coeffs[j]) + x2*series;
+  }
+
+  const T large = 1 - 2 / (Exp<A>(2*x) + 1);
+  return (std::fabs(x) < T(0.5)) ? x*series : large;
+}
+
+
+template <Accuracy A, typename T> inline T Tanh(T x);
+
+template <> inline float  Tanh<Accuracy::Exact>(float x)  { return std::tanh(x); }
+template <> inline double Tanh<Accuracy::Exact>(double x) { return std::tanh(x); }
+template <> inline float  Tanh<Accuracy::High>(float x)   { return TanhApprox<Accuracy::High, 8>(x); }
+template <> inline double Tanh<Accuracy::High>(double x)  { return TanhApprox<Accuracy::High, 8>(x); }
+template <> inline float  Tanh<Accuracy::Fast>(float x)   { return TanhApprox<Accuracy::Fast, 5>(x); }
+template <> inline double Tanh<Accuracy::Fast>(double x)  { return TanhApprox<Accuracy::Fast, 5>(x); }
+
+
+// x > 0
+template <Accuracy A, typename T> inline T Log(T x);
+
+template <> inline float  Log<Accuracy::Exact>(float x)  { return std::log(x); }
+template <> inline double Log<Accuracy::Exact>(double x) { return std::log(x); }
+template <> inline float  Log<Accuracy::High>(float x)   { return LogApprox<5>(x); }
+template <> inline double Log<Accuracy::High>(double x)  { return LogApprox<6>(x); }
+template <> inline float  Log<Accuracy::Fast>(float x)   { return LogApprox<3>(x); }
+template <> inline double Log<Accuracy::Fast>(double x)  { return LogApprox<3>(x); }
+
+
+
+// log(1 + e^x) = max(x, 0) + log1p(e^-|x|).  The approximate tiers take
+// log1p(e) as log(u) e / (u - 1) with u = 1 + e, which cancels the
+// rounding of u, and as e itself where u rounds to 1.
+template <Accuracy A, typename T>
+inline T Softplus(T x)
+{
+  const T e = Exp<A>(-std::fabs(x));
+  const T u = 1 + e;
+  const T log1p_e = (u == 1) ? e : Log<A>(u) * e / (u - 1);
+  return ((x > 0) ? x : 0) + log1p_e;
+}
+
+template <> inline float  Softplus<Accuracy::Exact>(float x)  { return std::max(x, 0.0f) + std::log1p(std::exp(-std::fabs(x))); }
+template <> inline double Softplus<Accuracy::Exact>(double x) { return std::max(x, 0.0) + std::log1p(std::exp(-std::fabs(x))); }
+
+
+} // namespace fastmath
+} // namespace nn
@@ -0,0 +1,221 @@
+#include "inference.hpp"
+#include "network.hpp"
+
+#include <algorithm>
+#include <string>
+
+namespace nn
+{
+
+
+
+InferenceModel::InferenceModel(const Network& network, bool copy_parameters)
+  : input_size(0),
+    widest(0)
+{
+  const auto& layers = network.layers;
+  if (layers.size() < 2) {
+    throw "InferenceModel needs at least an input and an output layer.";
+  }
+  input_size = layers[0]->Size();
+
+  // the copies are registered with the workspace, so they mustn't move
+  stages.reserve(layers.size() - 1);
+
+  for (size_t l = 1; l < layers.size(); ++l) {
+    const Layer* layer = layers[l].get();
+    if (layer->incoming.size() != 1 || layer->incoming[0]->layer_from != layers[l - 1].get()) {
+      throw "InferenceModel needs a layered network: one connection into each layer, from the layer before.";
+    }
+
+    const Connection& connection = *layer->incoming[0];
+    const auto& weights = connection.weights;
+    const bool sparse = connection.UsesSparseWeights();
+    auto act_fn = layer->GetActivationFunction();
+    stages.push_back({ copy_parameters && !sparse ? realmatrix(weights) : realmatrix(0, 0),
+                       copy_parameters ? realmatrix(layer->bias) : realmatrix(0, 0),
+                       copy_parameters && sparse ? connection.sparse_weights : realsparsematrix(0, 0),
+                       constrealview(weights),
+                       constrealview(layer->bias),
+                       sparse ? &connection.sparse_weights : nullptr,
+                       act_fn,
+                       dynamic_cast<const SoftmaxActivation*>(act_fn.get()) });
+    widest = std::max(widest, layer->Size());
+  }
+
+  if (copy_parameters) {
+    for (size_t s = 0; s < stages.size(); ++s) {
+      if (!stages[s].sparse_weights) {
+        parameters.Add("layer" + std::to_string(s + 1) + ".weights", stages[s].own_weights);
+      }
+      parameters.Add("layer" + std::to_string(s + 1) + ".bias", stages[s].own_bias);
+    }
+    parameters.Allocate();
+    for (auto& stage : stages) {
+      if (stage.sparse_weights) {
+        stage.weights = constrealview(nullptr, stage.weights.Rows(), stage.weights.Cols());
+        stage.sparse_weights = &stage.own_sparse_weights;
+      } else {
+        stage.weights = constrealview(stage.own_weights);
+      }
+      stage.bias = constrealview(stage.own_bias);
+    }
+  }
+
+  default_context.reset(new ExecutionContext(*this));
+}
+
+
+
+ExecutionContext::ExecutionContext(const InferenceModel& model, int rows)
+  : widest(model.WidestLayer()),
+    scratch{ realmatrix(0, 0), realmatrix(0, 0) }
+{
+  Reserve(rows);
+}
+
+
+
+void
+ExecutionContext::Reserve(int rows)
+{
+  if (scratch[0].Rows() < rows) {
+    for (auto& s : scratch) {
+      s = realmatrix(rows, widest, realmatrix::PaddedLd(widest));
+    }
+  }
+}
+
+
+
+void
+InferenceModel::AddBiasAndActivate(const Stage& stage, realview y, bool whole_rows) const
+{
+  const int size = y.Cols();
+  const realscalar* b = stage.bias.GetRowPtr(0);
+
+  for (int row = 0; row < y.Rows(); ++row) {
+    realscalar* x = y.GetRowPtr(row);
+    for (int col = 0; col < size; ++col) {
+      x[col] += b[col];
+    }
+    if (stage.softmax) {
+      stage.softmax->ApplyRow(x, x, size);
+    } else if (!whole_rows) {
+      stage.activation_fn->Apply(x, x, size);
+    }
+  }
+
+  // the scratch padding is ours, so apply it in one call like
+  // Layer::CalculateActivation
+  if (!stage.softmax && whole_rows) {
+    stage.activation_fn->Apply(y.GetPtr(), y.GetPtr(), y.Rows() * y.LeadingDim());
+  }
+}
+
+
+
+namespace
+{
+
+void Clear(realview y)
+{
+  for (int row = 0; row < y.Rows(); ++row) {
+    std::fill_n(y.GetRowPtr(row), y.Cols(), realscalar(0));
+  }
+}
+
+// y = x W^T, from the dense or the sparse weights
+void Multiply(realview y, constrealview x, constrealview weights, const realsparsematrix* sparse_weights)
+{
+  if (sparse_weights) {
+    Clear(y);
+    accum_A_BSt(y, x, *sparse_weights);
+  } else {
+    set_A_BCt(y, x, weights);
+  }
+}
+
+// the model has no dense copy of sparse weights, so a sparse batch for
+// those is expanded first
+void Multiply(realview y, const realsparsematrix& in, constrealview weights, const realsparsematrix* sparse_weights)
+{
+  if (sparse_weights) {
+    Multiply(y, constrealview(in.ToDense()), weights, sparse_weights);
+    return;
+  }
+  Clear(y);
+  accum_A_SBt(y, in, weights);
+}
+
+}
+
+
+
+template <typename Input>
+void
+InferenceModel::Run(ExecutionContext& context, const Input& in, realview out) const
+{
+  const int rows = in.Rows();
+  if (in.Cols() != input_size || out.Cols() != OutputSize() || out.Rows() != rows) {
+    throw "InferenceModel::Predict: input or output has the wrong shape.";
+  }
+  if (context.widest < widest) {
+    throw "InferenceModel::Predict: the context was made for a smaller model.";
+  }
+  if (rows == 0) {
+    return;
+  }
+  context.Reserve(rows);
+  realmatrix* scratch = context.scratch;
+
+  // layer s writes into scratch[s % 2], the last one straight into out
+  constrealview x(nullptr, 0, 0);
+  for (size_t s = 0; s < stages.size(); ++s) {
+    const Stage& stage = stages[s];
+    const bool last = (s + 1 == stages.size());
+    realview y = last ? out : realview(scratch[s % 2].GetPtr(), rows, stage.weights.Rows(), scratch[s % 2].LeadingDim());
+
+    if (s == 0) {
+      Multiply(y, in, stage.weights, stage.sparse_weights);
+    } else {
+      Multiply(y, x, stage.weights, stage.sparse_weights);
+    }
+    AddBiasAndActivate(stage, y, !last);
+
+    x = y;
+  }
+}
+
+
+
+void
+InferenceModel::Predict(ExecutionContext& context, constrealview in, realview out) const
+{
+  Run(context, in, out);
+}
+
+
+
+void
+InferenceModel::Predict(ExecutionContext& context, const realsparsematrix& in, realview out) const
+{
+  Run(context, in, out);
+}
+
+
+
+size_t
+InferenceModel::ParameterBytes() const
+{
+  size_t bytes = parameters.Bytes();
+  for (const auto& stage : stages) {
+    if (stage.sparse_weights == &stage.own_sparse_weights) {
+      bytes += stage.own_sparse_weights.Bytes();
+    }
+  }
+  return bytes;
+}
+
+
+}
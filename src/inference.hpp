@@ -0,0 +1,116 @@
+#pragma once
+
+#include "matrix.hpp"
+#include "sparse.hpp"
+#include "workspace.hpp"
+#include "activation.hpp"
+
+#include <memory>
+#include <vector>
+#include <iostream>
+
+namespace nn
+{
+
+class Network;
+class InferenceModel;
+
+
+
+// The per-thread (or per-request) state of an InferenceModel: the two
+// scratch buffers, sized by the widest layer, that the layers ping-pong
+// between.  They grow to the largest row count seen.  Each thread scores
+// with its own context, so any number of threads can call Predict on one
+// model at once without locks.
+class ExecutionContext
+{
+  friend class InferenceModel;
+
+public:
+  explicit ExecutionContext(const InferenceModel& model, int rows = 1);
+
+  int Rows() const { return scratch[0].Rows(); }     // without growing
+  size_t Bytes() const { return (scratch[0].StorageSize() + scratch[1].StorageSize()) * sizeof(realscalar); }
+
+private:
+  int widest;
+  realmatrix scratch[2];
+
+  void Reserve(int rows);
+};
+
+
+
+// A frozen, read-only copy of a trained, layered Network for scoring.  It
+// keeps only the weights and biases, packed one after another in a single
+// arena; everything that changes during a forward pass lives in an
+// ExecutionContext.  Each layer is one GEMM that overwrites its output,
+// followed by a single pass that adds the bias and applies the activation,
+// so there is no net_input to keep and no observers or epoch state.
+// Connections the network runs from sparse weights (see Connection::Prune)
+// keep only those here, and their layers use the sparse kernel.
+//
+// By default later changes to the Network don't affect the model.  With
+// copy_parameters false the model uses the network's own weights and
+// biases instead, e.g. those mapped from a model file; the network must
+// then outlive the model, and not be trained or have its workspace
+// replanned while the model is in use.
+class InferenceModel
+{
+public:
+  explicit InferenceModel(const Network& network, bool copy_parameters = true);
+
+  InferenceModel(const InferenceModel&) = delete;
+  InferenceModel& operator=(const InferenceModel&) = delete;
+
+  // out = the network's output for in, for any number of rows.  in has
+  // InputSize() columns; out has as many rows as in and OutputSize()
+  // columns.  Safe to call from many threads at once, each with its own
+  // context.
+  void Predict(ExecutionContext& context, constrealview in, realview out) const;
+  void Predict(ExecutionContext& context, const realsparsematrix& in, realview out) const;
+
+  // as above, with a context owned by the model; one thread at a time
+  void Predict(constrealview in, realview out) { Predict(*default_context, in, out); }
+  void Predict(const realsparsematrix& in, realview out) { Predict(*default_context, in, out); }
+
+  int InputSize() const { return input_size; }
+  int OutputSize() const { return stages.back().weights.Rows(); }
+  size_t NumLayers() const { return stages.size() + 1; }
+  int WidestLayer() const { return widest; }
+
+  // bytes of weights and biases held by the model itself; 0 if it uses
+  // the network's
+  size_t ParameterBytes() const;
+
+  void Report(std::ostream& out) const { parameters.Report(out); }
+
+private:
+  struct Stage
+  {
+    realmatrix own_weights;     // the copies, if the model has them
+    realmatrix own_bias;
+    realsparsematrix own_sparse_weights;
+    constrealview weights;      // layer size x previous layer size; no data if sparse
+    constrealview bias;         // a single row
+    const realsparsematrix* sparse_weights;   // set to use these instead
+    std::shared_ptr<ActivationFunction> activation_fn;
+    const SoftmaxActivation* softmax;   // set for a softmax layer
+  };
+
+  std::vector<Stage> stages;
+  Workspace parameters;
+
+  int input_size;
+  int widest;               // largest layer after the input layer
+
+  std::unique_ptr<ExecutionContext> default_context;
+
+  template <typename Input>
+  void Run(ExecutionContext& context, const Input& in, realview out) const;
+
+  void AddBiasAndActivate(const Stage& stage, realview y, bool whole_rows) const;
+};
+
+
+}
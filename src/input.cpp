@@ -28,7 +28,7 @@ IntegerCategoryEncoder::IntegerCategoryEncoder(int min_value_use,
 }
 
 
-std::vector<double>
+realvector
 IntegerCategoryEncoder::EncodeField(const void* field_ptr)
 {
   auto out = empty_pattern;
@@ -40,7 +40,7 @@ IntegerCategoryEncoder::EncodeField(const void* field_ptr)
 
 
 void
-IntegerCategoryEncoder::DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr)
+IntegerCategoryEncoder::DecodeField(realvector::const_iterator& p, const void* field_ptr)
 {
   int idx = std::distance(p, std::max_element(p, p + num_categories));
   *(int *)field_ptr = idx + min_value;
@@ -64,7 +64,7 @@ IntegerToBinaryEncoder::IntegerToBinaryEncoder(int min_value_use,
 {
 }
 
-std::vector<double>
+realvector
 IntegerToBinaryEncoder::EncodeField(const void* field_ptr)
 {
   int value = *(int *)field_ptr - min_value;
@@ -82,7 +82,7 @@ IntegerToBinaryEncoder::EncodeField(const void* field_ptr)
 }
 
 void
-IntegerToBinaryEncoder::DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr)
+IntegerToBinaryEncoder::DecodeField(realvector::const_iterator& p, const void* field_ptr)
 {
   int value = 0;
   int this_bit_val = 1;
@@ -134,20 +134,20 @@ DoubleScaleEncoder::DoubleScaleEncoder(double a, double b, double c, double d)
 
 
 
-std::vector<double>
+realvector
 DoubleScaleEncoder::EncodeField(const void* field_ptr)
 {
   double in_val = *(double *)field_ptr;
   
   double out_val = out_min + (out_max - out_min) * (in_val - in_min)/(in_max - in_min);
   
-  return std::vector<double>(1, out_val);
+  return realvector(1, out_val);
 }
 
 
 
 void
-DoubleScaleEncoder::DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr)
+DoubleScaleEncoder::DecodeField(realvector::const_iterator& p, const void* field_ptr)
 {
   *(double *)field_ptr = in_min + (in_max - in_min) * (*p - out_min)/(out_max - out_min);
   ++p;
@@ -163,18 +163,18 @@ DoubleNormalizeEncoder::DoubleNormalizeEncoder(double mean_use, double std_dev_u
 }
 
 
-std::vector<double>
+realvector
 DoubleNormalizeEncoder::EncodeField(const void* field_ptr)
 {
   double input_val = *(double *)field_ptr;
   double output_val = (input_val - mean)/std_dev;
   
-  return std::vector<double>(1, output_val);
+  return realvector(1, output_val);
 }
 
 
 void
-DoubleNormalizeEncoder::DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr)
+DoubleNormalizeEncoder::DecodeField(realvector::const_iterator& p, const void* field_ptr)
 {
   *(double *)field_ptr = *p * std_dev + mean;
   ++p;
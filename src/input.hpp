@@ -173,8 +173,8 @@ void CalculateFieldStatistic(int offset,
 class FieldEncoder
 {
 public:
-  virtual std::vector<double> EncodeField(const void* field_ptr) = 0;
-  virtual void DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr) = 0;
+  virtual realvector EncodeField(const void* field_ptr) = 0;
+  virtual void DecodeField(realvector::const_iterator& p, const void* field_ptr) = 0;
   virtual size_t Length() const = 0;
 };
 
@@ -194,9 +194,9 @@ public:
     encoders.insert(std::make_pair(offset, encoder));
   }
 
-  std::vector<double> Encode(const InputType* data) const;
-  void Decode(const std::vector<double>& input, InputType* data) const;
-  InputType Decode(const std::vector<double>& input) const;
+  realvector Encode(const InputType* data) const;
+  void Decode(const realvector& input, InputType* data) const;
+  InputType Decode(const realvector& input) const;
 
   size_t Length() const {
     size_t length = 0;
@@ -216,12 +216,12 @@ private:
 class DoubleDefaultEncoder : public FieldEncoder
 {
 public:
-  std::vector<double> EncodeField(const void *field_ptr)
+  realvector EncodeField(const void *field_ptr)
   {
-    return std::vector<double>(1, *(double *)field_ptr);
+    return realvector(1, *(double *)field_ptr);
   }
 
-  void DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr)
+  void DecodeField(realvector::const_iterator& p, const void* field_ptr)
   {
     *(double *)field_ptr = *p;
     ++p;
@@ -240,8 +240,8 @@ public:
                          double on_value_use = 1.0,
                          double off_value_use = 0.0);
 
-  std::vector<double> EncodeField(const void* field_ptr);
-  void DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr);
+  realvector EncodeField(const void* field_ptr);
+  void DecodeField(realvector::const_iterator& p, const void* field_ptr);
 
   size_t Length() const { return empty_pattern.size(); }
 
@@ -251,7 +251,7 @@ private:
   int num_categories;
   double on_value;
   double off_value;
-  std::vector<double> empty_pattern;
+  realvector empty_pattern;
 };
 
 
@@ -264,8 +264,8 @@ public:
                          double on_value_use = 1.0,
                          double off_value_use = 0.0);
   
-  std::vector<double> EncodeField(const void* field_ptr) override;
-  void DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr);
+  realvector EncodeField(const void* field_ptr) override;
+  void DecodeField(realvector::const_iterator& p, const void* field_ptr);
 
   size_t Length() const { return empty_pattern.size(); }
 
@@ -276,7 +276,7 @@ private:
   double on_value;
   double off_value;
   int bits;
-  std::vector<double> empty_pattern;
+  realvector empty_pattern;
 
 
   int num_bits(int x);
@@ -302,7 +302,7 @@ public:
   }
 
 
-  std::vector<double> EncodeField(const void* field_ptr) override
+  realvector EncodeField(const void* field_ptr) override
   {
     const CategoryType* val = static_cast<const CategoryType*>(field_ptr);
     const auto& p = category_id.find(*val);
@@ -315,7 +315,7 @@ public:
     return int_encoder->EncodeField(&id);
   }
   
-  void DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr) override
+  void DecodeField(realvector::const_iterator& p, const void* field_ptr) override
   {
     int value;
     int_encoder->DecodeField(p, &value);
@@ -365,8 +365,8 @@ class DoubleScaleEncoder : public FieldEncoder
 public:
   DoubleScaleEncoder(double a, double b, double c, double d);
 
-  std::vector<double> EncodeField(const void* field_ptr) override;
-  void DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr) override;
+  realvector EncodeField(const void* field_ptr) override;
+  void DecodeField(realvector::const_iterator& p, const void* field_ptr) override;
 
   size_t Length() const { return 1; }
 
@@ -384,8 +384,8 @@ class DoubleNormalizeEncoder : public FieldEncoder
 public:
   DoubleNormalizeEncoder(double mean_use, double std_dev_use);
 
-  std::vector<double> EncodeField(const void* field_ptr) override;
-  void DecodeField(std::vector<double>::const_iterator& p, const void* field_ptr) override;
+  realvector EncodeField(const void* field_ptr) override;
+  void DecodeField(realvector::const_iterator& p, const void* field_ptr) override;
 
   size_t Length() const { return 1; }
 
@@ -399,10 +399,10 @@ private:
 
 
 template <typename InputType>
-std::vector<double>
+realvector
 InputEncoder<InputType>::Encode(const InputType* data) const
 {
-  std::vector<double> out;
+  realvector out;
   
   const char *base_ptr = (char *)data;
   
@@ -418,7 +418,7 @@ InputEncoder<InputType>::Encode(const InputType* data) const
 
 template <typename InputType>
 void
-InputEncoder<InputType>::Decode(const std::vector<double>& input, InputType* data) const
+InputEncoder<InputType>::Decode(const realvector& input, InputType* data) const
 {
   const char* base_ptr = (char *)data;
   auto p = input.begin();
@@ -432,7 +432,7 @@ InputEncoder<InputType>::Decode(const std::vector<double>& input, InputType* dat
 
 template <typename InputType>
 InputType
-InputEncoder<InputType>::Decode(const std::vector<double>& input) const
+InputEncoder<InputType>::Decode(const realvector& input) const
 {
   InputType data;
   const char* base_ptr = (char *)&data;
@@ -1,4 +1,5 @@
 #include "matrix.hpp"
+#include "blas.hpp"
 
 #include <iostream>
 #include <cstring>
@@ -7,99 +8,148 @@
 namespace nn
 {
 
-// A += B C
+// ||x||_2
+template <>
+float
+nrm2(int n, const float* x)
+{
+  return blas::CurrentBackend().Nrm2(n, x);
+}
+
+template <>
+double
+nrm2(int n, const double* x)
+{
+  return blas::CurrentBackend().Nrm2(n, x);
+}
+
+
+
+// x *= alpha
 template <>
 void
-accum_A_BC(Matrix<float>& A, const Matrix<float>& B, const Matrix<float>& C)
+scal(int n, float alpha, float* x)
 {
-  cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, A.Rows(), A.Cols(), B.Cols(),
-    1.0f, B.GetPtr(), B.Cols(), C.GetPtr(), C.Cols(), 1.0f, A.GetPtr(), A.Cols());
+  blas::CurrentBackend().Scal(n, alpha, x);
 }
 
 template <>
 void
-accum_A_BC(Matrix<double>& A, const Matrix<double>& B, const Matrix<double>& C)
+scal(int n, double alpha, double* x)
+{
+  blas::CurrentBackend().Scal(n, alpha, x);
+}
+
+
+
+// A += B C
+void
+accum_A_BC(MatrixView<float> A, ConstMatrixView<float> B, ConstMatrixView<float> C)
+{
+  blas::CurrentBackend().Gemm(blas::NoTrans, blas::NoTrans, A.Rows(), A.Cols(), B.Cols(),
+    1.0f, B.GetPtr(), B.LeadingDim(), C.GetPtr(), C.LeadingDim(), 1.0f, A.GetPtr(), A.LeadingDim());
+}
+
+void
+accum_A_BC(MatrixView<double> A, ConstMatrixView<double> B, ConstMatrixView<double> C)
 {
-  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, A.Rows(), A.Cols(), B.Cols(),
-    1.0, B.GetPtr(), B.Cols(), C.GetPtr(), C.Cols(), 1.0, A.GetPtr(), A.Cols());
+  blas::CurrentBackend().Gemm(blas::NoTrans, blas::NoTrans, A.Rows(), A.Cols(), B.Cols(),
+    1.0, B.GetPtr(), B.LeadingDim(), C.GetPtr(), C.LeadingDim(), 1.0, A.GetPtr(), A.LeadingDim());
+}
+
+
+
+// A = B C^T
+void
+set_A_BCt(MatrixView<float> A, ConstMatrixView<float> B, ConstMatrixView<float> C)
+{
+  blas::CurrentBackend().Gemm(blas::NoTrans, blas::Trans, A.Rows(), A.Cols(), B.Cols(),
+    1.0f, B.GetPtr(), B.LeadingDim(), C.GetPtr(), C.LeadingDim(), 0.0f, A.GetPtr(), A.LeadingDim());
+}
+
+void
+set_A_BCt(MatrixView<double> A, ConstMatrixView<double> B, ConstMatrixView<double> C)
+{
+  blas::CurrentBackend().Gemm(blas::NoTrans, blas::Trans, A.Rows(), A.Cols(), B.Cols(),
+    1.0, B.GetPtr(), B.LeadingDim(), C.GetPtr(), C.LeadingDim(), 0.0, A.GetPtr(), A.LeadingDim());
 }
 
 
 
 // A += B C^T
-template <>
 void
-accum_A_BCt(Matrix<float>& A, const Matrix<float>& B, const Matrix<float>& C)
+accum_A_BCt(MatrixView<float> A, ConstMatrixView<float> B, ConstMatrixView<float> C)
 {
-  cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, A.Rows(), A.Cols(), B.Cols(),
-    1.0f, B.GetPtr(), B.Cols(), C.GetPtr(), C.Cols(), 1.0f, A.GetPtr(), A.Cols());
+  blas::CurrentBackend().Gemm(blas::NoTrans, blas::Trans, A.Rows(), A.Cols(), B.Cols(),
+    1.0f, B.GetPtr(), B.LeadingDim(), C.GetPtr(), C.LeadingDim(), 1.0f, A.GetPtr(), A.LeadingDim());
 }
 
-template <>
 void
-accum_A_BCt(Matrix<double>& A, const Matrix<double>& B, const Matrix<double>& C)
+accum_A_BCt(MatrixView<double> A, ConstMatrixView<double> B, ConstMatrixView<double> C)
 {
-  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, A.Rows(), A.Cols(), B.Cols(),
-    1.0, B.GetPtr(), B.Cols(), C.GetPtr(), C.Cols(), 1.0, A.GetPtr(), A.Cols());
+  blas::CurrentBackend().Gemm(blas::NoTrans, blas::Trans, A.Rows(), A.Cols(), B.Cols(),
+    1.0, B.GetPtr(), B.LeadingDim(), C.GetPtr(), C.LeadingDim(), 1.0, A.GetPtr(), A.LeadingDim());
 }
 
 
 
 // A += B^T C
-template <>
 void
-accum_A_BtC(Matrix<float>& A, const Matrix<float>& B, const Matrix<float>& C)
+accum_A_BtC(MatrixView<float> A, ConstMatrixView<float> B, ConstMatrixView<float> C)
 {
-  cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans, A.Rows(), A.Cols(), B.Rows(),
-    1.0f, B.GetPtr(), B.Cols(), C.GetPtr(), C.Cols(), 1.0f, A.GetPtr(), A.Cols());
+  blas::CurrentBackend().Gemm(blas::Trans, blas::NoTrans, A.Rows(), A.Cols(), B.Rows(),
+    1.0f, B.GetPtr(), B.LeadingDim(), C.GetPtr(), C.LeadingDim(), 1.0f, A.GetPtr(), A.LeadingDim());
 }
 
-template <>
 void
-accum_A_BtC(Matrix<double>& A, const Matrix<double>& B, const Matrix<double>& C)
+accum_A_BtC(MatrixView<double> A, ConstMatrixView<double> B, ConstMatrixView<double> C)
 {
-  cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, A.Rows(), A.Cols(), B.Rows(),
-    1.0, B.GetPtr(), B.Cols(), C.GetPtr(), C.Cols(), 1.0, A.GetPtr(), A.Cols());
+  blas::CurrentBackend().Gemm(blas::Trans, blas::NoTrans, A.Rows(), A.Cols(), B.Rows(),
+    1.0, B.GetPtr(), B.LeadingDim(), C.GetPtr(), C.LeadingDim(), 1.0, A.GetPtr(), A.LeadingDim());
 }
 
 
 
 // y += A^T x
-template <>
 void
-accum_y_Atx(typename Matrix<float>::VectorType& y,
-            const Matrix<float>& A,
-            const typename Matrix<float>::VectorType& x)
+accum_y_Atx(std::vector<float>& y, ConstMatrixView<float> A, const std::vector<float>& x)
 {
-  cblas_sgemv(CblasRowMajor, CblasTrans, A.Rows(), A.Cols(), 1.0f,
-    A.GetPtr(), A.Cols(), &x[0], 1, 1.0f, &y[0], 1);
+  blas::CurrentBackend().Gemv(blas::Trans, A.Rows(), A.Cols(), 1.0f,
+    A.GetPtr(), A.LeadingDim(), &x[0], 1.0f, &y[0]);
 }
 
-template <>
 void
-accum_y_Atx(typename Matrix<double>::VectorType& y,
-  const Matrix<double>& A,
-  const typename Matrix<double>::VectorType& x)
+accum_y_Atx(std::vector<double>& y, ConstMatrixView<double> A, const std::vector<double>& x)
 {
-  cblas_dgemv(CblasRowMajor, CblasTrans, A.Rows(), A.Cols(), 1.0,
-    A.GetPtr(), A.Cols(), &x[0], 1, 1.0, &y[0], 1);
+  blas::CurrentBackend().Gemv(blas::Trans, A.Rows(), A.Cols(), 1.0,
+    A.GetPtr(), A.LeadingDim(), &x[0], 1.0, &y[0]);
 }
 
 
 
 // A += alpha B
-template <>
 void
-accum_A_alphaB(Matrix<float>& A, float alpha, const Matrix<float>& B)
+accum_A_alphaB(MatrixView<float> A, float alpha, ConstMatrixView<float> B)
 {
-  cblas_saxpy(A.Size(), alpha, B.GetPtr(), 1, A.GetPtr(), 1);
+  if (A.IsPacked() && B.IsPacked()) {
+    blas::CurrentBackend().Axpy(A.Size(), alpha, B.GetPtr(), A.GetPtr());
+    return;
+  }
+  for (int row = 0; row < A.Rows(); ++row) {
+    blas::CurrentBackend().Axpy(A.Cols(), alpha, B.GetRowPtr(row), A.GetRowPtr(row));
+  }
 }
 
-template <>
 void
-accum_A_alphaB(Matrix<double>& A, double alpha, const Matrix<double>& B)
+accum_A_alphaB(MatrixView<double> A, double alpha, ConstMatrixView<double> B)
 {
-  cblas_daxpy(A.Size(), alpha, B.GetPtr(), 1, A.GetPtr(), 1);
+  if (A.IsPacked() && B.IsPacked()) {
+    blas::CurrentBackend().Axpy(A.Size(), alpha, B.GetPtr(), A.GetPtr());
+    return;
+  }
+  for (int row = 0; row < A.Rows(); ++row) {
+    blas::CurrentBackend().Axpy(A.Cols(), alpha, B.GetRowPtr(row), A.GetRowPtr(row));
+  }
 }
 
 
@@ -109,32 +159,36 @@ template <>
 void
 accum_y_alphax(std::vector<float>& y, float alpha, const std::vector<float>& x)
 {
-  cblas_saxpy(y.size(), alpha, &x[0], 1, &y[0], 1);
+  blas::CurrentBackend().Axpy(y.size(), alpha, &x[0], &y[0]);
 }
 
 template <>
 void
 accum_y_alphax(std::vector<double>& y, double alpha, const std::vector<double>& x)
 {
-  cblas_daxpy(y.size(), alpha, &x[0], 1, &y[0], 1);
+  blas::CurrentBackend().Axpy(y.size(), alpha, &x[0], &y[0]);
 }
 
 
-// A += x y^T
-template <>
-void accum_A_xyT(Matrix<float>& A, const typename Matrix<float>::VectorType& x, const typename Matrix<float>::VectorType& y)
+// A = x y^T
+void
+accum_A_xyT(MatrixView<float> A, const std::vector<float>& x, const std::vector<float>& y)
 {
-  memset(A.GetPtr(), 0, A.Size() * sizeof(float));
-  cblas_sger(CblasRowMajor, A.Rows(), A.Cols(), 1.0f, &x[0], 1, &y[0], 1, A.GetPtr(), A.Cols());
+  for (int row = 0; row < A.Rows(); ++row) {
+    memset(A.GetRowPtr(row), 0, A.Cols() * sizeof(float));
+  }
+  blas::CurrentBackend().Ger(A.Rows(), A.Cols(), 1.0f, &x[0], &y[0], A.GetPtr(), A.LeadingDim());
 }
 
 
-// A += x y^T
-template <>
-void accum_A_xyT(Matrix<double>& A, const typename Matrix<double>::VectorType& x, const typename Matrix<double>::VectorType& y)
+// A = x y^T
+void
+accum_A_xyT(MatrixView<double> A, const std::vector<double>& x, const std::vector<double>& y)
 {
-  memset(A.GetPtr(), 0, A.Size() * sizeof(double));
-  cblas_dger(CblasRowMajor, A.Rows(), A.Cols(), 1.0, &x[0], 1, &y[0], 1, A.GetPtr(), A.Cols());
+  for (int row = 0; row < A.Rows(); ++row) {
+    memset(A.GetRowPtr(row), 0, A.Cols() * sizeof(double));
+  }
+  blas::CurrentBackend().Ger(A.Rows(), A.Cols(), 1.0, &x[0], &y[0], A.GetPtr(), A.LeadingDim());
 }
 
 
@@ -1,28 +1,53 @@
 #pragma once
 
+#include "allocator.hpp"
+
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <iostream>
+#include <type_traits>
 
-#ifdef __linux__
-extern "C" {
-#  include <cblas.h>
-}
-#elif _WIN32
-#  include <mkl_cblas.h>
-#else
-#  error "Unsupported OS!"
-#endif
-
+#include <cmath>
 
 namespace nn
 {
 template <typename T> class Matrix;
 
+namespace expr
+{
+template <typename E> struct Expression;
+}
+
 typedef double dblscalar;
 typedef std::vector<dblscalar> dblvector;
 typedef Matrix<dblscalar> dblmatrix;
 
+typedef float fltscalar;
+typedef std::vector<fltscalar> fltvector;
+typedef Matrix<fltscalar> fltmatrix;
+
+// Scalar type used by the network, the trainers and the input encoders.
+// Define NN_SINGLE_PRECISION to build the whole stack in float.
+#ifdef NN_SINGLE_PRECISION
+typedef fltscalar realscalar;
+#else
+typedef dblscalar realscalar;
+#endif
+typedef std::vector<realscalar> realvector;
+typedef Matrix<realscalar> realmatrix;
+
+
+// ||x||_2
+template <typename T>
+T nrm2(int n, const T* x);
+
+
+// x *= alpha
+template <typename T>
+void scal(int n, T alpha, T* x);
+
+
 template <typename T>
 class Matrix
 {
@@ -30,8 +55,9 @@ public:
   
   typedef T ValueType;
   typedef std::vector<T> VectorType;
-  typedef typename VectorType::iterator IteratorType;
-  typedef typename VectorType::const_iterator ConstIteratorType;
+  typedef std::vector<T, AlignedAllocator<T>> StorageType;
+  typedef T* IteratorType;
+  typedef const T* ConstIteratorType;
 
 
   class RowType
@@ -49,19 +75,108 @@ public:
   };
 
 
-  Matrix(int rows_use, int cols_use)
+  // Rows are stored ld_use entries apart (ld_use >= cols_use).  Passing 0
+  // packs the rows; pass PaddedLd(cols_use) to start every row on a cache
+  // line.
+  Matrix(int rows_use, int cols_use, int ld_use = 0)
+    : rows(rows_use),
+      cols(cols_use),
+      ld(ld_use > cols_use ? ld_use : cols_use),
+      size(rows*cols),
+      capacity(rows),
+      data(rows*ld, 0),
+      ptr(data.data())
+  {
+  }
+
+  // A matrix over storage owned by someone else (see Workspace), which must
+  // hold rows*ld entries and outlive the matrix.  storage may be nullptr,
+  // in which case the matrix has its shape but no storage until Bind.
+  Matrix(int rows_use, int cols_use, int ld_use, T* storage)
     : rows(rows_use),
       cols(cols_use),
+      ld(ld_use > cols_use ? ld_use : cols_use),
       size(rows*cols),
-      data(size, 0)
+      capacity(rows),
+      ptr(storage)
+  {
+  }
+
+  // Copies always own their storage.  Assigning to a matrix over external
+  // storage writes through to that storage instead, and throws if the
+  // shapes differ rather than leaving it.
+  Matrix(const Matrix& other)
+    : rows(other.rows),
+      cols(other.cols),
+      ld(other.ld),
+      size(other.size),
+      capacity(other.capacity),
+      data(other.ptr, other.ptr + (other.ptr ? other.StorageCapacity() : 0)),
+      ptr(data.data())
   {
   }
 
+  Matrix(Matrix&& other)
+    : rows(other.rows),
+      cols(other.cols),
+      ld(other.ld),
+      size(other.size),
+      capacity(other.capacity),
+      data(std::move(other.data)),   // keeps its buffer, so ptr stays valid
+      ptr(other.ptr)
+  {
+    other.ptr = other.data.data();
+  }
+
+  Matrix& operator=(const Matrix& other)
+  {
+    if (this != &other) {
+      if (!CopyIntoExternal(other)) {
+        Matrix copy(other);
+        *this = std::move(copy);
+      }
+    }
+    return *this;
+  }
+
+  Matrix& operator=(Matrix&& other)
+  {
+    if (this != &other && !CopyIntoExternal(other)) {
+      rows = other.rows;
+      cols = other.cols;
+      ld = other.ld;
+      size = other.size;
+      capacity = other.capacity;
+      data = std::move(other.data);
+      ptr = other.ptr;
+      other.ptr = other.data.data();
+    }
+    return *this;
+  }
+
+  // Moves the matrix onto storage (Capacity()*ld entries), copying the
+  // current contents if it has any, and releases any storage it owned.
+  void Bind(T* storage)
+  {
+    if (ptr && ptr != storage) {
+      std::copy_n(ptr, StorageCapacity(), storage);
+    }
+    ptr = storage;
+    StorageType().swap(data);
+  }
+
+  bool IsExternal() const { return ptr != data.data(); }
+
+
+  // evaluates an elementwise expression into this matrix (see expression.hpp)
+  template <typename E>
+  Matrix& operator=(const expr::Expression<E>& e);
 
   explicit Matrix(const std::vector<VectorType>& v)
   {
     rows = v.size();
     cols = v[0].size();
+    ld = cols;
     for (auto& pattern : v) {
       if (pattern.size() != cols) {
         std::cerr << "Pattern is wrong size!" << std::endl;
@@ -69,39 +184,61 @@ public:
       }
     }
     size = rows * cols;
+    capacity = rows;
     data.resize(size);
+    ptr = data.data();
     for (int row = 0; row < rows; ++row) {
       SetRowValues(row, v[row]);
     }
   }
 
-  int AppendRow(const dblmatrix& new_row)
+  // Smallest leading dimension >= cols that starts each row on a cache line.
+  // Strides that are a multiple of 4K get one more cache line, so that
+  // consecutive rows don't alias in the L1 cache.
+  static int PaddedLd(int cols)
+  {
+    const int line = CACHE_LINE_SIZE / sizeof(T);
+    int padded = (cols + line - 1) / line * line;
+    if (padded > line && (padded * sizeof(T)) % 4096 == 0) {
+      padded += line;
+    }
+    return padded;
+  }
+
+  int AppendRow(const VectorType& new_row)
   {
-    if (new_row.Size() != cols) {
+    if (new_row.size() != cols) {
       throw "Wrong vector length!";
     }
+    if (IsExternal()) {
+      throw "Can't grow a matrix over external storage!";
+    }
     rows++;
     size += cols;
-    data.insert(end(data), begin(new_row), end(new_row));
+    if (rows > capacity) {
+      capacity = rows;
+      data.resize(capacity * ld, 0);
+      ptr = data.data();
+    }
+    SetRowValues(rows - 1, new_row);
+    return rows;
   }
 
   int GetRowStartIndex(int row_num) const
   {
-    return row_num * cols;
+    return row_num * ld;
   }
 
   std::pair<ConstIteratorType, ConstIteratorType> GetRowRange(int row_num) const
   {
-    auto start_iterator = data.begin() + row_num * cols;
-    auto end_iterator = start_iterator + cols;
-    return std::make_pair(start_iterator, end_iterator);
+    ConstIteratorType start_iterator = GetRowPtr(row_num);
+    return std::make_pair(start_iterator, start_iterator + cols);
   }
 
   std::pair<IteratorType, IteratorType> GetRowRange(int row_num)
   {
-    auto start_iterator = data.begin() + row_num * cols;
-    auto end_iterator = start_iterator + cols;
-    return std::make_pair(start_iterator, end_iterator);
+    IteratorType start_iterator = GetRowPtr(row_num);
+    return std::make_pair(start_iterator, start_iterator + cols);
   }
 
   RowType GetRow(int row_num) { return RowType(GetRowRange(row_num)); }
@@ -111,40 +248,44 @@ public:
   VectorType GetRowValues(int row_num) const
   {
     auto range = GetRowRange(row_num);
-    return dblvector(range.first, range.second);
+    return VectorType(range.first, range.second);
   }
 
   VectorType GetColumnValues(int col_num)
   {
-    dblvector values(cols);
-    auto v = data.begin() + col_num;
-    for (int c = 0; c < cols; ++c, v += cols) {
-      values[c] = *v;
+    VectorType values(rows);
+    const T* v = ptr + col_num;
+    for (int r = 0; r < rows; ++r, v += ld) {
+      values[r] = *v;
     }
     return values;
   }
 
-  void SetRowValues(int row_num, const dblvector& values)
+  void SetRowValues(int row_num, const VectorType& values)
   {
-    std::copy(std::begin(values), std::end(values), data.begin() + row_num * cols);
+    std::copy(std::begin(values), std::end(values), GetRowPtr(row_num));
   }
 
-  void SetData(const dblvector& values)
+  // values holds the matrix packed row by row
+  void SetData(const VectorType& values)
   {
     if (values.size() != size) {
       std::cerr << "Invalid size" << std::endl;
     }
 
-    std::copy(std::begin(values), std::end(values), std::begin(data));
+    for (int row = 0; row < rows; ++row) {
+      std::copy_n(values.begin() + row * cols, cols, GetRowPtr(row));
+    }
   }
 
-  void SetEntry(int row, int col, T value) { data[row * cols + col] = value; }
-  void SetEntry(int index, T value) { data[index] = value; }
+  void SetEntry(int row, int col, T value) { ptr[GetRowStartIndex(row) + col] = value; }
+  void SetEntry(int index, T value) { ptr[index] = value; }
 
-  T& operator[](int index) { return data[index]; }
-  const T& operator[](int index) const { return data[index]; }
+  // index into the underlying storage, including any row padding
+  T& operator[](int index) { return ptr[index]; }
+  const T& operator[](int index) const { return ptr[index]; }
 
-  void SetAllRowValues(const dblvector& values)
+  void SetAllRowValues(const VectorType& values)
   {
     for (int i = 0; i < rows; ++i) {
       SetRowValues(i, values);
@@ -154,38 +295,71 @@ public:
   int Rows() const { return rows; }
   int Cols() const { return cols; }
   int Size() const { return size; }
+  int LeadingDim() const { return ld; }
+  int StorageSize() const { return rows * ld; }
+  bool IsPacked() const { return ld == cols; }
+
+  // The storage holds Capacity() rows, the number the matrix was created
+  // with.  SetRows uses only the first num_rows of them without moving or
+  // reallocating anything, so a buffer sized for a full batch can hold a
+  // partial one; Rows(), StorageSize() and iteration then cover just those.
+  int Capacity() const { return capacity; }
+  int StorageCapacity() const { return capacity * ld; }
+  void SetRows(int num_rows)
+  {
+    if (num_rows < 0 || num_rows > capacity) {
+      throw "Matrix::SetRows: more rows than the storage holds.";
+    }
+    rows = num_rows;
+    size = rows * cols;
+  }
 
-  T* GetPtr() { return &data[0]; }
-  const T* GetPtr() const { return &data[0]; }
-  std::vector<T>& GetRef() { return data; }
-  const std::vector<T>& GetRef() const { return data; }
+  T* GetPtr() { return ptr; }
+  const T* GetPtr() const { return ptr; }
+  // the owned storage; empty for a matrix over external storage
+  StorageType& GetRef() { return data; }
+  const StorageType& GetRef() const { return data; }
 
-  IteratorType begin() { return data.begin(); }
-  IteratorType end()   { return data.end(); }
-  ConstIteratorType begin() const { return data.begin(); }
-  ConstIteratorType end()   const { return data.end(); }
+  // iterate over the underlying storage, including any row padding
+  IteratorType begin() { return ptr; }
+  IteratorType end()   { return ptr + StorageSize(); }
+  ConstIteratorType begin() const { return ptr; }
+  ConstIteratorType end()   const { return ptr + StorageSize(); }
 
   T Norm() const {
-    return cblas_dnrm2(data.size(), &data[0], 1);
+    if (IsPacked()) {
+      return nrm2(size, GetPtr());
+    }
+    T sum_sq = 0;
+    for (int row = 0; row < rows; ++row) {
+      T row_norm = nrm2(cols, GetRowPtr(row));
+      sum_sq += row_norm * row_norm;
+    }
+    return std::sqrt(sum_sq);
   }
 
   void Normalize() {
     T norm = Norm();
     if (norm > 1.0) {
-      cblas_dscal(data.size(), 1.0 / norm, &data[0], 1);
+      scal(StorageSize(), T(1.0) / norm, GetPtr());
     }
   }
 
   T* GetRowPtr(int row_num)
   {
-    return &data[0] + GetRowStartIndex(row_num);
+    return ptr + GetRowStartIndex(row_num);
+  }
+
+  const T* GetRowPtr(int row_num) const
+  {
+    return ptr + GetRowStartIndex(row_num);
   }
 
   void NormalizeRow(int row_num, T desired_norm = 1.0)
   {
-    T row_norm = cblas_dnrm2(cols, GetRowPtr(row_num), 1);
+    T row_norm = nrm2(cols, GetRowPtr(row_num));
     T scale_factor = desired_norm / row_norm;
-    cblas_dscal(cols, scale_factor, GetRowPtr(row_num), 1);
+    scal(cols, scale_factor, GetRowPtr(row_num));
   }
 
   void NormalizeEachRow(T desired_norm = 1.0)
@@ -197,10 +371,10 @@ public:
   
   void print() const
   {
-    int idx = 0;
     for (int r = 0; r < rows; ++r) {
+      const T* row_ptr = GetRowPtr(r);
       for (int c = 0; c < cols; ++c) {
-        std::cout << data[idx++] << " ";
+        std::cout << row_ptr[c] << " ";
       }
       std::cout << std::endl;
     }
@@ -209,9 +383,26 @@ public:
 private:
   int rows;
   int cols;
+  int ld;
   int size;
+  int capacity;   // rows the storage holds, >= rows
+
+  StorageType data;
+  T* ptr;        // data.data(), or external storage
 
-  std::vector<T> data;
+  bool CopyIntoExternal(const Matrix& other)
+  {
+    if (!IsExternal() || !ptr) {
+      return false;
+    }
+    if (rows != other.rows || cols != other.cols) {
+      throw "Can't assign a matrix of another shape to one over external storage!";
+    }
+    for (int row = 0; row < rows; ++row) {
+      std::copy_n(other.GetRowPtr(row), cols, GetRowPtr(row));
+    }
+    return true;
+  }
 };
 
 
@@ -223,31 +414,107 @@ template <typename T> typename Matrix<T>::ConstIteratorType end(const Matrix<T>&
 
 
 
+// Non-owning reference to a row-major block of rows x cols entries whose
+// rows are ld apart.  MatrixView<const T> (ConstMatrixView<T>) is the
+// read-only version.  Views are cheap to copy and never allocate; the
+// referenced storage must outlive them.
+template <typename T>
+class MatrixView
+{
+public:
+  typedef typename std::remove_const<T>::type ValueType;
+
+  MatrixView(T* ptr_use, int rows_use, int cols_use, int ld_use = 0)
+    : ptr(ptr_use),
+      rows(rows_use),
+      cols(cols_use),
+      ld(ld_use > cols_use ? ld_use : cols_use)
+  {}
+
+  MatrixView(Matrix<ValueType>& A)
+    : MatrixView(A.GetPtr(), A.Rows(), A.Cols(), A.LeadingDim())
+  {}
+
+  // only read-only views can be taken of a const Matrix
+  template <typename U = T, typename = typename std::enable_if<std::is_const<U>::value>::type>
+  MatrixView(const Matrix<ValueType>& A)
+    : MatrixView(A.GetPtr(), A.Rows(), A.Cols(), A.LeadingDim())
+  {}
+
+  MatrixView(const MatrixView<ValueType>& v)
+    : MatrixView(v.GetPtr(), v.Rows(), v.Cols(), v.LeadingDim())
+  {}
+
+  int Rows() const { return rows; }
+  int Cols() const { return cols; }
+  int Size() const { return rows * cols; }
+  int LeadingDim() const { return ld; }
+  bool IsPacked() const { return ld == cols; }
+
+  T* GetPtr() const { return ptr; }
+  T* GetRowPtr(int row_num) const { return ptr + row_num * ld; }
+
+  T& operator()(int row, int col) const { return ptr[row * ld + col]; }
+
+  // rows [first_row, first_row + num_rows)
+  MatrixView SubRows(int first_row, int num_rows) const
+  {
+    return MatrixView(GetRowPtr(first_row), num_rows, cols, ld);
+  }
+
+  // columns [first_col, first_col + num_cols) of every row
+  MatrixView SubCols(int first_col, int num_cols) const
+  {
+    return MatrixView(ptr + first_col, rows, num_cols, ld);
+  }
+
+  MatrixView Row(int row_num) const { return SubRows(row_num, 1); }
+
+private:
+  T*  ptr;
+  int rows;
+  int cols;
+  int ld;
+};
+
+
+template <typename T>
+using ConstMatrixView = MatrixView<const T>;
+
+typedef MatrixView<realscalar> realview;
+typedef ConstMatrixView<realscalar> constrealview;
+
+
+
 // matrix-matrix operations
 // A += B C
-template <typename T>
-void accum_A_BC(Matrix<T>& A, const Matrix<T>& B, const Matrix<T>& C);
+void accum_A_BC(MatrixView<float> A, ConstMatrixView<float> B, ConstMatrixView<float> C);
+void accum_A_BC(MatrixView<double> A, ConstMatrixView<double> B, ConstMatrixView<double> C);
+
+
+// A = B C^T
+void set_A_BCt(MatrixView<float> A, ConstMatrixView<float> B, ConstMatrixView<float> C);
+void set_A_BCt(MatrixView<double> A, ConstMatrixView<double> B, ConstMatrixView<double> C);
 
 
 // A += B C^T
-template <typename T>
-void accum_A_BCt(Matrix<T>& A, const Matrix<T>& B, const Matrix<T>& C);
+void accum_A_BCt(MatrixView<float> A, ConstMatrixView<float> B, ConstMatrixView<float> C);
+void accum_A_BCt(MatrixView<double> A, ConstMatrixView<double> B, ConstMatrixView<double> C);
 
 
 // A += B^T C
-template <typename T>
-void accum_A_BtC(Matrix<T>& A, const Matrix<T>& B, const Matrix<T>& C);
+void accum_A_BtC(MatrixView<float> A, ConstMatrixView<float> B, ConstMatrixView<float> C);
+void accum_A_BtC(MatrixView<double> A, ConstMatrixView<double> B, ConstMatrixView<double> C);
 
 
 // y += A^T x
-template <typename T>
-void accum_y_Atx(typename Matrix<T>::VectorType& y, const Matrix<T>& A,
-  const typename Matrix<T>::VectorType& x);
+void accum_y_Atx(std::vector<float>& y, ConstMatrixView<float> A, const std::vector<float>& x);
+void accum_y_Atx(std::vector<double>& y, ConstMatrixView<double> A, const std::vector<double>& x);
 
 
 // A += alpha B
-template <typename T>
-void accum_A_alphaB(Matrix<T>& A, T alpha, const Matrix<T>& B);
+void accum_A_alphaB(MatrixView<float> A, float alpha, ConstMatrixView<float> B);
+void accum_A_alphaB(MatrixView<double> A, double alpha, ConstMatrixView<double> B);
 
 
 // y += alpha x
@@ -255,8 +522,8 @@ template <typename T>
 void accum_y_alphax(std::vector<T>& y, T alpha, const std::vector<T>& x);
 
 
-// A += x y^T
-template <typename T>
-void accum_A_xyT(Matrix<T>& A, const typename Matrix<T>::VectorType& x, const typename Matrix<T>::VectorType& y);
+// A = x y^T
+void accum_A_xyT(MatrixView<float> A, const std::vector<float>& x, const std::vector<float>& y);
+void accum_A_xyT(MatrixView<double> A, const std::vector<double>& x, const std::vector<double>& y);
 
 } // namespace nn
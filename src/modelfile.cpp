@@ -0,0 +1,434 @@
+#include "modelfile.hpp"
+#include "network.hpp"
+
+#include <fstream>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <cstring>
+
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+
+namespace nn
+{
+
+namespace
+{
+
+uint64_t RoundUp(uint64_t n, uint64_t multiple) { return (n + multiple - 1) / multiple * multiple; }
+
+
+// the record of type T at offset, checked against the end of the file
+template <typename T>
+const T& RecordAt(const MappedFile& file, uint64_t offset)
+{
+  if (offset > file.Size() || sizeof(T) > file.Size() - offset) {
+    throw "Model file is truncated.";
+  }
+  return *reinterpret_cast<const T*>(file.Data() + offset);
+}
+
+
+void CheckBlob(const MappedFile& file, uint64_t offset, uint64_t bytes, uint64_t alignment)
+{
+  if (offset % alignment != 0 || offset > file.Size() || bytes > file.Size() - offset) {
+    throw "Model file has a misplaced weight or bias blob.";
+  }
+}
+
+
+uint64_t SparseBlobBytes(const ConnectionRecord& record)
+{
+  return uint64_t(record.nonzeros) * sizeof(realscalar) + (uint64_t(record.rows) + 1 + record.nonzeros) * sizeof(uint32_t);
+}
+
+}
+
+
+
+ActivationCode
+DescribeActivation(const ActivationFunction& act_fn, double params[3])
+{
+  params[0] = params[1] = params[2] = 0;
+
+  if (auto sigmoid = dynamic_cast<const SigmoidActivation*>(&act_fn)) {
+    params[0] = sigmoid->MinValue();
+    params[1] = sigmoid->MaxValue();
+    params[2] = sigmoid->Slope();
+    return ActivationCode::Sigmoid;
+  }
+  if (auto linear = dynamic_cast<const LinearActivation*>(&act_fn)) {
+    params[0] = linear->Slope();
+    return ActivationCode::Linear;
+  }
+  if (auto leaky = dynamic_cast<const LeakyReLUActivation*>(&act_fn)) {
+    params[0] = leaky->Alpha();
+    return ActivationCode::LeakyReLU;
+  }
+  if (dynamic_cast<const TanhActivation*>(&act_fn)) {
+    return ActivationCode::Tanh;
+  }
+  if (dynamic_cast<const ReLUActivation*>(&act_fn)) {
+    return ActivationCode::ReLU;
+  }
+  if (dynamic_cast<const SoftplusActivation*>(&act_fn)) {
+    return ActivationCode::Softplus;
+  }
+  if (dynamic_cast<const SoftmaxActivation*>(&act_fn)) {
+    return ActivationCode::Softmax;
+  }
+  throw "Only the built-in activation functions can be saved.";
+}
+
+
+
+std::shared_ptr<ActivationFunction>
+MakeActivation(ActivationCode code, const double params[3])
+{
+  switch (code) {
+  case ActivationCode::Linear:    return std::make_shared<LinearActivation>(params[0]);
+  case ActivationCode::Sigmoid:   return std::make_shared<SigmoidActivation>(params[0], params[1], params[2]);
+  case ActivationCode::Tanh:      return std::make_shared<TanhActivation>();
+  case ActivationCode::ReLU:      return std::make_shared<ReLUActivation>();
+  case ActivationCode::LeakyReLU: return std::make_shared<LeakyReLUActivation>(params[0]);
+  case ActivationCode::Softplus:  return std::make_shared<SoftplusActivation>();
+  case ActivationCode::Softmax:   return std::make_shared<SoftmaxActivation>();
+  }
+  throw "Model file has an unknown activation function.";
+}
+
+
+
+ErrorCode
+DescribeError(const ErrorFunction& error_fn)
+{
+  if (dynamic_cast<const SquaredError*>(&error_fn)) {
+    return ErrorCode::Squared;
+  }
+  if (dynamic_cast<const CrossEntropyError*>(&error_fn)) {
+    return ErrorCode::CrossEntropy;
+  }
+  if (dynamic_cast<const CategoricalCrossEntropyError*>(&error_fn)) {
+    return ErrorCode::CategoricalCrossEntropy;
+  }
+  throw "Only the built-in error functions can be saved.";
+}
+
+
+
+std::shared_ptr<ErrorFunction>
+MakeError(ErrorCode code)
+{
+  switch (code) {
+  case ErrorCode::Squared:                 return std::make_shared<SquaredError>();
+  case ErrorCode::CrossEntropy:            return std::make_shared<CrossEntropyError>();
+  case ErrorCode::CategoricalCrossEntropy: return std::make_shared<CategoricalCrossEntropyError>();
+  }
+  throw "Model file has an unknown error function.";
+}
+
+
+
+MappedFile::MappedFile(const std::string& file_name)
+  : data(nullptr),
+    size(0),
+    mapped(false)
+{
+#ifdef __linux__
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw "Can't open the model file.";
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw "Can't open the model file.";
+  }
+  size = st.st_size;
+  if (size > 0) {
+    void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      data = static_cast<char*>(p);
+      mapped = true;
+    }
+  }
+  close(fd);
+  if (mapped || size == 0) {
+    return;
+  }
+#endif
+
+  std::ifstream in(file_name, std::ios::binary | std::ios::ate);
+  if (!in) {
+    throw "Can't open the model file.";
+  }
+  size = in.tellg();
+  in.seekg(0);
+  data = AlignedAllocator<char, MODEL_FILE_ALIGNMENT>().allocate(size);
+  if (!in.read(data, size)) {
+    AlignedAllocator<char, MODEL_FILE_ALIGNMENT>().deallocate(data, size);
+    throw "Can't read the model file.";
+  }
+}
+
+
+
+MappedFile::~MappedFile()
+{
+  if (!data) {
+    return;
+  }
+#ifdef __linux__
+  if (mapped) {
+    munmap(data, size);
+    return;
+  }
+#endif
+  AlignedAllocator<char, MODEL_FILE_ALIGNMENT>().deallocate(data, size);
+}
+
+
+
+void
+Network::Save(const std::string& file_name) const
+{
+  std::map<const Layer*, uint32_t> layer_index;
+  for (size_t l = 0; l < layers.size(); ++l) {
+    layer_index[layers[l].get()] = l;
+  }
+
+  FileHeader header = {};
+  std::memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+  header.version = MODEL_FILE_VERSION;
+  header.scalar_bytes = sizeof(realscalar);
+  header.num_layers = layers.size();
+  header.num_connections = connections.size();
+  header.error_code = static_cast<uint32_t>(DescribeError(*err_function));
+  header.blob_alignment = MODEL_FILE_ALIGNMENT;
+
+  // lay out the blobs after the records
+  uint64_t offset = sizeof(FileHeader) + layers.size()*sizeof(LayerRecord) + connections.size()*sizeof(ConnectionRecord);
+
+  std::vector<ConnectionRecord> connection_records;
+  for (auto& c : connections) {
+    ConnectionRecord record = {};
+    record.from = layer_index.at(c->layer_from);
+    record.to = layer_index.at(c->layer_to);
+    record.rows = c->weights.Rows();
+    record.cols = c->weights.Cols();
+    record.ld = c->weights.LeadingDim();
+    if (c->IsPruned()) {
+      record.format = static_cast<uint32_t>(WeightFormat::Sparse);
+      record.sparse_kernel = c->UsesSparseWeights();
+      record.nonzeros = c->sparse_weights.NonZeros();
+      offset = RoundUp(offset, CACHE_LINE_SIZE);
+      record.weights_offset = offset;
+      offset += SparseBlobBytes(record);
+    } else {
+      record.format = static_cast<uint32_t>(WeightFormat::Dense);
+      offset = RoundUp(offset, MODEL_FILE_ALIGNMENT);
+      record.weights_offset = offset;
+      offset += uint64_t(record.rows) * record.ld * sizeof(realscalar);
+    }
+    connection_records.push_back(record);
+  }
+
+  std::vector<LayerRecord> layer_records;
+  for (size_t l = 0; l < layers.size(); ++l) {
+    const auto& act_fn = *layers[l]->GetActivationFunction();
+    LayerRecord record = {};
+    record.size = layers[l]->Size();
+    record.activation_code = static_cast<uint32_t>(DescribeActivation(act_fn, record.params));
+    record.accuracy = static_cast<uint32_t>(act_fn.GetAccuracy());
+    if (!layers[l]->IsInput()) {
+      offset = RoundUp(offset, CACHE_LINE_SIZE);
+      record.bias_offset = offset;
+      offset += record.size * sizeof(realscalar);
+    }
+    layer_records.push_back(record);
+  }
+  header.file_bytes = offset;
+
+  std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw "Can't create the model file.";
+  }
+  uint64_t written = 0;
+  auto write = [&](const void* p, uint64_t bytes) {
+    out.write(static_cast<const char*>(p), bytes);
+    written += bytes;
+  };
+  auto pad_to = [&](uint64_t to) {
+    static const char zeros[MODEL_FILE_ALIGNMENT] = {};
+    write(zeros, to - written);
+  };
+
+  write(&header, sizeof(header));
+  for (auto& record : layer_records) {
+    write(&record, sizeof(record));
+  }
+  for (auto& record : connection_records) {
+    write(&record, sizeof(record));
+  }
+  for (size_t c = 0; c < connections.size(); ++c) {
+    pad_to(connection_records[c].weights_offset);
+    if (connections[c]->IsPruned()) {
+      const auto& sparse = connections[c]->sparse_weights;
+      std::vector<uint32_t> row_start(sparse.Rows() + 1);
+      for (int row = 0; row <= sparse.Rows(); ++row) {
+        row_start[row] = sparse.RowStart(row);
+      }
+      write(sparse.ValuePtr(), uint64_t(sparse.NonZeros()) * sizeof(realscalar));
+      write(row_start.data(), row_start.size() * sizeof(uint32_t));
+      write(sparse.ColIndexPtr(), uint64_t(sparse.NonZeros()) * sizeof(uint32_t));
+    } else {
+      const auto& weights = connections[c]->weights;
+      write(weights.GetPtr(), uint64_t(weights.StorageSize()) * sizeof(realscalar));
+    }
+  }
+  for (size_t l = 0; l < layers.size(); ++l) {
+    if (layers[l]->IsInput()) {
+      continue;
+    }
+    pad_to(layer_records[l].bias_offset);
+    write(layers[l]->bias.GetPtr(), layers[l]->Size() * sizeof(realscalar));
+  }
+
+  if (!out) {
+    throw "Can't write the model file.";
+  }
+}
+
+
+
+Network::Network(const std::string& file_name, int batch_size_use, bool map_weights)
+  : batch_size(batch_size_use),
+    current_epoch(0),
+    last_error(0),
+    workspace_planned(false)
+{
+  auto file = std::make_shared<const MappedFile>(file_name);
+
+  const auto& header = RecordAt<FileHeader>(*file, 0);
+  if (std::memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    throw "Not a model file.";
+  }
+  if (header.version != MODEL_FILE_VERSION) {
+    throw "Unsupported model file version.";
+  }
+  if (header.scalar_bytes != sizeof(realscalar)) {
+    throw "Model file was written with a different scalar type.";
+  }
+  if (header.file_bytes != file->Size()) {
+    throw "Model file is truncated.";
+  }
+  if (header.blob_alignment == 0 || header.blob_alignment % CACHE_LINE_SIZE != 0) {
+    throw "Model file has a bad blob alignment.";
+  }
+  err_function = MakeError(static_cast<ErrorCode>(header.error_code));
+
+  uint64_t offset = sizeof(FileHeader);
+  std::vector<LayerRecord> layer_records;
+  for (uint32_t l = 0; l < header.num_layers; ++l, offset += sizeof(LayerRecord)) {
+    const auto& record = RecordAt<LayerRecord>(*file, offset);
+    if (record.accuracy > static_cast<uint32_t>(fastmath::Accuracy::Fast)) {
+      throw "Model file has an unknown activation accuracy.";
+    }
+    if (record.size == 0 || record.size > uint32_t(std::numeric_limits<int>::max())) {
+      throw "Model file has a bad layer size.";
+    }
+    auto act_fn = MakeActivation(static_cast<ActivationCode>(record.activation_code), record.params);
+    act_fn->SetAccuracy(static_cast<fastmath::Accuracy>(record.accuracy));
+    AddLayer(record.size, act_fn);
+    layer_records.push_back(record);
+  }
+
+  std::vector<std::pair<Connection*, ConnectionRecord>> sparse_records;
+  for (uint32_t c = 0; c < header.num_connections; ++c, offset += sizeof(ConnectionRecord)) {
+    const auto& record = RecordAt<ConnectionRecord>(*file, offset);
+    if (record.from >= layers.size() || record.to >= layers.size()) {
+      throw "Model file connects a layer that doesn't exist.";
+    }
+    AddConnection(record.from, record.to);
+
+    auto& weights = connections.back()->weights;
+    if (record.rows != uint32_t(weights.Rows()) || record.cols != uint32_t(weights.Cols())
+        || record.ld != uint32_t(weights.LeadingDim())) {
+      throw "Model file weights don't match the layer sizes.";
+    }
+    if (record.format == static_cast<uint32_t>(WeightFormat::Sparse)) {
+      // expanded into the workspace below
+      if (record.nonzeros > uint64_t(record.rows) * record.cols || record.sparse_kernel > 1) {
+        throw "Model file has corrupt sparse weights.";
+      }
+      CheckBlob(*file, record.weights_offset, SparseBlobBytes(record), CACHE_LINE_SIZE);
+      sparse_records.push_back({ connections.back().get(), record });
+      continue;
+    }
+    if (record.format != static_cast<uint32_t>(WeightFormat::Dense)) {
+      throw "Model file has an unknown weight format.";
+    }
+    CheckBlob(*file, record.weights_offset, uint64_t(record.rows) * record.ld * sizeof(realscalar), header.blob_alignment);
+
+    // the mapping is read-only, so writing these faults.  Copied weights
+    // move to the workspace in PlanWorkspace.
+    weights.Bind(const_cast<realscalar*>(reinterpret_cast<const realscalar*>(file->Data() + record.weights_offset)));
+  }
+
+  if (map_weights) {
+    weights_file = file;
+  }
+  PlanWorkspace();
+
+  for (size_t l = 0; l < layers.size(); ++l) {
+    if (layers[l]->IsInput()) {
+      continue;
+    }
+    const auto& record = layer_records[l];
+    CheckBlob(*file, record.bias_offset, record.size * sizeof(realscalar), CACHE_LINE_SIZE);
+    std::memcpy(layers[l]->bias.GetPtr(), file->Data() + record.bias_offset, record.size * sizeof(realscalar));
+  }
+
+  // the pruned weights, and the mask that keeps them pruned
+  for (const auto& sparse : sparse_records) {
+    Connection& c = *sparse.first;
+    const ConnectionRecord& record = sparse.second;
+    const char* blob = file->Data() + record.weights_offset;
+    const auto* value = reinterpret_cast<const realscalar*>(blob);
+    const auto* row_start = reinterpret_cast<const uint32_t*>(value + record.nonzeros);
+    const auto* col_index = row_start + record.rows + 1;
+
+    if (row_start[0] != 0 || row_start[record.rows] != record.nonzeros) {
+      throw "Model file has corrupt sparse weights.";
+    }
+    c.mask = realmatrix(record.rows, record.cols, record.ld);
+    for (uint32_t row = 0; row < record.rows; ++row) {
+      if (row_start[row] > row_start[row + 1] || row_start[row + 1] > record.nonzeros) {
+        throw "Model file has corrupt sparse weights.";
+      }
+      realscalar* w = c.weights.GetRowPtr(row);
+      realscalar* m = c.mask.GetRowPtr(row);
+      for (uint32_t i = row_start[row]; i < row_start[row + 1]; ++i) {
+        if (col_index[i] >= record.cols) {
+          throw "Model file has corrupt sparse weights.";
+        }
+        w[col_index[i]] = value[i];
+        m[col_index[i]] = 1;
+      }
+    }
+    // the kernel the saved network ran, rather than timing them here
+    c.UpdateSparseWeights(0);
+    c.use_sparse_weights = record.sparse_kernel != 0;
+  }
+}
+
+
+}
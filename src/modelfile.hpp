@@ -0,0 +1,148 @@
+#pragma once
+
+#include "activation.hpp"
+#include "error.hpp"
+
+#include <memory>
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nn
+{
+
+// The binary model file written by Network::Save and read by the
+// Network(file_name) constructor.  All integers and scalars are stored in
+// the writer's byte order and scalar type; a reader with a different
+// realscalar rejects the file.
+//
+//   FileHeader
+//   LayerRecord      x num_layers
+//   ConnectionRecord x num_connections
+//   weight blobs     one per connection.  Dense weights start on a
+//                    blob_alignment boundary and are rows x ld scalars
+//                    with the rows padded as in memory, so they can be used
+//                    in place.  Pruned weights are stored compressed, from
+//                    a cache line boundary: the nonzeros values, rows + 1
+//                    uint32 row starts and nonzeros uint32 column indices,
+//                    as in SparseMatrix.  Whether the sparse or the dense
+//                    kernel runs them is saved too, so loading doesn't time
+//                    the kernels again.
+//   bias blobs       one per layer with incoming connections, in layer
+//                    order, size scalars each, cache-line aligned
+//
+// Offsets are from the start of the file.
+
+const char MODEL_FILE_MAGIC[8] = { 'B', 'P', 'N', 'N', 'M', 'O', 'D', 'L' };
+const uint32_t MODEL_FILE_VERSION = 3;
+const uint32_t MODEL_FILE_ALIGNMENT = 4096;   // a page
+
+
+enum class ActivationCode : uint32_t
+{
+  Linear = 1,       // params: slope
+  Sigmoid = 2,      // params: min, max, slope
+  Tanh = 3,
+  ReLU = 4,
+  LeakyReLU = 5,    // params: alpha
+  Softplus = 6,
+  Softmax = 7
+};
+
+
+enum class ErrorCode : uint32_t
+{
+  Squared = 1,
+  CrossEntropy = 2,
+  CategoricalCrossEntropy = 3
+};
+
+
+struct FileHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t scalar_bytes;        // sizeof(realscalar) of the writer
+  uint32_t num_layers;
+  uint32_t num_connections;
+  uint32_t error_code;
+  uint32_t blob_alignment;
+  uint64_t file_bytes;
+  uint64_t reserved[3];
+};
+
+
+struct LayerRecord
+{
+  uint32_t size;
+  uint32_t activation_code;
+  uint32_t accuracy;            // fastmath::Accuracy of the activation
+  uint32_t reserved;
+  double   params[3];           // see ActivationCode
+  uint64_t bias_offset;         // 0 for an input layer
+};
+
+
+enum class WeightFormat : uint32_t
+{
+  Dense = 0,
+  Sparse = 1        // pruned, see Connection::Prune
+};
+
+
+struct ConnectionRecord
+{
+  uint32_t from;                // layer indices
+  uint32_t to;
+  uint32_t rows;                // size of the to layer
+  uint32_t cols;                // size of the from layer
+  uint32_t ld;                  // of dense weights
+  uint32_t format;              // WeightFormat
+  uint32_t sparse_kernel;       // of sparse weights: 1 to run them sparse
+  uint32_t reserved;
+  uint64_t weights_offset;
+  uint64_t nonzeros;            // of sparse weights
+};
+
+
+// the code and parameters of the built-in activation and error functions;
+// others can't be saved and throw
+ActivationCode DescribeActivation(const ActivationFunction& act_fn, double params[3]);
+std::shared_ptr<ActivationFunction> MakeActivation(ActivationCode code, const double params[3]);
+ErrorCode DescribeError(const ErrorFunction& error_fn);
+std::shared_ptr<ErrorFunction> MakeError(ErrorCode code);
+
+
+
+// A whole file mapped read-only.  The pages come from the page cache, so
+// every process that maps the same file shares one physical copy, and
+// they're only read in as they're touched.  Where mmap isn't available the
+// file is read into an aligned buffer instead.
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string& file_name);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* Data() const { return data; }
+  size_t Size() const { return size; }
+  bool IsMapped() const { return mapped; }
+
+  bool Contains(const void* p) const
+  {
+    const char* c = static_cast<const char*>(p);
+    return c >= data && c < data + size;
+  }
+
+private:
+  char*  data;
+  size_t size;
+  bool   mapped;
+};
+
+
+}
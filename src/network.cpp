@@ -1,8 +1,12 @@
 #include "network.hpp"
+#include "modelfile.hpp"
 #include "utility.hpp"
 
 #include <algorithm>
+#include <cmath>
 #include <functional>
+#include <limits>
+#include <numeric>
 
 namespace nn
 {
@@ -13,9 +17,12 @@ Layer::Layer(int size_use, int batch_size_use,
              std::shared_ptr<ActivationFunction> activation_fn_use)
   : size(size_use),
     batch_size(batch_size_use),
-    net_input(batch_size, size),
-    activation(batch_size, size),
-    bias(size),
+    net_input(batch_size, size, realmatrix::PaddedLd(size), nullptr),
+    activation(batch_size, size, realmatrix::PaddedLd(size), nullptr),
+    bias(1, size, realmatrix::PaddedLd(size), nullptr),
+    input(activation),
+    sparse_input(nullptr),
+    has_input(false),
     activation_fn(activation_fn_use)
 {
 }
@@ -23,28 +30,175 @@ Layer::Layer(int size_use, int batch_size_use,
 
 
 void
-Layer::CalculateActivation()
+Layer::CalculateActivation(int first_row, int rows)
 {
-  for (int row = 0; row < activation.Rows(); ++row) {
-    net_input.SetRowValues(row, bias);
+  for (int row = first_row; row < first_row + rows; ++row) {
+    std::copy_n(bias.GetRowPtr(0), size, net_input.GetRowPtr(row));
   }
 
+  realview x = realview(net_input).SubRows(first_row, rows);
   for (auto& in_conn: incoming) {
-    in_conn->AccumulateNetInput(net_input);
+    in_conn->AccumulateNetInput(x, first_row);
+  }
+
+  // net_input and activation share a leading dimension, so this is one
+  // call for all the rows; the padding just gets f(0)
+  activation_fn->Apply(net_input.GetRowPtr(first_row), activation.GetRowPtr(first_row), rows*net_input.LeadingDim());
+}
+
+
+
+void
+Layer::CalculateNetInput(int first_row, int rows)
+{
+  realview x = realview(net_input).SubRows(first_row, rows);
+  if (incoming.empty()) {
+    for (int row = 0; row < rows; ++row) {
+      std::fill_n(x.GetRowPtr(row), size, realscalar(0));
+    }
+    return;
+  }
+
+  // the first connection overwrites, so there's no separate clearing pass
+  incoming[0]->CalculateNetInput(x, first_row);
+  for (size_t c = 1; c < incoming.size(); ++c) {
+    incoming[c]->AccumulateNetInput(x, first_row);
+  }
+}
+
+
+
+void
+Layer::AddToWorkspace(Workspace& workspace, const std::string& name)
+{
+  workspace.Add(name + ".net_input", net_input);
+  workspace.Add(name + ".activation", activation);
+  workspace.Add(name + ".bias", bias);
+}
+
+
+
+void
+Layer::ScaleByDerivative(realview delta, int first_row) const
+{
+  for (int row = 0; row < delta.Rows(); ++row) {
+    const realscalar* x = net_input.GetRowPtr(first_row + row);
+    const realscalar* fx = activation.GetRowPtr(first_row + row);
+    realscalar* d = delta.GetRowPtr(row);
+    for (int col = 0; col < size; ++col) {
+      d[col] *= activation_fn->df(x[col], fx[col]);
+    }
+  }
+}
+
+
+
+void
+Layer::OutputDelta(constrealview target, const ErrorFunction* error_fn, realview delta, int first_row) const
+{
+  for (int row = 0; row < delta.Rows(); ++row) {
+    const realscalar* x = net_input.GetRowPtr(first_row + row);
+    const realscalar* fx = activation.GetRowPtr(first_row + row);
+    const realscalar* t = target.GetRowPtr(row);
+    realscalar* d = delta.GetRowPtr(row);
+    for (int col = 0; col < size; ++col) {
+      d[col] = error_fn->dE(fx[col], t[col]) * activation_fn->df(x[col], fx[col]);
+    }
+  }
+}
+
+
+
+realscalar
+Layer::TotalError(constrealview target_pattern, const ErrorFunction* error_fn, realscalar* row_errors)
+{
+  double total_error = 0.0;
+
+  // one virtual call per pattern
+  for (int row = 0; row < activation.Rows(); ++row) {
+    double row_error = error_fn->Sum(activation.GetRowPtr(row), target_pattern.GetRowPtr(row), size);
+    if (row_errors) {
+      row_errors[row] = row_error;
+    }
+    total_error += row_error;
+  }
+
+  return total_error;
+}
+
+
+
+SoftmaxLayer::SoftmaxLayer(int size_use, int batch_size_use,
+                           std::shared_ptr<SoftmaxActivation> activation_fn_use)
+  : Layer(size_use, batch_size_use, activation_fn_use),
+    softmax(activation_fn_use.get()),
+    log_sum_exp(batch_size, 1, 0, nullptr)
+{
+}
+
+
+
+void
+SoftmaxLayer::CalculateActivation(int first_row, int rows)
+{
+  CalculateNetInput(first_row, rows);
+
+  const realscalar* b = bias.GetRowPtr(0);
+  for (int row = first_row; row < first_row + rows; ++row) {
+    realscalar* x = net_input.GetRowPtr(row);
+    for (int col = 0; col < size; ++col) {
+      x[col] += b[col];
+    }
+    *log_sum_exp.GetRowPtr(row) = softmax->ApplyRow(x, activation.GetRowPtr(row), size);
+  }
+}
+
+
+
+void
+SoftmaxLayer::AddToWorkspace(Workspace& workspace, const std::string& name)
+{
+  Layer::AddToWorkspace(workspace, name);
+  workspace.Add(name + ".log_sum_exp", log_sum_exp);
+}
+
+
+
+// -sum(t log p) with log p = x - lse
+realscalar
+SoftmaxLayer::TotalError(constrealview target, const ErrorFunction* error_fn, realscalar* row_errors)
+{
+  double total_error = 0.0;
+
+  for (int row = 0; row < net_input.Rows(); ++row) {
+    const realscalar* x = net_input.GetRowPtr(row);
+    const realscalar* t = target.GetRowPtr(row);
+    const realscalar lse = *log_sum_exp.GetRowPtr(row);
+    double row_error = LaneSum(size, [=](size_t col) { return t[col]*(lse - x[col]); });
+    if (row_errors) {
+      row_errors[row] = row_error;
+    }
+    total_error += row_error;
   }
 
-  std::transform(begin(net_input), end(net_input), begin(activation),
-                 [&](auto& x) { return activation_fn->f(x); });
+  return total_error;
 }
 
 
 
-dblscalar
-Layer::TotalError(const dblmatrix& target_pattern, const ErrorFunction* error_fn)
+void
+SoftmaxLayer::OutputDelta(constrealview target, const ErrorFunction* error_fn, realview delta, int first_row) const
 {
-  return std::inner_product(activation.begin(), activation.end(), target_pattern.begin(), 0.0,
-                            std::plus<dblscalar>(),
-                            [&](auto x, auto y) { return error_fn->E(x, y); });
+  // the gradient is p*sum(t) - t, which is p - t for a one-hot target
+  for (int row = 0; row < delta.Rows(); ++row) {
+    const realscalar* p = activation.GetRowPtr(first_row + row);
+    const realscalar* t = target.GetRowPtr(row);
+    realscalar* d = delta.GetRowPtr(row);
+    const realscalar t_sum = std::accumulate(t, t + size, realscalar(0));
+    for (int col = 0; col < size; ++col) {
+      d[col] = t_sum*p[col] - t[col];
+    }
+  }
 }
 
 
@@ -55,13 +209,92 @@ Connection::Connection(Layer* from, Layer* to)
     rows(layer_to->Size()),
     cols(layer_from->Size()),
     size(rows*cols),
-    weights(rows, cols)
+    weights(rows, cols, realmatrix::PaddedLd(cols), nullptr),
+    mask(0, 0),
+    sparse_weights(0, 0),
+    use_sparse_weights(false)
 {
   layer_from->AddOutgoingConnection(this);
   layer_to->AddIncomingConnection(this);
 }
 
 
+
+size_t
+Connection::Prune(realscalar threshold, double break_even)
+{
+  if (!IsPruned()) {
+    mask = realmatrix(rows, cols, weights.LeadingDim());
+    for (int row = 0; row < rows; ++row) {
+      std::fill_n(mask.GetRowPtr(row), cols, realscalar(1));
+    }
+  }
+
+  size_t pruned = 0;
+  for (int row = 0; row < rows; ++row) {
+    realscalar* w = weights.GetRowPtr(row);
+    realscalar* m = mask.GetRowPtr(row);
+    for (int col = 0; col < cols; ++col) {
+      if (m[col] != 0 && std::abs(w[col]) < threshold) {
+        m[col] = 0;
+        ++pruned;
+      }
+    }
+  }
+
+  UpdateSparseWeights(break_even);
+  return pruned;
+}
+
+
+
+double
+Connection::Density() const
+{
+  return IsPruned() ? double(sparse_weights.NonZeros()) / size : 1.0;
+}
+
+
+
+void
+Connection::ApplyMask()
+{
+  if (!IsPruned()) {
+    return;
+  }
+
+  // the sparse weights have a non-zero wherever the mask does
+  realscalar* value = sparse_weights.ValuePtr();
+  const int* col_index = sparse_weights.ColIndexPtr();
+  for (int row = 0; row < rows; ++row) {
+    realscalar* w = weights.GetRowPtr(row);
+    const realscalar* m = mask.GetRowPtr(row);
+    for (int col = 0; col < cols; ++col) {
+      w[col] *= m[col];
+    }
+    for (int i = sparse_weights.RowStart(row); i < sparse_weights.RowStart(row + 1); ++i) {
+      value[i] = w[col_index[i]];
+    }
+  }
+}
+
+
+
+void
+Connection::UpdateSparseWeights(double break_even)
+{
+  if (!IsPruned()) {
+    return;
+  }
+
+  // the pattern comes from the mask, so weights that happen to be zero
+  // keep their place
+  sparse_weights = realsparsematrix(constrealview(mask));
+  ApplyMask();
+  use_sparse_weights = Density() < break_even;
+}
+
+
 Network::Network(const std::vector<size_t>& layer_sizes,
                  int batch_size_use,
                  std::shared_ptr<ActivationFunction> hid_act_fn,
@@ -70,7 +303,8 @@ Network::Network(const std::vector<size_t>& layer_sizes,
   : batch_size(batch_size_use),
     err_function(err_function_use),
     current_epoch(0),
-    last_error(0)
+    last_error(0),
+    workspace_planned(false)
 {
   size_t num_hid = layer_sizes.size() - 1;
   
@@ -79,6 +313,116 @@ Network::Network(const std::vector<size_t>& layer_sizes,
   }
   AddLayer(layer_sizes[num_hid], out_act_fn);
   AddDefaultConnections();
+  PlanWorkspace();
+}
+
+
+
+void
+Network::PlanWorkspace()
+{
+  // checked once the topology is known, rather than on every pass
+  for (auto& layer : layers) {
+    if (dynamic_cast<const SoftmaxLayer*>(layer.get())) {
+      if (!layer->IsOutput()) {
+        throw "Softmax is only supported on the output layer.";
+      }
+      if (!dynamic_cast<const CategoricalCrossEntropyError*>(err_function.get())) {
+        throw "A softmax output layer needs CategoricalCrossEntropyError.";
+      }
+    }
+  }
+
+  workspace.Clear();
+  // input layers only ever bind the caller's batch
+  for (size_t l = 0; l < layers.size(); ++l) {
+    if (!layers[l]->IsInput()) {
+      layers[l]->AddToWorkspace(workspace, "layer" + std::to_string(l));
+    }
+  }
+  for (size_t c = 0; c < connections.size(); ++c) {
+    // mapped weights stay in the file
+    if (weights_file && weights_file->Contains(connections[c]->weights.GetPtr())) {
+      continue;
+    }
+    connections[c]->AddToWorkspace(workspace, "connection" + std::to_string(c));
+  }
+  workspace.Allocate();
+  workspace_planned = true;
+}
+
+
+
+size_t
+Network::Prune(realscalar threshold)
+{
+  if (HasMappedWeights()) {
+    throw "Network::Prune: the weights are mapped read-only.";
+  }
+
+  size_t pruned = 0;
+  for (auto& c : connections) {
+    pruned += c->Prune(threshold, SparseBreakEven());
+  }
+  return pruned;
+}
+
+
+
+size_t
+Network::PruneToSparsity(double sparsity, bool per_connection)
+{
+  if (sparsity < 0 || sparsity > 1) {
+    throw "Network::PruneToSparsity: sparsity must be between 0 and 1.";
+  }
+  if (HasMappedWeights()) {
+    throw "Network::PruneToSparsity: the weights are mapped read-only.";
+  }
+
+  auto add_magnitudes = [](const Connection& c, std::vector<realscalar>& magnitudes) {
+    const auto& weights = c.GetWeights();
+    for (int row = 0; row < weights.Rows(); ++row) {
+      const realscalar* w = weights.GetRowPtr(row);
+      for (int col = 0; col < weights.Cols(); ++col) {
+        magnitudes.push_back(std::abs(w[col]));
+      }
+    }
+  };
+  // the k-th smallest magnitude; everything below it goes
+  auto threshold = [sparsity](std::vector<realscalar>& magnitudes) {
+    const size_t k = size_t(sparsity*magnitudes.size());
+    if (k >= magnitudes.size()) {
+      return std::numeric_limits<realscalar>::infinity();
+    }
+    std::nth_element(magnitudes.begin(), magnitudes.begin() + k, magnitudes.end());
+    return magnitudes[k];
+  };
+
+  std::vector<realscalar> magnitudes;
+  if (!per_connection) {
+    for (auto& c : connections) {
+      add_magnitudes(*c, magnitudes);
+    }
+    return Prune(threshold(magnitudes));
+  }
+
+  size_t pruned = 0;
+  for (auto& c : connections) {
+    magnitudes.clear();
+    add_magnitudes(*c, magnitudes);
+    pruned += c->Prune(threshold(magnitudes), SparseBreakEven());
+  }
+  return pruned;
+}
+
+
+
+void
+Network::UpdateSparseWeights()
+{
+  for (auto& c : connections) {
+    c->UpdateSparseWeights(SparseBreakEven());
+  }
 }
 
 
@@ -86,41 +430,317 @@ Network::Network(const std::vector<size_t>& layer_sizes,
 int
 Network::AddDefaultConnections()
 {
-  nn::utility::adjacent_pairs(std::begin(layers), std::end(layers),
-                              [&](auto p, auto q) { this->AddConnection(p.get(), q.get()); });
+  for (size_t l = 1; l < layers.size(); ++l) {
+    AddConnection(l - 1, l);
+  }
 
   return connections.size();
 }
 
 
 
-dblmatrix
-Network::FeedForward(const dblmatrix& input_pattern)
+void
+Network::AddConnection(size_t from, size_t to)
 {
-  layers[INPUT_LAYER]->SetActivation(input_pattern);
+  if (from >= layers.size() || to >= layers.size()) {
+    throw "Network::AddConnection: no such layer.";
+  }
+  if (from == to || Reaches(to, from)) {
+    throw "Network::AddConnection: the connection would make a cycle.";
+  }
+  for (auto c : layers[from]->outgoing) {
+    if (c->layer_to == layers[to].get()) {
+      throw "Network::AddConnection: the layers are already connected.";
+    }
+  }
 
-  for (size_t l = 1; l < layers.size(); ++l) {
-    layers[l]->CalculateActivation();
+  connections.push_back(std::make_shared<Connection>(layers[from].get(), layers[to].get()));
+  SortLayers();
+}
+
+
+
+// whether there is a path of connections from layer from to layer to
+bool
+Network::Reaches(size_t from, size_t to) const
+{
+  std::vector<const Layer*> stack = { layers[from].get() };
+  std::vector<const Layer*> seen;
+  while (!stack.empty()) {
+    const Layer* layer = stack.back();
+    stack.pop_back();
+    if (layer == layers[to].get()) {
+      return true;
+    }
+    for (auto c : layer->outgoing) {
+      if (std::find(seen.begin(), seen.end(), c->layer_to) == seen.end()) {
+        seen.push_back(c->layer_to);
+        stack.push_back(c->layer_to);
+      }
+    }
+  }
+  return false;
+}
+
+
+
+// recomputes levels and outputs after the topology changes
+void
+Network::SortLayers()
+{
+  std::map<const Layer*, size_t> index;
+  for (size_t l = 0; l < layers.size(); ++l) {
+    index[layers[l].get()] = l;
+  }
+
+  // layers are visited once everything feeding them has been
+  std::vector<size_t> level(layers.size(), 0);
+  std::vector<size_t> waiting(layers.size());
+  std::vector<size_t> ready;
+  for (size_t l = 0; l < layers.size(); ++l) {
+    waiting[l] = layers[l]->incoming.size();
+    if (waiting[l] == 0) {
+      ready.push_back(l);
+    }
+  }
+
+  levels.clear();
+  outputs.clear();
+  for (size_t visited = 0; visited < ready.size(); ++visited) {
+    size_t l = ready[visited];
+    if (levels.size() <= level[l]) {
+      levels.resize(level[l] + 1);
+    }
+    levels[level[l]].push_back(l);
+    for (auto c : layers[l]->outgoing) {
+      size_t next = index.at(c->layer_to);
+      level[next] = std::max(level[next], level[l] + 1);
+      if (--waiting[next] == 0) {
+        ready.push_back(next);
+      }
+    }
+  }
+  assert(ready.size() == layers.size());   // AddConnection keeps out cycles
+
+  for (auto& lev : levels) {
+    std::sort(lev.begin(), lev.end());
+  }
+  for (size_t l = 0; l < layers.size(); ++l) {
+    if (layers[l]->IsOutput()) {
+      outputs.push_back(l);
+    }
+  }
+
+  SplitStages();
+  workspace_planned = false;
+}
+
+
+
+// cuts the levels after the inputs into the pipeline stages
+void
+Network::SplitStages()
+{
+  pipeline_stages.clear();
+  if (micro_batch <= 0 || levels.size() < 2) {
+    return;
+  }
+  const int wanted = requested_stages > 0 ? requested_stages : (thread_pool ? thread_pool->NumThreads() : 1);
+  const size_t num_stages = std::min<size_t>(wanted, levels.size() - 1);
+
+  // the multiply-adds per pattern of each level
+  std::vector<double> cost(levels.size(), 0.0);
+  double total = 0;
+  for (size_t lev = 1; lev < levels.size(); ++lev) {
+    for (size_t l : levels[lev]) {
+      cost[lev] += layers[l]->Size();
+      for (auto c : layers[l]->incoming) {
+        cost[lev] += c->Size();
+      }
+    }
+    total += cost[lev];
   }
 
-  return layers.back()->GetActivation();
+  // close a stage once it has its share, or when each stage after it needs
+  // one of the remaining levels
+  size_t first = 1;
+  double so_far = 0;
+  for (size_t lev = 1; lev < levels.size(); ++lev) {
+    so_far += cost[lev];
+    const size_t stages_left = num_stages - pipeline_stages.size();
+    const size_t levels_left = levels.size() - 1 - lev;
+    if (stages_left > 1 && (so_far >= total*(pipeline_stages.size() + 1)/num_stages || levels_left == stages_left - 1)) {
+      pipeline_stages.emplace_back(first, lev + 1);
+      first = lev + 1;
+    }
+  }
+  pipeline_stages.emplace_back(first, levels.size());
 }
 
 
 
-dblscalar
-Network::TotalError(const dblmatrix& target_pattern)
+bool
+Network::Pipelines(int rows) const
 {
-  return (last_error = layers.back()->TotalError(target_pattern, err_function.get()));
+  if (pipeline_stages.size() < 2 || rows <= micro_batch) {
+    return false;
+  }
+  for (size_t l : levels[0]) {
+    if (layers[l]->GetSparseActivation()) {
+      return false;
+    }
+  }
+  return true;
 }
 
 
+
+int
+Network::InputSize() const
+{
+  int size = 0;
+  for (size_t l : levels.empty() ? std::vector<size_t>() : levels[0]) {
+    size += layers[l]->Size();
+  }
+  return size;
+}
+
+
+
+int
+Network::OutputSize() const
+{
+  int size = 0;
+  for (size_t l : outputs) {
+    size += layers[l]->Size();
+  }
+  return size;
+}
+
+
+
+const realmatrix&
+Network::FeedForward(constrealview input_pattern)
+{
+  if (input_pattern.Cols() != InputSize()) {
+    throw "Network::FeedForward: the input doesn't match the input layers.";
+  }
+  SetRows(input_pattern.Rows());
+
+  int col = 0;
+  for (size_t l : levels[0]) {
+    layers[l]->SetActivation(input_pattern.SubCols(col, layers[l]->Size()));
+    col += layers[l]->Size();
+  }
+  return PropagateInput();
+}
+
+
+
+const realmatrix&
+Network::FeedForward(const realsparsematrix& input_pattern)
+{
+  if (NumInputs() != 1) {
+    throw "Network::FeedForward: a sparse input needs a single input layer.";
+  }
+  SetRows(input_pattern.Rows());
+  layers[levels[0][0]]->SetActivation(input_pattern);
+  return PropagateInput();
+}
+
+
+
+void
+Network::SetRows(int rows)
+{
+  if (rows > batch_size) {
+    throw "Network::FeedForward: more patterns than the batch size.";
+  }
+  for (auto& layer : layers) {
+    if (!layer->IsInput()) {
+      layer->SetRows(rows);
+    }
+  }
+}
+
+
+
+// plans the workspace of a network built, or changed, since it was last
+// planned
 void
-Network::AddConnection(Layer* from, Layer *to)
+Network::EnsureWorkspace()
+{
+  if (!workspace_planned) {
+    for (auto& layer : layers) {
+      if (layer->IsInput() && layer->IsOutput() && layers.size() > 1) {
+        throw "Network: a layer has no connections.";
+      }
+    }
+    PlanWorkspace();
+  }
+}
+
+
+
+const realmatrix&
+Network::PropagateInput()
 {
-  connections.push_back(std::make_shared<Connection>(from, to));
+  EnsureWorkspace();
+
+  const auto& output = layers[outputs.back()]->GetActivationMatrix();
+  const int rows = output.Rows();
+
+  if (Pipelines(rows)) {
+    utility::RunPipeline(thread_pool.get(), pipeline_stages.size(), (rows + micro_batch - 1)/micro_batch,
+                         [&](int stage, int part) {
+      const int first_row = part*micro_batch;
+      const int part_rows = std::min(micro_batch, rows - first_row);
+      for (size_t lev = pipeline_stages[stage].first; lev < pipeline_stages[stage].second; ++lev) {
+        for (size_t l : levels[lev]) {
+          layers[l]->CalculateActivation(first_row, part_rows);
+        }
+      }
+    });
+    return output;
+  }
+
+  for (size_t lev = 1; lev < levels.size(); ++lev) {
+    const auto& level = levels[lev];
+    utility::ParallelFor(thread_pool.get(), level.size(),
+                         [&](int i) { layers[level[i]]->CalculateActivation(); });
+  }
+
+  return output;
 }
 
 
 
+realscalar
+Network::TotalError(constrealview target_pattern, realscalar* row_errors)
+{
+  if (outputs.size() == 1) {
+    return (last_error = layers[outputs[0]]->TotalError(target_pattern, err_function.get(), row_errors));
+  }
+
+  // each output's share of the target, with the pattern errors summed
+  const int rows = target_pattern.Rows();
+  std::vector<realscalar> output_errors(row_errors ? rows : 0);
+  if (row_errors) {
+    std::fill_n(row_errors, rows, realscalar(0));
+  }
+
+  double total_error = 0.0;
+  int col = 0;
+  for (size_t l : outputs) {
+    total_error += layers[l]->TotalError(target_pattern.SubCols(col, layers[l]->Size()), err_function.get(),
+                                         row_errors ? output_errors.data() : nullptr);
+    col += layers[l]->Size();
+    for (size_t row = 0; row < output_errors.size(); ++row) {
+      row_errors[row] += output_errors[row];
+    }
+  }
+  return (last_error = total_error);
+}
+
+
 }
@@ -1,14 +1,19 @@
 #pragma once
 
 #include "matrix.hpp"
+#include "sparse.hpp"
+#include "workspace.hpp"
 #include "activation.hpp"
 #include "error.hpp"
 #include "utility.hpp"
+#include "threadpool.hpp"
 
 #include <vector>
 #include <map>
 #include <memory>
 #include <algorithm>
+#include <type_traits>
+#include <utility>
 
 #include <iostream>
 #include <iomanip>
@@ -21,6 +26,7 @@ namespace nn
 class Layer;
 class Connection;
 class Network;
+class MappedFile;
 
 
 namespace train
@@ -33,36 +39,97 @@ class NetworkTrainer;
 class Layer
 {
   friend train::NetworkTrainer;
+  friend class InferenceModel;
+  friend class Network;
   
 public:
 
   Layer(int size_use, int batch_size_use, std::shared_ptr<ActivationFunction> activation_fn_use);
+  virtual ~Layer() {}
 
   void SetActivationFunction(std::shared_ptr<ActivationFunction> act_fn) { activation_fn = act_fn; }
   
-  void SetActivation(const dblmatrix& in) { activation = in; } // for input layers
-  void CalculateActivation();                                  // for hidden layers
+  // for input layers: binds the layer to the caller's batch without copying
+  // it.  The batch must stay alive until the next call.
+  void SetActivation(constrealview in)
+  {
+    assert(in.Rows() <= batch_size && in.Cols() == size);
+    input = in;
+    sparse_input = nullptr;
+    has_input = true;
+  }
+  // as above, for a sparse batch.  Outgoing connections then use the
+  // sparse kernels, and GetActivation() must not be used.
+  void SetActivation(const realsparsematrix& in)
+  {
+    assert(in.Rows() <= batch_size && in.Cols() == size);
+    sparse_input = &in;
+    has_input = true;
+  }
+  // for hidden layers: the rows first_row .. first_row + rows - 1 of the
+  // batch, so separate row ranges can be computed at once
+  virtual void CalculateActivation(int first_row, int rows);
+  void CalculateActivation() { CalculateActivation(0, activation.Rows()); }
+
+  virtual void AddToWorkspace(Workspace& workspace, const std::string& name);
+
+  // The number of patterns in the current batch, at most BatchSize().  The
+  // buffers keep their storage; only the first rows are computed.
+  virtual void SetRows(int rows)
+  {
+    net_input.SetRows(rows);
+    activation.SetRows(rows);
+  }
 
   int BatchSize() const { return batch_size; }
 
-  const dblmatrix& GetActivation() const { return activation; }
-  dblmatrix& GetActivation() { return activation; }
+  constrealview GetActivation() const { return has_input ? input : constrealview(activation); }
+  const realmatrix& GetActivationMatrix() const { return activation; }
+  const realsparsematrix* GetSparseActivation() const { return sparse_input; }
+
+  // The error summed over the batch.  If row_errors is given, the error of
+  // each pattern is also written there (batch size entries).
+  virtual realscalar TotalError(constrealview target_pattern, const ErrorFunction* error_fn,
+                                realscalar* row_errors = nullptr);
+
+  // Backprop through the activation.  Specialized layers (DenseLayer) do
+  // these in fused loops with the activation inlined; for other layers the
+  // trainer uses the batched ActivationFunction calls instead, and these
+  // per-element versions are only a fallback.
+  virtual bool IsSpecialized() const { return false; }
+
+  // delta *= f'(net_input).  delta and target may be a row range of the
+  // batch starting at first_row.
+  virtual void ScaleByDerivative(realview delta, int first_row = 0) const;
 
-  dblscalar TotalError(const dblmatrix& target_pattern, const ErrorFunction* error_fn);
+  // delta = dE(activation, target) * f'(net_input)
+  virtual void OutputDelta(constrealview target, const ErrorFunction* error_fn, realview delta,
+                           int first_row = 0) const;
 
   int Size() const { return size; }
 
+  // an input layer has no incoming connections, an output layer no outgoing ones
+  bool IsInput() const { return incoming.empty(); }
+  bool IsOutput() const { return outgoing.empty(); }
+
   auto GetActivationFunction() const { return activation_fn; }
 
   void AddIncomingConnection(Connection* in)  { incoming.push_back(in); }
   void AddOutgoingConnection(Connection* out) { outgoing.push_back(out); }
 
-private:
+protected:
+  // net_input = sum of the incoming connections, without the bias
+  void CalculateNetInput(int first_row, int rows);
+
   const int size;
   int batch_size;
-  dblmatrix net_input;
-  dblmatrix activation;
-  dblvector bias;
+  realmatrix net_input;
+  realmatrix activation;
+  realmatrix bias;        // a single row
+
+  constrealview input;  // bound by SetActivation, used instead of activation
+  const realsparsematrix* sparse_input;
+  bool has_input;
 
   std::shared_ptr<ActivationFunction> activation_fn;
 
@@ -76,6 +143,8 @@ private:
 class Connection
 {
   friend train::NetworkTrainer;
+  friend class InferenceModel;
+  friend class Network;
 
 public:
   Connection(Layer* from, Layer* to);
@@ -84,12 +153,58 @@ public:
   int Cols() const { return cols; }
   int Size() const { return size; }
 
-  void AccumulateNetInput(dblmatrix& net_input)
+  // net_input holds the rows of the batch from first_row on; a sparse
+  // input is always used whole
+  void AccumulateNetInput(realview net_input, int first_row = 0)
   {
-    nn::accum_A_BCt(net_input, layer_from->GetActivation(), weights);
+    if (auto sparse = layer_from->GetSparseActivation()) {
+      assert(first_row == 0);
+      nn::accum_A_SBt(net_input, *sparse, weights);
+    } else if (use_sparse_weights) {
+      nn::accum_A_BSt(net_input, layer_from->GetActivation().SubRows(first_row, net_input.Rows()), sparse_weights);
+    } else {
+      nn::accum_A_BCt(net_input, layer_from->GetActivation().SubRows(first_row, net_input.Rows()), weights);
+    }
+  }
+
+  // as above, but overwriting net_input
+  void CalculateNetInput(realview net_input, int first_row = 0)
+  {
+    if (layer_from->GetSparseActivation() || use_sparse_weights) {
+      for (int row = 0; row < net_input.Rows(); ++row) {
+        std::fill_n(net_input.GetRowPtr(row), net_input.Cols(), realscalar(0));
+      }
+      AccumulateNetInput(net_input, first_row);
+    } else {
+      nn::set_A_BCt(net_input, layer_from->GetActivation().SubRows(first_row, net_input.Rows()), weights);
+    }
   }
 
-  dblmatrix& GetWeights() { return weights; }
+  // After changing the weights through GetWeights, call UpdateSparseWeights
+  // (or Network::UpdateSparseWeights) if the connection is pruned.
+  realmatrix& GetWeights() { return weights; }
+  const realmatrix& GetWeights() const { return weights; }
+
+  // Magnitude pruning: zeroes the weights smaller than threshold in
+  // magnitude and from then on keeps every zero weight at zero (see
+  // ApplyMask).  Returns how many weights this call pruned.  The pruned
+  // connection keeps a compressed sparse row copy of its weights, and uses
+  // it for the net input of dense batches when its density is below
+  // break_even.
+  size_t Prune(realscalar threshold, double break_even);
+  bool IsPruned() const { return mask.Rows() != 0; }
+  // the fraction of the weights that aren't pruned
+  double Density() const;
+  bool UsesSparseWeights() const { return use_sparse_weights; }
+  const realsparsematrix& GetSparseWeights() const { return sparse_weights; }
+
+  // Zeroes the pruned weights again and copies the others into the sparse
+  // weights; training calls this after every update.
+  void ApplyMask();
+  // takes up changes to the weights, picking the kernel again
+  void UpdateSparseWeights(double break_even);
+
+  void AddToWorkspace(Workspace& workspace, const std::string& name) { workspace.Add(name + ".weights", weights); }
 
 private:
   Layer* layer_from;
@@ -99,7 +214,171 @@ private:
   int    cols;
   int    size;
 
-  dblmatrix weights;
+  realmatrix weights;
+
+  // only once pruned: 1 for the weights kept, 0 for those pruned, and the
+  // kept weights by row
+  realmatrix mask;
+  realsparsematrix sparse_weights;
+  bool use_sparse_weights;
+};
+
+
+
+// A layer whose activation, and optionally error function, are known at
+// compile time, e.g. DenseLayer<TanhActivation> for a hidden layer or
+// DenseLayer<SigmoidActivation, CrossEntropyError> for an output layer.
+// The bias is added in the same pass that applies the activation, and the
+// backprop steps inline f' and dE instead of going through virtual calls and
+// an activation_df buffer.  Err, when given, must be the type of the
+// network's error function.  Build these with Network::AddLayer<Act, Err>.
+template <typename Act, typename Err = void>
+class DenseLayer : public Layer
+{
+public:
+  template <typename... Args>
+  DenseLayer(int size_use, int batch_size_use, Args&&... act_args)
+    : Layer(size_use, batch_size_use, std::make_shared<Act>(std::forward<Args>(act_args)...)),
+      act(static_cast<const Act*>(activation_fn.get()))
+  {}
+
+  bool IsSpecialized() const override { return true; }
+
+  using Layer::CalculateActivation;
+  void CalculateActivation(int first_row, int rows) override
+  {
+    CalculateNetInput(first_row, rows);
+
+    const realscalar* b = bias.GetRowPtr(0);
+    for (int row = first_row; row < first_row + rows; ++row) {
+      realscalar* x = net_input.GetRowPtr(row);
+      for (int col = 0; col < size; ++col) {
+        x[col] += b[col];
+      }
+      act->Act::Apply(x, activation.GetRowPtr(row), size);
+    }
+  }
+
+  void ScaleByDerivative(realview delta, int first_row = 0) const override
+  {
+    for (int row = 0; row < delta.Rows(); ++row) {
+      const realscalar* x = net_input.GetRowPtr(first_row + row);
+      const realscalar* fx = activation.GetRowPtr(first_row + row);
+      realscalar* d = delta.GetRowPtr(row);
+      for (int col = 0; col < size; ++col) {
+        d[col] *= act->Act::df(x[col], fx[col]);
+      }
+    }
+  }
+
+  void OutputDelta(constrealview target, const ErrorFunction* error_fn, realview delta,
+                   int first_row = 0) const override
+  {
+    OutputDeltaWith(ErrorType(error_fn), target, delta, first_row);
+  }
+
+  realscalar TotalError(constrealview target, const ErrorFunction* error_fn,
+                        realscalar* row_errors = nullptr) override
+  {
+    return TotalErrorWith(ErrorType(error_fn), target, row_errors);
+  }
+
+private:
+  const Act* act;
+
+  // the static error function, or the network's one if Err is void
+  template <typename E = Err>
+  static typename std::enable_if<!std::is_void<E>::value, E>::type ErrorType(const ErrorFunction* error_fn)
+  {
+    assert(dynamic_cast<const E*>(error_fn));
+    return E();
+  }
+
+  template <typename E = Err>
+  static typename std::enable_if<std::is_void<E>::value, const ErrorFunction&>::type ErrorType(const ErrorFunction* error_fn)
+  {
+    return *error_fn;
+  }
+
+  // qualified (non-virtual) calls for a static error type
+  template <typename ErrT>
+  static double CallSum(const ErrT& err, const realscalar* x, const realscalar* t, size_t n) { return err.ErrT::Sum(x, t, n); }
+  template <typename ErrT>
+  static realscalar CalldE(const ErrT& err, realscalar x, realscalar t) { return err.ErrT::dE(x, t); }
+  static double CallSum(const ErrorFunction& err, const realscalar* x, const realscalar* t, size_t n) { return err.Sum(x, t, n); }
+  static realscalar CalldE(const ErrorFunction& err, realscalar x, realscalar t) { return err.dE(x, t); }
+
+  template <typename E>
+  void OutputDeltaWith(const E& err, constrealview target, realview delta, int first_row) const
+  {
+    for (int row = 0; row < delta.Rows(); ++row) {
+      const realscalar* x = net_input.GetRowPtr(first_row + row);
+      const realscalar* fx = activation.GetRowPtr(first_row + row);
+      const realscalar* t = target.GetRowPtr(row);
+      realscalar* d = delta.GetRowPtr(row);
+      for (int col = 0; col < size; ++col) {
+        d[col] = CalldE(err, fx[col], t[col]) * act->Act::df(x[col], fx[col]);
+      }
+    }
+  }
+
+  template <typename E>
+  realscalar TotalErrorWith(const E& err, constrealview target, realscalar* row_errors) const
+  {
+    double total_error = 0.0;
+    for (int row = 0; row < activation.Rows(); ++row) {
+      double row_error = CallSum(err, activation.GetRowPtr(row), target.GetRowPtr(row), size);
+      if (row_errors) {
+        row_errors[row] = row_error;
+      }
+      total_error += row_error;
+    }
+    return total_error;
+  }
+};
+
+
+
+// Softmax output layer for SoftmaxActivation.  The forward pass does the
+// max/exp/sum of each row once and keeps its log-sum-exp, so the
+// categorical cross-entropy is just lse - x at the target and the output
+// delta is p - t, with no divisions or log(0) cases.  Only valid as the
+// output layer of a network whose error function is
+// CategoricalCrossEntropyError, which PlanWorkspace checks.
+class SoftmaxLayer : public Layer
+{
+public:
+  SoftmaxLayer(int size_use, int batch_size_use,
+               std::shared_ptr<SoftmaxActivation> activation_fn_use = std::make_shared<SoftmaxActivation>());
+
+  using Layer::CalculateActivation;
+  void CalculateActivation(int first_row, int rows) override;
+  void AddToWorkspace(Workspace& workspace, const std::string& name) override;
+
+  realscalar TotalError(constrealview target, const ErrorFunction* error_fn,
+                        realscalar* row_errors = nullptr) override;
+
+  bool IsSpecialized() const override { return true; }
+  void OutputDelta(constrealview target, const ErrorFunction* error_fn, realview delta,
+                   int first_row = 0) const override;
+
+  void SetRows(int rows) override
+  {
+    Layer::SetRows(rows);
+    log_sum_exp.SetRows(rows);
+  }
+
+private:
+  const SoftmaxActivation* softmax;
+  realmatrix log_sum_exp;     // one column, per pattern
+};
+
+// AddLayer<SoftmaxActivation, CategoricalCrossEntropyError>
+template <typename Err>
+class DenseLayer<SoftmaxActivation, Err> : public SoftmaxLayer
+{
+public:
+  DenseLayer(int size_use, int batch_size_use) : SoftmaxLayer(size_use, batch_size_use) {}
 };
 
 
@@ -107,11 +386,16 @@ private:
 class Network : public utility::Observable
 {
   friend train::NetworkTrainer;
+  friend class InferenceModel;
 
-  static const int INPUT_LAYER = 0;
-  
 public:
-  // Network(const std::string& file_name);        // load a network from a file
+  // Loads a network written by Save (see modelfile.hpp).  With
+  // map_weights the connection weights stay in the read-only file mapping
+  // rather than being copied, so loading costs the same for any model size
+  // and processes serving the same file share its pages; such a network can
+  // score but not be trained.  Otherwise the weights are copied into the
+  // workspace as usual.
+  explicit Network(const std::string& file_name, int batch_size_use = 1, bool map_weights = true);
 
   Network(const std::vector<size_t>& layer_sizes,     // create a network with specified layer sizes
           int batch_size_use,
@@ -119,19 +403,128 @@ public:
           std::shared_ptr<ActivationFunction> out_act_fn,
           std::shared_ptr<ErrorFunction> err_function_use);
 
-  Network() {} // create an empty network
+  Network() : batch_size(0), current_epoch(0), last_error(0), workspace_planned(false) {} // create an empty network
+
+  // an empty network to add layers and connections to
+  Network(int batch_size_use, std::shared_ptr<ErrorFunction> err_function_use)
+    : batch_size(batch_size_use), current_epoch(0), last_error(0),
+      err_function(err_function_use), workspace_planned(false)
+  {}
   
   void AddLayer(size_t size, std::shared_ptr<ActivationFunction> act_fn)
   {
-    layers.emplace_back(std::make_shared<Layer>(size, batch_size, act_fn));
+    if (auto softmax = std::dynamic_pointer_cast<SoftmaxActivation>(act_fn)) {
+      layers.emplace_back(std::make_shared<SoftmaxLayer>(size, batch_size, softmax));
+    } else {
+      layers.emplace_back(std::make_shared<Layer>(size, batch_size, act_fn));
+    }
+    SortLayers();
+  }
+
+  // adds a DenseLayer<Act, Err>; act_args are passed to Act's constructor
+  template <typename Act, typename Err = void, typename... Args>
+  void AddLayer(size_t size, Args&&... act_args)
+  {
+    layers.emplace_back(std::make_shared<DenseLayer<Act, Err>>(size, batch_size, std::forward<Args>(act_args)...));
+    SortLayers();
   }
 
+  // Connects layer from to layer to, by the order they were added in.  Any
+  // DAG may be built: skip connections, several inputs (layers with no
+  // incoming connections) and several outputs (no outgoing ones).  Throws
+  // for a connection that already exists or would close a cycle.
+  void AddConnection(size_t from, size_t to);
+  // connects each layer to the next
   int AddDefaultConnections();
 
-  dblmatrix FeedForward(const dblmatrix& input_pattern);
-  dblscalar TotalError(const dblmatrix& target_pattern);
+  size_t NumLayers() const { return layers.size(); }
+  size_t NumInputs() const { return levels.empty() ? 0 : levels[0].size(); }
+  size_t NumOutputs() const { return outputs.size(); }
+  // the summed sizes of the input and of the output layers: the columns of
+  // an input pattern and of a target
+  int InputSize() const;
+  int OutputSize() const;
+  // the most patterns FeedForward takes at once
+  int BatchSize() const { return batch_size; }
+
+  // The layers of a level only depend on layers of earlier levels, so with
+  // a thread pool each level's layers run side by side, in FeedForward and
+  // in training.  Layers that are computed one after another ignore it.
+  void SetThreadPool(std::shared_ptr<utility::ThreadPool> pool) { thread_pool = pool; SplitStages(); }
+
+  // Pipelines FeedForward and training for batches of more than
+  // micro_batch rows.  The batch is cut into micro-batches of that many
+  // rows and the levels into num_stages runs of about equal cost (0 for
+  // one per thread of the pool).  While a stage works on one micro-batch
+  // the stage before it works on the next, so every thread has work even
+  // when the GEMMs of a single layer are too small to split.  A stage runs
+  // its layers one after another.  Sparse batches, and those of at most
+  // micro_batch rows, run whole as usual.  0 turns it off.
+  void SetPipeline(int micro_batch_use, int num_stages = 0)
+  {
+    micro_batch = micro_batch_use;
+    requested_stages = num_stages;
+    SplitStages();
+  }
+  size_t NumPipelineStages() const { return pipeline_stages.size(); }
+
+  // Magnitude pruning of the weights of every connection, see
+  // Connection::Prune.  Prune uses one threshold for the whole network;
+  // PruneToSparsity picks it so that a fraction sparsity of the weights
+  // (not counting the padding) are zero, over all the connections at once
+  // or within each.  Ties at the threshold may leave a few more.  Training
+  // afterwards fine-tunes the remaining weights.  Both return how many
+  // weights they pruned.
+  size_t Prune(realscalar threshold);
+  size_t PruneToSparsity(double sparsity, bool per_connection = false);
+  // Pruned connections sparser than this use the sparse kernel for dense
+  // batches; by default the density measured by nn::SparseBreakEven.
+  void SetSparseBreakEven(double density) { sparse_break_even = density; UpdateSparseWeights(); }
+  double SparseBreakEven() const { return sparse_break_even < 0 ? nn::SparseBreakEven() : sparse_break_even; }
+  // after changing the weights of pruned connections other than by training
+  void UpdateSparseWeights();
+
+  size_t NumConnections() const { return connections.size(); }
+  const Connection& GetConnection(size_t c) const { return *connections[c]; }
+
+  // writes the topology, activation and error functions, weights and biases
+  void Save(const std::string& file_name) const;
+  bool HasMappedWeights() const { return weights_file != nullptr; }
+
+  // The returned activation of the last output layer stays valid until the
+  // next call; GetOutput has the others.  The input may have any number of
+  // rows up to the batch size, and only those rows are computed.  With
+  // several input layers the columns of input_pattern are split between
+  // them in the order they were added; a sparse input needs a single input
+  // layer.
+  const realmatrix& FeedForward(constrealview input_pattern);
+  const realmatrix& FeedForward(const realsparsematrix& input_pattern);
+  const realmatrix& GetOutput(size_t i) const { return layers[outputs[i]]->GetActivationMatrix(); }
+  // The error of the last FeedForward, optionally per pattern as in
+  // Layer::TotalError.  The columns of target_pattern are split between the
+  // output layers like the input.
+  realscalar TotalError(constrealview target_pattern, realscalar* row_errors = nullptr);
+
+  // Lays out every layer and connection buffer in the network's single
+  // workspace arena.  Done by the constructor and by FeedForward after the
+  // topology changes; call again to move onto huge pages.  Throws if a
+  // softmax layer isn't an output layer with categorical cross-entropy.
+  void PlanWorkspace();
+  // Accuracy of the exp/tanh used by the activation functions of every
+  // layer.  Activation function objects shared with other networks change
+  // for those too.
+  void SetMathAccuracy(fastmath::Accuracy accuracy)
+  {
+    for (auto& layer : layers) {
+      layer->GetActivationFunction()->SetAccuracy(accuracy);
+    }
+  }
+
+  void UseHugePages(bool use) { workspace.UseHugePages(use); PlanWorkspace(); }
+  const Workspace& GetWorkspace() const { return workspace; }
 
   int GetCurrentEpoch() const { return current_epoch; }
+  // only current during epochs in which an observer NeedsError
   double GetLastError() const { return last_error; }
 
 private:
@@ -143,18 +536,33 @@ private:
   std::vector<std::shared_ptr<Layer>> layers;
   std::vector<std::shared_ptr<Connection>> connections;
 
+  // layer indices by level: the inputs, then each layer one level after
+  // the latest of the layers feeding it
+  std::vector<std::vector<size_t>> levels;
+  std::vector<size_t> outputs;
+
   std::shared_ptr<ErrorFunction> err_function;
+  std::shared_ptr<utility::ThreadPool> thread_pool;
 
-  void AddConnection(Layer* from, Layer* to);
-};
+  int micro_batch = 0;                  // see SetPipeline
+  int requested_stages = 0;
+  // the levels [first, second) of each pipeline stage; empty when not pipelining
+  std::vector<std::pair<size_t, size_t>> pipeline_stages;
 
+  double sparse_break_even = -1;        // see SetSparseBreakEven; < 0 to measure
 
-class SimpleRecurrentNetwork
-{
-public:
+  Workspace workspace;
+  bool workspace_planned;
 
-private:
-  Network ff_network;
+  std::shared_ptr<const MappedFile> weights_file;   // set when the weights are mapped
+
+  void SortLayers();
+  void EnsureWorkspace();
+  bool Reaches(size_t from, size_t to) const;
+  void SplitStages();
+  bool Pipelines(int rows) const;
+  void SetRows(int rows);
+  const realmatrix& PropagateInput();
 };
 
 
@@ -175,9 +583,14 @@ public:
 
   void UpdateEpoch() override {}
 
+  bool NeedsError(int epoch) const override
+  {
+    return (epoch == 0) || (epoch % save_frequency == 0);
+  }
+
   void AccumulateErrorStatistics(int epoch)
   {
-    if ((epoch == 0) || (epoch % save_frequency == 0)) {
+    if (NeedsError(epoch)) {
       total_error[epoch] += network.GetLastError();
     }
   }
@@ -208,13 +621,20 @@ public:
 
   void UpdateBatch() override
   {
-    total_error += network.GetLastError();
+    if (NeedsError(network.GetCurrentEpoch())) {
+      total_error += network.GetLastError();
+    }
+  }
+
+  bool NeedsError(int epoch) const override
+  {
+    return (epoch == 0) || (epoch % save_frequency == 0);
   }
 
   void UpdateEpoch() override
   {
     int epoch = network.GetCurrentEpoch();
-    if ((epoch == 0) || (epoch % save_frequency == 0)) {
+    if (NeedsError(epoch)) {
       std::cout << std::setw(6) << epoch << ' ';
       std::cout << std::setw(17) << std::setprecision(4) << std::fixed << total_error;
       if (timer) {
@@ -0,0 +1,251 @@
+#include "predictor.hpp"
+#include "network.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+namespace nn
+{
+
+
+
+BatchingPredictor::BatchingPredictor(Network& network_use, int max_batch_use,
+                                     std::chrono::microseconds max_delay_use)
+  : network(network_use),
+    max_batch(max_batch_use > 0 ? max_batch_use : network_use.BatchSize()),
+    max_delay(max_delay_use),
+    input_size(network_use.InputSize()),
+    stopping(false),
+    batch(max_batch, input_size, realmatrix::PaddedLd(input_size)),
+    batches(0)
+{
+  if (max_batch_use < 0 || max_batch > network.BatchSize()) {
+    throw "BatchingPredictor: max_batch must be between 1 and the network's batch size.";
+  }
+  if (network.NumOutputs() == 0) {
+    throw "BatchingPredictor: the network has no output layer.";
+  }
+  scheduler = std::thread([this]() { Schedule(); });
+}
+
+
+
+BatchingPredictor::~BatchingPredictor()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  arrived.notify_all();
+  scheduler.join();
+}
+
+
+
+std::future<realvector>
+BatchingPredictor::Submit(realvector pattern)
+{
+  auto promise = std::make_shared<std::promise<realvector>>();
+  auto future = promise->get_future();
+  Enqueue(std::move(pattern),
+          [promise](const realvector& out) { promise->set_value(out); },
+          [promise](std::exception_ptr e) { promise->set_exception(e); });
+  return future;
+}
+
+
+
+void
+BatchingPredictor::Enqueue(realvector pattern, std::function<void(const realvector&)> deliver,
+                           std::function<void(std::exception_ptr)> fail)
+{
+  if (int(pattern.size()) != input_size) {
+    throw "BatchingPredictor::Submit: the pattern doesn't match the network's input size.";
+  }
+
+  bool wake;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) {
+      throw "BatchingPredictor::Submit: the predictor is shutting down.";
+    }
+    pending.push_back({ std::move(pattern), std::move(deliver), std::move(fail), Clock::now() });
+    // the scheduler is either waiting for a first request or for the
+    // batch to fill up
+    wake = pending.size() == 1 || int(pending.size()) == max_batch;
+  }
+  if (wake) {
+    arrived.notify_one();
+  }
+}
+
+
+
+void
+BatchingPredictor::Schedule()
+{
+  std::vector<Request> requests;
+  requests.reserve(max_batch);
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      arrived.wait(lock, [this]() { return stopping || !pending.empty(); });
+      if (pending.empty()) {
+        return;
+      }
+      // when shutting down the queue is served without waiting
+      const auto deadline = pending.front().submitted + max_delay;
+      arrived.wait_until(lock, deadline, [this]() {
+          return stopping || int(pending.size()) >= max_batch;
+        });
+
+      const int n = std::min(int(pending.size()), max_batch);
+      std::move(pending.begin(), pending.begin() + n, std::back_inserter(requests));
+      pending.erase(pending.begin(), pending.begin() + n);
+    }
+
+    RunBatch(requests);
+    requests.clear();
+  }
+}
+
+
+
+void
+BatchingPredictor::RunBatch(std::vector<Request>& requests)
+{
+  const int n = requests.size();
+  for (int row = 0; row < n; ++row) {
+    batch.SetRowValues(row, requests[row].pattern);
+  }
+
+  std::exception_ptr error;
+  try {
+    network.FeedForward(constrealview(batch).SubRows(0, n));
+  }
+  catch (...) {
+    error = std::current_exception();
+  }
+
+  // counted before the results are handed out, so a caller that has its
+  // result also finds it in the stats
+  {
+    const auto finished = Clock::now();
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if (batches == 0) {
+      first_submitted = requests.front().submitted;
+    }
+    ++batches;
+    for (const auto& request : requests) {
+      latencies.push_back(std::chrono::duration<double, std::micro>(finished - request.submitted).count());
+    }
+    last_finished = finished;
+  }
+
+  realvector out(error ? 0 : network.OutputSize());
+  for (int row = 0; row < n; ++row) {
+    Request& request = requests[row];
+    if (error) {
+      request.fail(error);
+      continue;
+    }
+    auto dest = out.begin();
+    for (size_t o = 0; o < network.NumOutputs(); ++o) {
+      const realmatrix& output = network.GetOutput(o);
+      dest = std::copy_n(output.GetRowPtr(row), output.Cols(), dest);
+    }
+    try {
+      request.deliver(out);
+    }
+    catch (...) {
+      request.fail(std::current_exception());   // from decoding
+    }
+  }
+}
+
+
+
+PredictorStats
+BatchingPredictor::GetStats() const
+{
+  std::vector<double> sorted;
+  PredictorStats stats = { 0, 0, 0, 0, 0, 0, 0 };
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if (batches == 0) {
+      return stats;
+    }
+    sorted = latencies;
+    stats.batches = batches;
+    const double seconds = std::chrono::duration<double>(last_finished - first_submitted).count();
+    stats.requests_per_second = seconds > 0 ? latencies.size() / seconds : 0;
+  }
+
+  // nearest rank
+  auto percentile = [&sorted](double p) {
+    auto nth = sorted.begin() + std::max(0, int(std::ceil(p*sorted.size())) - 1);
+    std::nth_element(sorted.begin(), nth, sorted.end());
+    return *nth;
+  };
+  stats.requests = sorted.size();
+  stats.mean_batch_size = double(stats.requests) / stats.batches;
+  stats.p50_latency = percentile(0.5);
+  stats.p99_latency = percentile(0.99);
+  stats.max_latency = *std::max_element(sorted.begin(), sorted.end());
+  return stats;
+}
+
+
+
+void
+BatchingPredictor::ResetStats()
+{
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  latencies.clear();
+  batches = 0;
+}
+
+
+
+PredictorStats
+GenerateLoad(BatchingPredictor& predictor, const std::vector<realvector>& patterns,
+             int clients, int requests_per_client)
+{
+  if (patterns.empty()) {
+    throw "GenerateLoad: no patterns.";
+  }
+
+  predictor.ResetStats();
+
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  std::vector<std::thread> threads;
+  for (int c = 0; c < clients; ++c) {
+    threads.emplace_back([&, c]() {
+        try {
+          for (int r = 0; r < requests_per_client; ++r) {
+            predictor.Submit(patterns[(size_t(c)*requests_per_client + r) % patterns.size()]).get();
+          }
+        }
+        catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+      });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  return predictor.GetStats();
+}
+
+
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "matrix.hpp"
+#include "input.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nn
+{
+
+class Network;
+
+
+
+// Latency and throughput of the requests a BatchingPredictor finished
+// since its stats were last reset.  Latencies are from Submit to the
+// end of its batch's forward pass, in microseconds.
+struct PredictorStats
+{
+  size_t requests;
+  size_t batches;
+  double mean_batch_size;
+  double p50_latency;
+  double p99_latency;
+  double max_latency;
+  double requests_per_second;   // from the first submission to the last result
+};
+
+
+
+// Serves single patterns from any number of threads through one Network.
+// Submit queues a pattern and returns a future for the network's output;
+// a scheduler thread gathers the waiting requests into a batch, runs one
+// FeedForward over it and hands each caller its row.  A batch runs once it
+// has max_batch requests, or once its oldest request has waited max_delay,
+// so a lone request isn't held longer than that and a busy predictor runs
+// full batches.
+//
+// The network is used only by the scheduler while the predictor exists.
+// With several output layers the result is all of them, in order.  Errors
+// from FeedForward are passed on through the futures of that batch.
+class BatchingPredictor
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // max_batch 0 for the network's batch size
+  explicit BatchingPredictor(Network& network_use, int max_batch_use = 0,
+                             std::chrono::microseconds max_delay_use = std::chrono::microseconds(500));
+  // serves what is still queued, then stops
+  ~BatchingPredictor();
+
+  BatchingPredictor(const BatchingPredictor&) = delete;
+  BatchingPredictor& operator=(const BatchingPredictor&) = delete;
+
+  std::future<realvector> Submit(realvector pattern);
+
+  // encodes data, and decodes the result, with the given encoders, which
+  // must outlive the request
+  template <typename InputType, typename OutputType>
+  std::future<OutputType> Submit(const input::InputEncoder<InputType>& input_encoder, const InputType& data,
+                                 const input::InputEncoder<OutputType>& output_encoder)
+  {
+    auto promise = std::make_shared<std::promise<OutputType>>();
+    auto future = promise->get_future();
+    Enqueue(input_encoder.Encode(&data),
+            [promise, &output_encoder](const realvector& out) { promise->set_value(output_encoder.Decode(out)); },
+            [promise](std::exception_ptr e) { promise->set_exception(e); });
+    return future;
+  }
+
+  int MaxBatch() const { return max_batch; }
+  std::chrono::microseconds MaxDelay() const { return max_delay; }
+
+  PredictorStats GetStats() const;
+  void ResetStats();
+
+private:
+  struct Request
+  {
+    realvector pattern;
+    std::function<void(const realvector&)> deliver;
+    std::function<void(std::exception_ptr)> fail;
+    Clock::time_point submitted;
+  };
+
+  Network& network;
+  const int max_batch;
+  const std::chrono::microseconds max_delay;
+  const int input_size;
+
+  std::mutex mutex;
+  std::condition_variable arrived;
+  std::deque<Request> pending;
+  bool stopping;
+
+  realmatrix batch;         // max_batch x input_size, the scheduler's
+
+  mutable std::mutex stats_mutex;
+  std::vector<double> latencies;
+  size_t batches;
+  Clock::time_point first_submitted;
+  Clock::time_point last_finished;
+
+  std::thread scheduler;
+
+  void Enqueue(realvector pattern, std::function<void(const realvector&)> deliver,
+               std::function<void(std::exception_ptr)> fail);
+  void Schedule();
+  void RunBatch(std::vector<Request>& requests);
+};
+
+
+
+// A closed-loop load generator: each of clients threads submits
+// requests_per_client patterns, taken in turn from patterns, waiting for
+// each result before sending the next.  Returns the predictor's stats for
+// just this run.
+PredictorStats GenerateLoad(BatchingPredictor& predictor, const std::vector<realvector>& patterns,
+                            int clients, int requests_per_client);
+
+
+}
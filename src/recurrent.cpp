@@ -0,0 +1,397 @@
+#include "recurrent.hpp"
+#include "expression.hpp"
+#include "utility.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+
+namespace nn
+{
+
+
+
+SimpleRecurrentNetwork::SimpleRecurrentNetwork(int input_size_use, int hidden_size_use, int output_size_use,
+                                               int batch_size_use, int max_steps_use,
+                                               std::shared_ptr<ActivationFunction> hid_act_fn,
+                                               std::shared_ptr<ActivationFunction> out_act_fn,
+                                               std::shared_ptr<ErrorFunction> err_function_use)
+  : batch_size(batch_size_use),
+    max_steps(max_steps_use),
+    num_sequences(0),
+    steps(0),
+    hidden_fn(hid_act_fn),
+    output_fn(out_act_fn),
+    softmax(dynamic_cast<const SoftmaxActivation*>(out_act_fn.get())),
+    err_function(err_function_use),
+    w_input(hidden_size_use, input_size_use, realmatrix::PaddedLd(input_size_use), nullptr),
+    w_context(hidden_size_use, hidden_size_use, realmatrix::PaddedLd(hidden_size_use), nullptr),
+    w_output(output_size_use, hidden_size_use, realmatrix::PaddedLd(hidden_size_use), nullptr),
+    bias_hidden(1, hidden_size_use, realmatrix::PaddedLd(hidden_size_use), nullptr),
+    bias_output(1, output_size_use, realmatrix::PaddedLd(output_size_use), nullptr),
+    net_hidden(max_steps*batch_size, hidden_size_use, realmatrix::PaddedLd(hidden_size_use), nullptr),
+    hidden(max_steps*batch_size, hidden_size_use, realmatrix::PaddedLd(hidden_size_use), nullptr),
+    net_output(max_steps*batch_size, output_size_use, realmatrix::PaddedLd(output_size_use), nullptr),
+    output(max_steps*batch_size, output_size_use, realmatrix::PaddedLd(output_size_use), nullptr),
+    context(batch_size, hidden_size_use, realmatrix::PaddedLd(hidden_size_use), nullptr),
+    input(nullptr, 0, input_size_use)
+{
+  // the hidden activation is applied to a whole step at once, which a
+  // softmax would normalise across sequences
+  if (dynamic_cast<const SoftmaxActivation*>(hidden_fn.get())) {
+    throw "Softmax is only supported on the output layer.";
+  }
+  if (softmax && !dynamic_cast<const CategoricalCrossEntropyError*>(err_function.get())) {
+    throw "A softmax output layer needs CategoricalCrossEntropyError.";
+  }
+
+  workspace.Add("input.weights", w_input);
+  workspace.Add("context.weights", w_context);
+  workspace.Add("output.weights", w_output);
+  workspace.Add("hidden.bias", bias_hidden);
+  workspace.Add("output.bias", bias_output);
+  workspace.Add("hidden.net_input", net_hidden);
+  workspace.Add("hidden.activation", hidden);
+  workspace.Add("output.net_input", net_output);
+  workspace.Add("output.activation", output);
+  workspace.Add("context", context);
+  workspace.Allocate();
+
+  ResetContext(batch_size);
+}
+
+
+
+void
+SimpleRecurrentNetwork::ResetContext(int num_sequences_use)
+{
+  if (num_sequences_use > batch_size) {
+    throw "SimpleRecurrentNetwork::ResetContext: more sequences than the batch size.";
+  }
+  num_sequences = num_sequences_use;
+  steps = 0;
+  context.SetRows(num_sequences);
+  std::fill(begin(context), end(context), realscalar(0));
+}
+
+
+
+const realmatrix&
+SimpleRecurrentNetwork::FeedForward(constrealview input_use, int steps_use)
+{
+  if (steps_use < 1 || steps_use > max_steps || input_use.Rows() != steps_use*num_sequences) {
+    throw "SimpleRecurrentNetwork::FeedForward: the input isn't max_steps steps or fewer of the current sequences.";
+  }
+  if (input_use.Cols() != InputSize()) {
+    throw "SimpleRecurrentNetwork::FeedForward: the input doesn't match the input size.";
+  }
+
+  // carry the last hidden activation of the previous segment
+  if (steps > 0) {
+    auto last = Step(static_cast<const realmatrix&>(hidden), steps - 1);
+    for (int row = 0; row < num_sequences; ++row) {
+      std::copy_n(last.GetRowPtr(row), HiddenSize(), context.GetRowPtr(row));
+    }
+  }
+
+  steps = steps_use;
+  input = input_use;
+  const int rows = steps*num_sequences;
+  for (auto m : { &net_hidden, &hidden, &net_output, &output }) {
+    m->SetRows(rows);
+  }
+
+  // the input projections of every step at once
+  set_A_BCt(net_hidden, input, w_input);
+
+  const realscalar* b = bias_hidden.GetRowPtr(0);
+  for (int t = 0; t < steps; ++t) {
+    realview x = Step(net_hidden, t);
+    accum_A_BCt(x, t == 0 ? constrealview(context) : Step(static_cast<const realmatrix&>(hidden), t - 1), w_context);
+    for (int row = 0; row < num_sequences; ++row) {
+      realscalar* x_row = x.GetRowPtr(row);
+      for (int col = 0; col < HiddenSize(); ++col) {
+        x_row[col] += b[col];
+      }
+    }
+    // one call for the step, padding included, as in Layer::CalculateActivation
+    hidden_fn->Apply(x.GetPtr(), Step(hidden, t).GetPtr(), num_sequences*x.LeadingDim());
+  }
+
+  // and the outputs of every step at once
+  set_A_BCt(net_output, hidden, w_output);
+
+  const realscalar* c = bias_output.GetRowPtr(0);
+  for (int row = 0; row < rows; ++row) {
+    realscalar* x = net_output.GetRowPtr(row);
+    for (int col = 0; col < OutputSize(); ++col) {
+      x[col] += c[col];
+    }
+    if (softmax) {
+      softmax->ApplyRow(x, output.GetRowPtr(row), OutputSize());
+    }
+  }
+  if (!softmax) {
+    output_fn->Apply(net_output.GetPtr(), output.GetPtr(), net_output.StorageSize());
+  }
+
+  return output;
+}
+
+
+
+realscalar
+SimpleRecurrentNetwork::TotalError(constrealview target) const
+{
+  double total_error = 0.0;
+  for (int row = 0; row < output.Rows(); ++row) {
+    total_error += err_function->Sum(output.GetRowPtr(row), target.GetRowPtr(row), OutputSize());
+  }
+  return total_error;
+}
+
+
+
+namespace train
+{
+
+BpttTrainingAlgorithm::BpttTrainingAlgorithm(SimpleRecurrentNetwork& network_use,
+                                             const BackpropTrainingParameters& params_use)
+  : network(network_use),
+    params(params_use),
+    training_data(nullptr),
+    last_error(0),
+    delta_hidden(network.hidden.Capacity(), network.HiddenSize(), network.hidden.LeadingDim(), nullptr),
+    delta_output(network.output.Capacity(), network.OutputSize(), network.output.LeadingDim(), nullptr),
+    hidden_df(network.hidden.Capacity(), network.HiddenSize(), network.hidden.LeadingDim(), nullptr),
+    ones(network.hidden.Capacity(), 1, 1, nullptr),
+    dw_input(network.w_input.Rows(), network.w_input.Cols(), network.w_input.LeadingDim(), nullptr),
+    dw_input_previous(network.w_input.Rows(), network.w_input.Cols(), network.w_input.LeadingDim(), nullptr),
+    dw_context(network.w_context.Rows(), network.w_context.Cols(), network.w_context.LeadingDim(), nullptr),
+    dw_context_previous(network.w_context.Rows(), network.w_context.Cols(), network.w_context.LeadingDim(), nullptr),
+    dw_output(network.w_output.Rows(), network.w_output.Cols(), network.w_output.LeadingDim(), nullptr),
+    dw_output_previous(network.w_output.Rows(), network.w_output.Cols(), network.w_output.LeadingDim(), nullptr),
+    d_bias_hidden(1, network.HiddenSize(), network.bias_hidden.LeadingDim(), nullptr),
+    d_bias_output(1, network.OutputSize(), network.bias_output.LeadingDim(), nullptr)
+{
+  workspace.Add("hidden.delta", delta_hidden);
+  workspace.Add("output.delta", delta_output);
+  workspace.Add("hidden.activation_df", hidden_df);
+  workspace.Add("ones", ones, realscalar(1));
+  workspace.Add("input.delta_w", dw_input);
+  workspace.Add("input.delta_w_previous", dw_input_previous);
+  workspace.Add("context.delta_w", dw_context);
+  workspace.Add("context.delta_w_previous", dw_context_previous);
+  workspace.Add("output.delta_w", dw_output);
+  workspace.Add("output.delta_w_previous", dw_output_previous);
+  workspace.Add("hidden.d_bias", d_bias_hidden);
+  workspace.Add("output.d_bias", d_bias_output);
+  workspace.Allocate();
+}
+
+
+
+// uniform in +-1/sqrt(fan in), the biases in +-0.5 as in backprop
+void
+BpttTrainingAlgorithm::InitializeNetwork()
+{
+  auto seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+  std::mt19937 mt_rand(seed);
+
+  auto fill = [&](realmatrix& m, double range) {
+    std::uniform_real_distribution<realscalar> dist(-range, range);
+    for (int row = 0; row < m.Rows(); ++row) {
+      auto r = m.GetRow(row);
+      std::generate(r.begin(), r.end(), [&]() { return dist(mt_rand); });
+    }
+  };
+  fill(network.w_input, 1 / std::sqrt(double(network.InputSize() + network.HiddenSize())));
+  fill(network.w_context, 1 / std::sqrt(double(network.InputSize() + network.HiddenSize())));
+  fill(network.w_output, 1 / std::sqrt(double(network.HiddenSize())));
+  fill(network.bias_hidden, 0.5);
+  fill(network.bias_output, 0.5);
+}
+
+
+
+void
+BpttTrainingAlgorithm::Train()
+{
+  if (!training_data) {
+    std::cerr << "No training data selected." << std::endl;
+    return;
+  }
+
+  const int max_steps = network.MaxSteps();
+
+  for (int epoch = 0; epoch <= params.max_epochs; ++epoch) {
+    bool check_error = (params.min_error > 0) && (params.error_check_interval <= 1 || epoch % params.error_check_interval == 0);
+    utility::KahanSum total_error;
+
+    for (auto& batch : *training_data) {
+      const int n = batch.NumSequences();
+      network.ResetContext(n);
+
+      for (int first = 0; first < batch.Steps(); first += max_steps) {
+        const int steps = std::min(max_steps, batch.Steps() - first);
+        auto target = constrealview(batch.Output()).SubRows(first*n, steps*n);
+
+        network.FeedForward(constrealview(batch.Input()).SubRows(first*n, steps*n), steps);
+        if (check_error) {
+          total_error.Add(network.TotalError(target));
+        }
+        Backpropagate(target);
+      }
+    }
+
+    if (check_error) {
+      last_error = total_error.Value();
+      if (last_error < params.min_error) {
+        std::cout << epoch << "\t" << last_error << std::endl;
+        break;
+      }
+    }
+  }
+}
+
+
+
+void
+BpttTrainingAlgorithm::OutputDelta(constrealview target)
+{
+  const auto& net = network.net_output;
+  const auto& y = network.output;
+  const int size = network.OutputSize();
+  const ErrorFunction& err = *network.err_function;
+  const ActivationFunction& act = *network.output_fn;
+  const realscalar scale = act.CanonicalDeltaScale(err);
+
+  for (int row = 0; row < y.Rows(); ++row) {
+    const realscalar* x = net.GetRowPtr(row);
+    const realscalar* fx = y.GetRowPtr(row);
+    const realscalar* t = target.GetRowPtr(row);
+    realscalar* d = delta_output.GetRowPtr(row);
+    if (network.softmax) {
+      // as SoftmaxLayer::OutputDelta
+      const realscalar t_sum = std::accumulate(t, t + size, realscalar(0));
+      for (int col = 0; col < size; ++col) {
+        d[col] = t_sum*fx[col] - t[col];
+      }
+    } else if (scale != 0) {
+      for (int col = 0; col < size; ++col) {
+        d[col] = scale*(fx[col] - t[col]);
+      }
+    } else {
+      for (int col = 0; col < size; ++col) {
+        d[col] = err.dE(fx[col], t[col]) * act.df(x[col], fx[col]);
+      }
+    }
+  }
+}
+
+
+
+void
+BpttTrainingAlgorithm::Backpropagate(constrealview target)
+{
+  using namespace expr;
+
+  const int n = network.num_sequences;
+  const int steps = network.steps;
+  const int rows = steps*n;
+  for (auto m : { &delta_hidden, &delta_output, &hidden_df, &ones }) {
+    m->SetRows(rows);
+  }
+  const auto& hidden = network.hidden;
+  auto step = [n](const realmatrix& m, int t) { return constrealview(m).SubRows(t*n, n); };
+
+  OutputDelta(target);
+  accum_A_BtC(dw_output, delta_output, hidden);
+  accum_A_BtC(d_bias_output, ones, delta_output);
+
+  // the hidden deltas from the outputs of every step at once, then the
+  // steps back from the last, each adding what it passes on through the
+  // context
+  std::fill(begin(delta_hidden), end(delta_hidden), realscalar(0));
+  accum_A_BC(delta_hidden, delta_output, network.w_output);
+  network.hidden_fn->Derivative(network.net_hidden.GetPtr(), hidden.GetPtr(), hidden_df.GetPtr(), hidden_df.StorageSize());
+
+  for (int t = steps - 1; t >= 0; --t) {
+    realview d = realview(delta_hidden).SubRows(t*n, n);
+    if (t < steps - 1) {
+      accum_A_BC(d, step(delta_hidden, t + 1), network.w_context);
+    }
+    Assign(d, Ref(d) * Ref(step(hidden_df, t)));
+  }
+
+  // the context of step t is the hidden activation of step t - 1, and of
+  // the first step the context carried into the segment
+  if (steps > 1) {
+    accum_A_BtC(dw_context, constrealview(delta_hidden).SubRows(n, rows - n), constrealview(hidden).SubRows(0, rows - n));
+  }
+  accum_A_BtC(dw_context, step(delta_hidden, 0), network.context);
+  accum_A_BtC(dw_input, delta_hidden, network.input);
+  accum_A_BtC(d_bias_hidden, ones, delta_hidden);
+
+  UpdateWeights(network.w_input, dw_input, dw_input_previous);
+  UpdateWeights(network.w_context, dw_context, dw_context_previous);
+  UpdateWeights(network.w_output, dw_output, dw_output_previous);
+  UpdateBias(network.bias_hidden, d_bias_hidden);
+  UpdateBias(network.bias_output, d_bias_output);
+}
+
+
+
+// as BackpropConnection::UpdateWeights
+void
+BpttTrainingAlgorithm::UpdateWeights(realmatrix& weights, realmatrix& dw, realmatrix& dw_previous)
+{
+  realscalar scale = 1;
+  if (params.normalize_gradient) {
+    realscalar norm = dw.Norm();
+    if (norm > 1.0) {
+      scale = 1 / norm;
+    }
+  }
+
+  const realscalar momentum = params.momentum;
+  const realscalar decay = 1 - params.weight_decay;
+  const realscalar rate = params.learning_rate;
+
+  if (momentum > 0) {
+    expr::ForEach([=](realscalar& w, realscalar& d, realscalar& d_prev) {
+                    realscalar step = scale*d + momentum*d_prev;
+                    d_prev = step;
+                    w = decay*w - rate*step;
+                    d = 0;
+                  },
+                  weights, dw, dw_previous);
+  } else {
+    expr::ForEach([=](realscalar& w, realscalar& d) {
+                    w = decay*w - rate*scale*d;
+                    d = 0;
+                  },
+                  weights, dw);
+  }
+}
+
+
+
+void
+BpttTrainingAlgorithm::UpdateBias(realmatrix& bias, realmatrix& d_bias)
+{
+  const realscalar rate = params.learning_rate;
+  expr::ForEach([=](realscalar& b, realscalar& d) {
+                  b -= rate*d;
+                  d = 0;
+                },
+                bias, d_bias);
+}
+
+}
+
+
+}
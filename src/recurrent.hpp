@@ -0,0 +1,194 @@
+#pragma once
+
+#include "matrix.hpp"
+#include "workspace.hpp"
+#include "activation.hpp"
+#include "error.hpp"
+#include "train.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace nn
+{
+
+namespace train
+{
+class BpttTrainingAlgorithm;
+}
+
+
+
+// A batch of equally long sequences for a SimpleRecurrentNetwork, stored
+// time-major: row t*NumSequences() + s holds step t of sequence s, so each
+// step of the whole batch is a block of consecutive rows.
+class SequenceBatch
+{
+public:
+  SequenceBatch(int num_sequences_use, int steps_use, int input_length, int output_length)
+    : num_sequences(num_sequences_use),
+      steps(steps_use),
+      input(steps*num_sequences, input_length, realmatrix::PaddedLd(input_length)),
+      output(steps*num_sequences, output_length, realmatrix::PaddedLd(output_length))
+  {}
+
+  void SetStep(int sequence, int step, const realvector& in, const realvector& out)
+  {
+    if (sequence >= num_sequences || step >= steps) {
+      throw "SequenceBatch::SetStep: no such sequence or step.";
+    }
+    input.SetRowValues(step*num_sequences + sequence, in);
+    output.SetRowValues(step*num_sequences + sequence, out);
+  }
+
+  int NumSequences() const { return num_sequences; }
+  int Steps() const { return steps; }
+  const realmatrix& Input() const { return input; }
+  const realmatrix& Output() const { return output; }
+
+private:
+  int num_sequences;
+  int steps;
+  realmatrix input;
+  realmatrix output;
+};
+
+
+
+// An Elman network: input -> hidden -> output, where the hidden layer is
+// also fed, through the context units, its own activation from the step
+// before.  A batch of sequences runs a segment of steps at a time.  The
+// activations of every step of a segment live in one time-major buffer
+// per layer, so the input projections of all the steps are a single GEMM
+// up front, each step is then one GEMM over the whole batch for the
+// context, and the outputs of all the steps are again a single GEMM.
+class SimpleRecurrentNetwork
+{
+  friend train::BpttTrainingAlgorithm;
+
+public:
+  // batch_size sequences at most, max_steps steps at most per segment
+  SimpleRecurrentNetwork(int input_size_use, int hidden_size_use, int output_size_use,
+                         int batch_size_use, int max_steps_use,
+                         std::shared_ptr<ActivationFunction> hid_act_fn,
+                         std::shared_ptr<ActivationFunction> out_act_fn,
+                         std::shared_ptr<ErrorFunction> err_function_use);
+
+  SimpleRecurrentNetwork(const SimpleRecurrentNetwork&) = delete;
+  SimpleRecurrentNetwork& operator=(const SimpleRecurrentNetwork&) = delete;
+
+  // zeroes the context units before the first segment of num_sequences
+  // new sequences
+  void ResetContext(int num_sequences);
+
+  // Runs the next steps steps of the current sequences, starting from the
+  // context the previous segment left.  input is time-major as in
+  // SequenceBatch, steps*num_sequences rows, and must stay alive until the
+  // next call.  Returns the outputs of every step, also time-major.
+  const realmatrix& FeedForward(constrealview input, int steps);
+  // the error of the last FeedForward summed over its steps
+  realscalar TotalError(constrealview target) const;
+
+  int InputSize() const { return w_input.Cols(); }
+  int HiddenSize() const { return w_input.Rows(); }
+  int OutputSize() const { return w_output.Rows(); }
+  int BatchSize() const { return batch_size; }
+  int MaxSteps() const { return max_steps; }
+
+  // hidden x input, hidden x hidden (from the context), output x hidden,
+  // and the single-row biases
+  realmatrix& GetInputWeights() { return w_input; }
+  realmatrix& GetContextWeights() { return w_context; }
+  realmatrix& GetOutputWeights() { return w_output; }
+  realmatrix& GetHiddenBias() { return bias_hidden; }
+  realmatrix& GetOutputBias() { return bias_output; }
+
+  const Workspace& GetWorkspace() const { return workspace; }
+
+private:
+  int batch_size;
+  int max_steps;
+  int num_sequences;      // of the current sequences
+  int steps;              // of the last segment
+
+  std::shared_ptr<ActivationFunction> hidden_fn;
+  std::shared_ptr<ActivationFunction> output_fn;
+  const SoftmaxActivation* softmax;     // set for a softmax output
+  std::shared_ptr<ErrorFunction> err_function;
+
+  realmatrix w_input;
+  realmatrix w_context;
+  realmatrix w_output;
+  realmatrix bias_hidden;
+  realmatrix bias_output;
+
+  // max_steps*batch_size rows, time-major
+  realmatrix net_hidden;
+  realmatrix hidden;
+  realmatrix net_output;
+  realmatrix output;
+
+  realmatrix context;     // the hidden activation before the segment
+  constrealview input;    // of the last segment
+
+  Workspace workspace;
+
+  constrealview Step(const realmatrix& m, int t) const { return constrealview(m).SubRows(t*num_sequences, num_sequences); }
+  realview Step(realmatrix& m, int t) { return realview(m).SubRows(t*num_sequences, num_sequences); }
+};
+
+
+
+namespace train
+{
+
+// Truncated backpropagation through time.  Each sequence batch runs in
+// segments of up to MaxSteps() steps; the gradients of a segment reach
+// back to its first step but not into earlier segments, whose last hidden
+// activation only enters as the context.  The weights are updated after
+// every segment, as BackpropTrainingAlgorithm does after every batch.
+class BpttTrainingAlgorithm : public TrainingAlgorithm
+{
+public:
+  BpttTrainingAlgorithm(SimpleRecurrentNetwork& network_use, const BackpropTrainingParameters& params_use);
+
+  void InitializeNetwork() override;
+  void Train() override;
+
+  void SetTrainingData(const std::vector<SequenceBatch>* td) { training_data = td; }
+
+  // the error of every epoch that computed one
+  double GetLastError() const { return last_error; }
+
+  const Workspace& GetWorkspace() const { return workspace; }
+
+private:
+  SimpleRecurrentNetwork& network;
+  BackpropTrainingParameters params;
+  const std::vector<SequenceBatch>* training_data;
+  double last_error;
+
+  // time-major like the activations
+  realmatrix delta_hidden;
+  realmatrix delta_output;
+  realmatrix hidden_df;
+  realmatrix ones;
+
+  realmatrix dw_input, dw_input_previous;
+  realmatrix dw_context, dw_context_previous;
+  realmatrix dw_output, dw_output_previous;
+  realmatrix d_bias_hidden;
+  realmatrix d_bias_output;
+
+  Workspace workspace;
+
+  void Backpropagate(constrealview target);
+  void OutputDelta(constrealview target);
+  void UpdateWeights(realmatrix& weights, realmatrix& dw, realmatrix& dw_previous);
+  void UpdateBias(realmatrix& bias, realmatrix& d_bias);
+};
+
+}
+
+
+}
@@ -0,0 +1,231 @@
+#include "sparse.hpp"
+
+#include <chrono>
+#include <random>
+
+
+namespace nn
+{
+
+namespace
+{
+
+template <typename T>
+void
+accum_A_SBt_impl(MatrixView<T> A, const SparseMatrix<T>& S, ConstMatrixView<T> B)
+{
+  const int* col_index = S.ColIndexPtr();
+  const T*   value     = S.ValuePtr();
+
+  // each output is a gather of the row's non-zeros from a row of B
+  for (int row = 0; row < S.Rows(); ++row) {
+    const int begin = S.RowStart(row);
+    const int end   = S.RowStart(row + 1);
+    if (begin == end) {
+      continue;
+    }
+
+    T* a = A.GetRowPtr(row);
+    for (int j = 0; j < A.Cols(); ++j) {
+      const T* b = B.GetRowPtr(j);
+      T sum = 0;
+      for (int i = begin; i < end; ++i) {
+        sum += value[i] * b[col_index[i]];
+      }
+      a[j] += sum;
+    }
+  }
+}
+
+
+template <typename T>
+void
+accum_A_BtS_impl(MatrixView<T> A, ConstMatrixView<T> B, const SparseMatrix<T>& S)
+{
+  const int* col_index = S.ColIndexPtr();
+  const T*   value     = S.ValuePtr();
+
+  // only the columns of A where S has a non-zero are touched
+  for (int row = 0; row < S.Rows(); ++row) {
+    const int begin = S.RowStart(row);
+    const int end   = S.RowStart(row + 1);
+    if (begin == end) {
+      continue;
+    }
+
+    const T* b = B.GetRowPtr(row);
+    for (int j = 0; j < A.Rows(); ++j) {
+      const T bj = b[j];
+      if (bj == T(0)) {
+        continue;
+      }
+      T* a = A.GetRowPtr(j);
+      for (int i = begin; i < end; ++i) {
+        a[col_index[i]] += bj * value[i];
+      }
+    }
+  }
+}
+
+
+
+template <typename T>
+void
+accum_A_BSt_impl(MatrixView<T> A, ConstMatrixView<T> B, const SparseMatrix<T>& S)
+{
+  const int* col_index = S.ColIndexPtr();
+  const T*   value     = S.ValuePtr();
+
+  // each output is a gather of a row of B at a row's non-zeros; four rows
+  // of B at a time share each load of an index and a value
+  int row = 0;
+  for (; row + 4 <= A.Rows(); row += 4) {
+    const T* b0 = B.GetRowPtr(row);
+    const T* b1 = B.GetRowPtr(row + 1);
+    const T* b2 = B.GetRowPtr(row + 2);
+    const T* b3 = B.GetRowPtr(row + 3);
+    T* a0 = A.GetRowPtr(row);
+    T* a1 = A.GetRowPtr(row + 1);
+    T* a2 = A.GetRowPtr(row + 2);
+    T* a3 = A.GetRowPtr(row + 3);
+    for (int j = 0; j < S.Rows(); ++j) {
+      T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+      for (int i = S.RowStart(j); i < S.RowStart(j + 1); ++i) {
+        const T v = value[i];
+        const int c = col_index[i];
+        s0 += v * b0[c];
+        s1 += v * b1[c];
+        s2 += v * b2[c];
+        s3 += v * b3[c];
+      }
+      a0[j] += s0;
+      a1[j] += s1;
+      a2[j] += s2;
+      a3[j] += s3;
+    }
+  }
+  for (; row < A.Rows(); ++row) {
+    const T* b = B.GetRowPtr(row);
+    T* a = A.GetRowPtr(row);
+    for (int j = 0; j < S.Rows(); ++j) {
+      T sum = 0;
+      for (int i = S.RowStart(j); i < S.RowStart(j + 1); ++i) {
+        sum += value[i] * b[col_index[i]];
+      }
+      a[j] += sum;
+    }
+  }
+}
+
+
+// the fastest of a few runs of f, in seconds
+template <typename F>
+double
+BestTime(F f)
+{
+  double best = 0;
+  for (int run = 0; run < 5; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (run == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+
+double
+MeasureBreakEven()
+{
+  const int batch = 32, rows = 256, cols = 256;
+  const double densities[] = { 0.5, 0.4, 0.3, 0.25, 0.2, 0.15, 0.1, 0.05, 0.02 };
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  Matrix<realscalar> A(batch, rows, Matrix<realscalar>::PaddedLd(rows));
+  Matrix<realscalar> B(batch, cols, Matrix<realscalar>::PaddedLd(cols));
+  Matrix<realscalar> W(rows, cols, Matrix<realscalar>::PaddedLd(cols));
+  for (int row = 0; row < batch; ++row) {
+    for (int col = 0; col < cols; ++col) {
+      B.SetEntry(row, col, realscalar(dist(rng)));
+    }
+  }
+
+  const double dense = BestTime([&]() { accum_A_BCt(A, B, W); });
+
+  // the densest that the sparse kernel is already faster at
+  for (double density : densities) {
+    std::bernoulli_distribution keep(density);
+    for (int row = 0; row < rows; ++row) {
+      for (int col = 0; col < cols; ++col) {
+        W.SetEntry(row, col, keep(rng) ? realscalar(dist(rng)) : realscalar(0));
+      }
+    }
+    SparseMatrix<realscalar> S{ ConstMatrixView<realscalar>(W) };
+    if (BestTime([&]() { accum_A_BSt_impl<realscalar>(A, B, S); }) < dense) {
+      return density;
+    }
+  }
+  return 0;
+}
+
+}
+
+
+
+// A += S B^T
+void
+accum_A_SBt(MatrixView<float> A, const SparseMatrix<float>& S, ConstMatrixView<float> B)
+{
+  accum_A_SBt_impl(A, S, B);
+}
+
+void
+accum_A_SBt(MatrixView<double> A, const SparseMatrix<double>& S, ConstMatrixView<double> B)
+{
+  accum_A_SBt_impl(A, S, B);
+}
+
+
+
+// A += B^T S
+void
+accum_A_BtS(MatrixView<float> A, ConstMatrixView<float> B, const SparseMatrix<float>& S)
+{
+  accum_A_BtS_impl(A, B, S);
+}
+
+void
+accum_A_BtS(MatrixView<double> A, ConstMatrixView<double> B, const SparseMatrix<double>& S)
+{
+  accum_A_BtS_impl(A, B, S);
+}
+
+
+
+// A += B S^T
+void
+accum_A_BSt(MatrixView<float> A, ConstMatrixView<float> B, const SparseMatrix<float>& S)
+{
+  accum_A_BSt_impl(A, B, S);
+}
+
+void
+accum_A_BSt(MatrixView<double> A, ConstMatrixView<double> B, const SparseMatrix<double>& S)
+{
+  accum_A_BSt_impl(A, B, S);
+}
+
+
+
+double
+SparseBreakEven()
+{
+  static const double break_even = MeasureBreakEven();
+  return break_even;
+}
+
+
+} // namespace nn
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "matrix.hpp"
+
+#include <vector>
+#include <iostream>
+
+namespace nn
+{
+
+// Compressed sparse row matrix, used for input batches that are mostly
+// zeros (e.g. one-hot encoded categories) and for pruned weights.  Rows are
+// filled in order with SetRowValues; rows that were never set are empty,
+// i.e. all zero.
+template <typename T>
+class SparseMatrix
+{
+public:
+  typedef T ValueType;
+  typedef std::vector<T> VectorType;
+
+  SparseMatrix(int rows_use, int cols_use)
+    : rows(rows_use),
+      cols(cols_use),
+      filled_rows(0),
+      row_start(rows + 1, 0)
+  {
+  }
+
+  // a sparse copy of the non-zero entries of A
+  explicit SparseMatrix(ConstMatrixView<T> A)
+    : SparseMatrix(A.Rows(), A.Cols())
+  {
+    for (int row = 0; row < rows; ++row) {
+      const T* a = A.GetRowPtr(row);
+      SetRowValues(row, VectorType(a, a + cols));
+    }
+  }
+
+  // row_num must be the first row not yet set
+  void SetRowValues(int row_num, const VectorType& values)
+  {
+    if (row_num != filled_rows || row_num >= Capacity() || values.size() != size_t(cols)) {
+      std::cerr << "Sparse rows must be set in order" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    for (int col = 0; col < cols; ++col) {
+      if (values[col] != T(0)) {
+        col_index.push_back(col);
+        value.push_back(values[col]);
+      }
+    }
+    ++filled_rows;
+    std::fill(row_start.begin() + filled_rows, row_start.end(), (int)value.size());
+  }
+
+  void Clear()
+  {
+    filled_rows = 0;
+    std::fill(row_start.begin(), row_start.end(), 0);
+    col_index.clear();
+    value.clear();
+  }
+
+  int Rows() const { return rows; }
+  int Cols() const { return cols; }
+  int NonZeros() const { return value.size(); }
+
+  // as Matrix::SetRows; the rows in use must include every row set so far
+  int Capacity() const { return row_start.size() - 1; }
+  void SetRows(int num_rows)
+  {
+    if (num_rows < filled_rows || num_rows > Capacity()) {
+      throw "SparseMatrix::SetRows: row count outside the filled rows and the capacity.";
+    }
+    rows = num_rows;
+  }
+  double Density() const { return (rows * cols) ? (double)NonZeros() / ((double)rows * cols) : 0.0; }
+
+  // the non-zeros of row r are entries [RowStart(r), RowStart(r + 1))
+  int RowStart(int row_num) const { return row_start[row_num]; }
+  const int* ColIndexPtr() const { return col_index.data(); }
+  const T* ValuePtr() const { return value.data(); }
+  // the values may change in place; the pattern of non-zeros can't
+  T* ValuePtr() { return value.data(); }
+
+  // of the row starts, column indices and values
+  size_t Bytes() const { return (row_start.size() + col_index.size())*sizeof(int) + value.size()*sizeof(T); }
+
+  Matrix<T> ToDense() const
+  {
+    Matrix<T> A(rows, cols);
+    for (int row = 0; row < rows; ++row) {
+      for (int i = row_start[row]; i < row_start[row + 1]; ++i) {
+        A.SetEntry(row, col_index[i], value[i]);
+      }
+    }
+    return A;
+  }
+
+private:
+  int rows;
+  int cols;
+  int filled_rows;
+
+  std::vector<int> row_start;
+  std::vector<int> col_index;
+  std::vector<T>   value;
+};
+
+
+typedef SparseMatrix<realscalar> realsparsematrix;
+
+
+
+// sparse-dense operations
+// A += S B^T
+void accum_A_SBt(MatrixView<float> A, const SparseMatrix<float>& S, ConstMatrixView<float> B);
+void accum_A_SBt(MatrixView<double> A, const SparseMatrix<double>& S, ConstMatrixView<double> B);
+
+
+// A += B^T S
+void accum_A_BtS(MatrixView<float> A, ConstMatrixView<float> B, const SparseMatrix<float>& S);
+void accum_A_BtS(MatrixView<double> A, ConstMatrixView<double> B, const SparseMatrix<double>& S);
+
+
+// A += B S^T, the net input of a dense batch B through sparse weights S
+void accum_A_BSt(MatrixView<float> A, ConstMatrixView<float> B, const SparseMatrix<float>& S);
+void accum_A_BSt(MatrixView<double> A, ConstMatrixView<double> B, const SparseMatrix<double>& S);
+
+
+// The density of the weights below which accum_A_BSt beats the dense
+// accum_A_BCt.  Timed once, on first use, for a 256 x 256 matrix and a
+// batch of 32 with the BLAS backend selected at the time, which takes a
+// few tens of milliseconds.  0 if the sparse kernel never wins.
+double SparseBreakEven();
+
+
+} // namespace nn
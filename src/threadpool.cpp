@@ -0,0 +1,159 @@
+#include "threadpool.hpp"
+
+#include <algorithm>
+
+namespace nn {
+namespace utility {
+
+
+
+ThreadPool::ThreadPool(int num_workers)
+  : current_task(nullptr),
+    num_tasks(0),
+    next_task(0),
+    tasks_left(0),
+    active_workers(0),
+    generation(0),
+    stopping(false)
+{
+  for (int w = 0; w < num_workers; ++w) {
+    workers.emplace_back([this]() {
+      long seen_generation = 0;
+      Work(seen_generation);
+    });
+  }
+}
+
+
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+
+
+void
+ThreadPool::Run(int n, const std::function<void(int)>& task)
+{
+  if (n <= 0) {
+    return;
+  }
+  if (workers.empty() || n == 1) {
+    for (int i = 0; i < n; ++i) {
+      task(i);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    current_task = &task;
+    num_tasks = n;
+    next_task = 0;
+    tasks_left = n;
+    error = nullptr;
+    ++generation;
+  }
+  start.notify_all();
+
+  RunTasks(task, n);
+
+  // workers still inside RunTasks could otherwise claim tasks of the next
+  // Run from the counter it resets
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this]() { return tasks_left == 0 && active_workers == 0; });
+  current_task = nullptr;
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+
+
+void
+ThreadPool::Work(long& seen_generation)
+{
+  for (;;) {
+    const std::function<void(int)>* task;
+    int n;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start.wait(lock, [&]() { return stopping || generation != seen_generation; });
+      if (stopping) {
+        return;
+      }
+      seen_generation = generation;
+      // woken too late for a Run that has already returned
+      if (!current_task) {
+        continue;
+      }
+      task = current_task;
+      n = num_tasks;
+      ++active_workers;
+    }
+
+    RunTasks(*task, n);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--active_workers == 0 && tasks_left == 0) {
+      done.notify_all();
+    }
+  }
+}
+
+
+
+// takes tasks of the current Run until there are none left
+void
+ThreadPool::RunTasks(const std::function<void(int)>& task, int n)
+{
+  for (;;) {
+    int i = next_task++;
+    if (i >= n) {
+      return;
+    }
+
+    try {
+      task(i);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--tasks_left == 0) {
+      done.notify_all();
+    }
+  }
+}
+
+
+
+
+void
+RunPipeline(ThreadPool* pool, int num_stages, int num_parts, const std::function<void(int, int)>& task)
+{
+  for (int tick = 0; tick < num_stages + num_parts - 1; ++tick) {
+    // the stages with a part on this tick
+    int first_stage = std::max(0, tick - num_parts + 1);
+    int last_stage = std::min(num_stages - 1, tick);
+    ParallelFor(pool, last_stage - first_stage + 1, [&](int i) {
+      int stage = first_stage + i;
+      task(stage, tick - stage);
+    });
+  }
+}
+
+
+}
+}
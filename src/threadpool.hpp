@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nn {
+namespace utility {
+
+
+// A fixed set of worker threads for running the independent steps of a
+// network pass side by side.  Run(n, task) calls task(0) .. task(n - 1),
+// spread over the workers and the calling thread, and returns when they
+// have all finished.  If tasks throw, Run rethrows the first exception.
+// One Run at a time; the pool isn't reentrant.
+class ThreadPool
+{
+public:
+  // workers besides the thread calling Run
+  explicit ThreadPool(int num_workers);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void Run(int n, const std::function<void(int)>& task);
+
+  int NumThreads() const { return workers.size() + 1; }
+
+private:
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable start;     // a new Run, or shutdown
+  std::condition_variable done;      // the last task of a Run finished
+
+  const std::function<void(int)>* current_task;
+  int num_tasks;
+  std::atomic<int> next_task;
+  int tasks_left;
+  int active_workers;                // workers taking tasks of the current Run
+  long generation;                   // counts Runs, so workers see each once
+  bool stopping;
+  std::exception_ptr error;
+
+  void Work(long& seen_generation);
+  void RunTasks(const std::function<void(int)>& task, int n);
+};
+
+
+// task(0) .. task(n - 1) on pool, or one after another without one
+inline void ParallelFor(ThreadPool* pool, int n, const std::function<void(int)>& task)
+{
+  if (pool) {
+    pool->Run(n, task);
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    task(i);
+  }
+}
+
+
+// Pushes num_parts pieces of work (micro-batches) through num_stages
+// stages, each piece through every stage in order.  On tick t stage s
+// works on part t - s, so part p reaches stage s once stage s - 1 has
+// finished it, and each stage takes the parts one after another; the work
+// of one tick runs side by side on pool.  task(stage, part).
+void RunPipeline(ThreadPool* pool, int num_stages, int num_parts, const std::function<void(int, int)>& task);
+
+
+}
+}
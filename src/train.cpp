@@ -19,6 +19,10 @@ BackpropTrainingAlgorithm::BackpropTrainingAlgorithm(Network& network_use,
     error_fn(ntr.GetErrorFunction()),
     training_data(nullptr)
 {
+  if (ntr.HasMappedWeights()) {
+    throw "Can't train a network whose weights are mapped read-only; load it with map_weights = false.";
+  }
+
   const auto& x = ntr.GetLayers();
   const auto& y = ntr.GetConnections();
 
@@ -39,6 +43,24 @@ BackpropTrainingAlgorithm::BackpropTrainingAlgorithm(Network& network_use,
     auto bp_connection = std::make_shared<BackpropConnection>(c, bp_from_layer, bp_to_layer, params);
     bp_connections.push_back(bp_connection);
   }
+
+  // no deltas are needed at the input layers
+  int col = 0;
+  target_col.assign(bp_layers.size(), -1);
+  for (size_t l = 0; l < bp_layers.size(); ++l) {
+    if (bp_layers[l]->IsOutput()) {
+      target_col[l] = col;
+      col += bp_layers[l]->Size();
+    }
+    if (!bp_layers[l]->IsInput()) {
+      bp_layers[l]->AddToWorkspace(workspace, "layer" + std::to_string(l));
+      bp_trained_layers.push_back(bp_layers[l].get());
+    }
+  }
+  for (size_t c = 0; c < bp_connections.size(); ++c) {
+    bp_connections[c]->AddToWorkspace(workspace, "connection" + std::to_string(c));
+  }
+  workspace.Allocate();
 }
 
 
@@ -49,9 +71,9 @@ BackpropTrainingAlgorithm::InitializeNetwork()
 {
   auto seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
   std::mt19937 mt_rand(seed);
-  auto randgen = std::bind(std::uniform_real_distribution<double>(-0.5, 0.5), mt_rand);
+  auto randgen = std::bind(std::uniform_real_distribution<realscalar>(-0.5, 0.5), mt_rand);
 
-  for (auto& layer : bp_layers) {
+  for (auto layer : bp_trained_layers) {   // input layers have no bias
     layer->InitializeBiases(randgen);
   }
   for (auto& conn : bp_connections) {
@@ -70,67 +92,143 @@ BackpropTrainingAlgorithm::Train()
     return;
   }
 
+  const auto& levels = ntr.GetLevels();
+  auto pool = ntr.GetThreadPool();
+  const int num_layers = bp_trained_layers.size();
+  const int num_updates = num_layers + bp_connections.size();
+
   for (int epoch = 0; epoch <= params.max_epochs; ++epoch) {
     ntr.SetCurrentEpoch(epoch);
 
-    dblscalar total_error = 0;
+    bool check_error = (params.min_error > 0) && (params.error_check_interval <= 1 || epoch % params.error_check_interval == 0);
+    bool need_error = check_error || ntr.ObserversNeedError(epoch);
+    utility::KahanSum total_error;
 
     for (auto batch = training_data->begin(); batch != training_data->end(); ++batch) {
-      const auto& in = batch->Input();
       const auto& targ = batch->Output();
 
-      ntr.FeedForward(in);
-      total_error += ntr.TotalError(targ);
+      // a partly filled batch runs on its filled rows only
+      const int rows = batch->CurrentBatchSize();
+      if (rows == 0) {
+        continue;
+      }
+      for (auto layer : bp_trained_layers) {
+        layer->SetRows(rows);
+      }
 
-      ntr.NotifyBatch();
+      if (batch->IsSparse()) {
+        ntr.FeedForward(batch->SparseInput());
+      } else {
+        ntr.FeedForward(batch->Input());
+      }
+      if (need_error) {
+        total_error.Add(ntr.TotalError(targ));
+      }
 
-      // delta at output layer
-      auto& output_layer = bp_layers.back();
-      output_layer->CalculateActivationDerivative();
-      output_layer->CalculateDelta(targ);
+      ntr.NotifyBatch();
 
-      for (int i = bp_layers.size() - 2; i >= 1; --i) {
-        bp_layers[i]->CalculateActivationDerivative();
-        bp_layers[i]->CalculateDelta();
+      if (ntr.Pipelines(rows)) {
+        TrainPipelined(targ, rows);
+        continue;
       }
 
-      for (int i = bp_layers.size() - 1; i >= 1; --i) {
-        bp_layers[i]->AccumulateBiasGradient();
-        bp_layers[i]->UpdateBias();
-      }
-    
-      for (auto& c : bp_connections) {
-        c->AccumulateGradients();
-      }
-    
-      for (auto& c : bp_connections) {
-        c->UpdateWeights();
+      // deltas from the last level back; a layer's delta only needs those
+      // of the later levels it feeds
+      for (size_t lev = levels.size() - 1; lev >= 1; --lev) {
+        const auto& level = levels[lev];
+        utility::ParallelFor(pool, level.size(), [&](int i) {
+          size_t l = level[i];
+          if (bp_layers[l]->IsOutput()) {
+            bp_layers[l]->CalculateDelta(constrealview(targ).SubCols(target_col[l], bp_layers[l]->Size()));
+          } else {
+            bp_layers[l]->CalculateDelta();
+          }
+        });
       }
+
+      // then every bias and weight update is independent
+      utility::ParallelFor(pool, num_updates, [&](int i) {
+        if (i < num_layers) {
+          bp_trained_layers[i]->AccumulateBiasGradient();
+          bp_trained_layers[i]->UpdateBias();
+        } else {
+          bp_connections[i - num_layers]->AccumulateGradients();
+          bp_connections[i - num_layers]->UpdateWeights();
+        }
+      });
     }
 
     ntr.NotifyEpoch();
 
     //std::cout << "epoch " << epoch << '\t' << total_error << std::endl;
 
-    if (total_error < params.min_error) {
-      std::cout << epoch << "\t" << total_error << std::endl;
+    if (check_error && total_error.Value() < params.min_error) {
+      std::cout << epoch << "\t" << total_error.Value() << std::endl;
       break;
     }
   }
 }
 
 
+// The backward pass of a pipelined FeedForward, run through the stages in
+// reverse.  Each stage finds the deltas of its layers for a micro-batch and
+// adds its rows to the gradients of their biases and incoming connections;
+// only that stage touches them, so the sums need no locks.  The updates
+// then use the gradients of the whole batch, as without pipelining.
+void
+BackpropTrainingAlgorithm::TrainPipelined(const realmatrix& targ, int rows)
+{
+  const auto& levels = ntr.GetLevels();
+  const auto& stages = ntr.GetPipelineStages();
+  const int micro_batch = ntr.GetMicroBatch();
+  auto pool = ntr.GetThreadPool();
+
+  utility::RunPipeline(pool, stages.size(), (rows + micro_batch - 1)/micro_batch, [&](int s, int part) {
+    const auto& stage = stages[stages.size() - 1 - s];
+    const int first_row = part*micro_batch;
+    const int part_rows = std::min(micro_batch, rows - first_row);
+    for (size_t lev = stage.second; lev-- > stage.first; ) {
+      for (size_t l : levels[lev]) {
+        auto& layer = *bp_layers[l];
+        if (layer.IsOutput()) {
+          layer.CalculateDelta(constrealview(targ).SubCols(target_col[l], layer.Size()), first_row, part_rows);
+        } else {
+          layer.CalculateDelta(first_row, part_rows);
+        }
+        layer.AccumulateBiasGradient(first_row, part_rows);
+        for (auto c : layer.incoming) {
+          c->AccumulateGradients(first_row, part_rows);
+        }
+      }
+    }
+  });
+
+  const int num_layers = bp_trained_layers.size();
+  utility::ParallelFor(pool, num_layers + bp_connections.size(), [&](int i) {
+    if (i < num_layers) {
+      bp_trained_layers[i]->UpdateBias();
+    } else {
+      bp_connections[i - num_layers]->UpdateWeights();
+    }
+  });
+}
+
+
 BackpropLayer::BackpropLayer(NetworkTrainer& ntr_use, const BackpropTrainingParameters& params, Layer* layer_use,
   const ErrorFunction* error_fn_use)
   : ntr(ntr_use),
     layer(layer_use),
     learning_rate(params.learning_rate),
-    activation(layer->GetActivation()),
-    activation_df(layer->BatchSize(), layer->Size()),
-    d_bias(layer->Size()),
-    delta(layer->BatchSize(), layer->Size()),
-    error_fn(error_fn_use)
+    delta(layer->BatchSize(), layer->Size(), realmatrix::PaddedLd(layer->Size()), nullptr),
+    activation_df(layer->BatchSize(), layer->Size(), realmatrix::PaddedLd(layer->Size()), nullptr),
+    d_bias(1, layer->Size(), realmatrix::PaddedLd(layer->Size()), nullptr),
+    ones(layer->BatchSize(), 1, 1, nullptr),
+    error_fn(error_fn_use),
+    canonical_delta_scale(error_fn ? layer->GetActivationFunction()->CanonicalDeltaScale(*error_fn) : 0),
+    neg_slope(0),
+    pos_slope(0)
 {
+  step_derivative = layer->GetActivationFunction()->StepDerivative(neg_slope, pos_slope);
 }
 
 
@@ -138,57 +236,128 @@ template <typename RngType>
 void
 BackpropLayer::InitializeBiases(RngType& randgen)
 {
-  auto& bias = ntr.GetLayerBias(layer);
+  auto bias = ntr.GetLayerBias(layer).GetRow(0);
+
+  std::transform(bias.begin(), bias.end(), bias.begin(), std::ref(randgen));
+}
+
+
 
-  std::transform(begin(bias), end(bias), begin(bias), std::ref(randgen));
+void
+BackpropLayer::AddToWorkspace(Workspace& workspace, const std::string& name)
+{
+  workspace.Add(name + ".delta", delta);
+  if (!layer->IsSpecialized() && !UsesCanonicalDelta() && !UsesStepDerivative()) {
+    workspace.Add(name + ".activation_df", activation_df);
+  }
+  workspace.Add(name + ".d_bias", d_bias);
+  workspace.Add(name + ".ones", ones, realscalar(1));
 }
 
 
 void
-BackpropLayer::CalculateActivationDerivative()
+BackpropLayer::CalculateActivationDerivative(int first_row, int rows)
 {
-  auto fn = layer->GetActivationFunction();
-  auto& net_in = ntr.GetLayerNetInput(layer);
+  const auto& net_input = ntr.GetLayerNetInput(layer);
+  const auto& activation = layer->GetActivationMatrix();
+
+  // one call for all the rows, as in Layer::CalculateActivation
+  layer->GetActivationFunction()->Derivative(net_input.GetRowPtr(first_row), activation.GetRowPtr(first_row),
+                                             activation_df.GetRowPtr(first_row), rows*activation_df.LeadingDim());
+}
+
 
-  std::transform(net_in.begin(), net_in.end(), activation.begin(), activation_df.begin(),
-                 [&](auto x, auto fx) { return fn->df(x, fx); });
+void
+BackpropLayer::ScaleByStepDerivative(int first_row, int rows)
+{
+  const auto& activation = layer->GetActivationMatrix();
+  const realscalar neg = neg_slope, pos = pos_slope;
+
+  for (int row = first_row; row < first_row + rows; ++row) {
+    const realscalar* a = activation.GetRowPtr(row);
+    realscalar* d = delta.GetRowPtr(row);
+    if (neg == 0) {
+      // ReLU: a select rather than a multiply, so dead units are exactly 0
+      for (int col = 0; col < delta.Cols(); ++col) {
+        d[col] = (a[col] > 0) ? pos*d[col] : 0;
+      }
+    } else {
+      for (int col = 0; col < delta.Cols(); ++col) {
+        d[col] *= (a[col] > 0) ? pos : neg;
+      }
+    }
+  }
 }
 
 
 
 void
-BackpropLayer::CalculateDelta()
+BackpropLayer::CalculateDelta(int first_row, int rows)
 {
-  std::fill(begin(delta), end(delta), 0);
+  using namespace expr;
+
+  realview d = realview(delta).SubRows(first_row, rows);
+  std::fill_n(d.GetPtr(), rows*d.LeadingDim(), realscalar(0));
 
   for (auto& conn : outgoing) {
-    conn->AccumulateNetDelta(delta);
+    conn->AccumulateNetDelta(d, first_row);
   }
 
   // scale by the derivative of the activation
-  std::transform(std::begin(delta), std::end(delta), std::begin(activation_df), std::begin(delta),
-                 std::multiplies<>());
+  if (layer->IsSpecialized()) {
+    layer->ScaleByDerivative(d, first_row);
+    return;
+  }
+  if (UsesStepDerivative()) {
+    ScaleByStepDerivative(first_row, rows);
+    return;
+  }
+  CalculateActivationDerivative(first_row, rows);
+  Assign(d, Ref(d) * Ref(realview(activation_df).SubRows(first_row, rows)));
 }
 
 
 
 void
-BackpropLayer::CalculateDelta(const dblmatrix& target) // for output layer
+BackpropLayer::CalculateDelta(constrealview target, int first_row, int rows) // for output layer
 {
-  //CalculateDelta2(target, *layer->GetActivationFunction(), *error_fn);
-  //return;
-
-  // // calcualte error into delta
-  std::transform(begin(activation), end(activation),
-    begin(target),
-    begin(delta),
-    [&](double x, double y) { return error_fn->dE(x, y); });
-
-  // scale by derivative of activation
-  std::transform(begin(delta), end(delta),
-    begin(activation_df),
-    begin(delta),
-    std::multiplies<>());
+  using namespace expr;
+
+  realview d = realview(delta).SubRows(first_row, rows);
+  constrealview t = target.SubRows(first_row, rows);
+
+  if (layer->IsSpecialized()) {
+    layer->OutputDelta(t, error_fn, d, first_row);
+    return;
+  }
+
+  constrealview a = constrealview(layer->GetActivationMatrix()).SubRows(first_row, rows);
+
+  if (UsesCanonicalDelta()) {
+    const realscalar scale = canonical_delta_scale;
+    for (int row = 0; row < rows; ++row) {
+      const realscalar* a_row = a.GetRowPtr(row);
+      const realscalar* t_row = t.GetRowPtr(row);
+      realscalar* d_row = d.GetRowPtr(row);
+      for (int col = 0; col < d.Cols(); ++col) {
+        d_row[col] = scale*(a_row[col] - t_row[col]);
+      }
+    }
+    return;
+  }
+
+  auto err = error_fn;
+  auto dE = [err](realscalar x, realscalar y) { return err->dE(x, y); };
+
+  if (UsesStepDerivative()) {
+    Assign(d, Map(dE, Ref(a), Ref(t)));
+    ScaleByStepDerivative(first_row, rows);
+    return;
+  }
+
+  // error scaled by the derivative of the activation
+  CalculateActivationDerivative(first_row, rows);
+  Assign(d, Map(dE, Ref(a), Ref(t)) * Ref(realview(activation_df).SubRows(first_row, rows)));
 }
 
 
@@ -200,8 +369,8 @@ BackpropConnection::BackpropConnection(std::shared_ptr<Connection> connection_us
     layer_from(from),
     layer_to(to),
     weights(connection->GetWeights()),
-    delta_w(layer_to->Size(), layer_from->Size()),
-    delta_w_previous(layer_to->Size(), layer_from->Size()),
+    delta_w(weights.Rows(), weights.Cols(), weights.LeadingDim(), nullptr),
+    delta_w_previous(weights.Rows(), weights.Cols(), weights.LeadingDim(), nullptr),
     params(params_use)
 {
   to->AddIncomingConnection(this);
@@ -213,43 +382,78 @@ template <typename RngType>
 void
 BackpropConnection::InitializeWeights(RngType& randgen)
 {
-  std::transform(begin(weights), end(weights), begin(weights), std::ref(randgen));
+  for (int row = 0; row < weights.Rows(); ++row) {
+    auto w = weights.GetRow(row);
+    std::transform(w.begin(), w.end(), w.begin(), std::ref(randgen));
+  }
 
   NguyenWidrowInitialization();
+  connection->ApplyMask();
+}
+
+
+void
+BackpropConnection::AddToWorkspace(Workspace& workspace, const std::string& name)
+{
+  workspace.Add(name + ".delta_w", delta_w);
+  workspace.Add(name + ".delta_w_previous", delta_w_previous);
 }
 
 
 void
-BackpropConnection::AccumulateNetDelta(dblmatrix& delta)
+BackpropConnection::AccumulateNetDelta(realview delta, int first_row)
 {
-  nn::accum_A_BC(delta, layer_to->GetDelta(), weights);
+  nn::accum_A_BC(delta, constrealview(layer_to->GetDelta()).SubRows(first_row, delta.Rows()), weights);
 }
 
 
 void
-BackpropConnection::AccumulateGradients()
+BackpropConnection::AccumulateGradients(int first_row, int rows)
 {
-  const auto& delta = layer_to->GetDelta();
-  const auto& activation = layer_from->GetActivation();
-  nn::accum_A_BtC(delta_w, delta, activation);
+  auto delta = constrealview(layer_to->GetDelta()).SubRows(first_row, rows);
+  if (auto sparse = layer_from->GetSparseActivation()) {
+    assert(first_row == 0 && rows == sparse->Rows());
+    nn::accum_A_BtS(delta_w, delta, *sparse);
+  } else {
+    nn::accum_A_BtC(delta_w, delta, layer_from->GetActivation().SubRows(first_row, rows));
+  }
 }
 
 
 void
 BackpropConnection::UpdateWeights()
 {
+  realscalar scale = 1;
   if (params.normalize_gradient) {
-    delta_w.Normalize();
-  }
-  if (params.momentum > 0) {
-    nn::accum_A_alphaB(delta_w, params.momentum, delta_w_previous);
-    delta_w_previous = delta_w;
+    realscalar norm = delta_w.Norm();
+    if (norm > 1.0) {
+      scale = 1 / norm;
+    }
   }
-  if (params.weight_decay > 0) {
-    std::for_each(begin(weights), end(weights), [&](auto& x) { x *= (1 - params.weight_decay); });
+
+  const realscalar momentum = params.momentum;
+  const realscalar decay = 1 - params.weight_decay;
+  const realscalar rate = params.learning_rate/* / layer_from->BatchSize()*/;
+
+  // scale, momentum, weight decay, step and reset of delta_w in one pass
+  if (momentum > 0) {
+    expr::ForEach([=](realscalar& w, realscalar& dw, realscalar& dw_prev) {
+                    realscalar step = scale*dw + momentum*dw_prev;
+                    dw_prev = step;
+                    w = decay*w - rate*step;
+                    dw = 0;
+                  },
+                  weights, delta_w, delta_w_previous);
+  } else {
+    expr::ForEach([=](realscalar& w, realscalar& dw) {
+                    w = decay*w - rate*scale*dw;
+                    dw = 0;
+                  },
+                  weights, delta_w);
   }
-  nn::accum_A_alphaB(weights, -params.learning_rate/* / layer_from->BatchSize()*/, delta_w);
-  std::memset(delta_w.GetPtr(), 0, sizeof(double)*delta_w.Size());
+
+  // pruned weights stay at zero
+  connection->ApplyMask();
 }
 
 
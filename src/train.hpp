@@ -4,10 +4,12 @@
 #include "network.hpp"
 #include "input.hpp"
 #include "utility.hpp"
+#include "expression.hpp"
 
 #include <map>
 
 #include <cstring>
+#include <cmath>
 
 namespace nn
 {
@@ -20,43 +22,60 @@ namespace train
 class NetworkTrainer
 {
 public:
+  // the weights and biases live in the workspace, so a network built by
+  // hand has it planned here
   explicit NetworkTrainer(Network& network_use)
     : network(network_use)
   {
+    network.EnsureWorkspace();
   }
 
   void SetCurrentEpoch(int epoch) {
     network.current_epoch = epoch;
   }
 
-  dblmatrix FeedForward(const dblmatrix& input_pattern)
+  const realmatrix& FeedForward(constrealview input_pattern)
   {
     return network.FeedForward(input_pattern);
   }
 
-  dblscalar TotalError(const dblmatrix& target_pattern)
+  const realmatrix& FeedForward(const realsparsematrix& input_pattern)
   {
-    return network.TotalError(target_pattern);
+    return network.FeedForward(input_pattern);
+  }
+
+  realscalar TotalError(constrealview target_pattern, realscalar* row_errors = nullptr)
+  {
+    return network.TotalError(target_pattern, row_errors);
   }
 
   void NotifyBatch() { network.NotifyBatch(); }
   void NotifyEpoch() { network.NotifyEpoch(); }
+  bool ObserversNeedError(int epoch) const { return network.ObserversNeedError(epoch); }
+  bool HasMappedWeights() const { return network.HasMappedWeights(); }
 
 
   std::vector<std::shared_ptr<Layer>> GetLayers() const { return network.layers; }
   std::vector<std::shared_ptr<Connection>> GetConnections() const { return network.connections; }
+  // layer indices by level, see Network::levels
+  const std::vector<std::vector<size_t>>& GetLevels() const { return network.levels; }
+  utility::ThreadPool* GetThreadPool() const { return network.thread_pool.get(); }
+  // whether the last FeedForward of rows patterns was pipelined, and how
+  bool Pipelines(int rows) const { return network.Pipelines(rows); }
+  const std::vector<std::pair<size_t, size_t>>& GetPipelineStages() const { return network.pipeline_stages; }
+  int GetMicroBatch() const { return network.micro_batch; }
 
   auto GetErrorFunction() const { return network.err_function; }
 
   template <typename PtrType>
-  double* GetLayerBiasPtr(PtrType layer) { return &(layer->bias[0]); }
+  realscalar* GetLayerBiasPtr(PtrType layer) { return layer->bias.GetPtr(); }
   template <typename PtrType>
-  dblvector& GetLayerBias(PtrType layer) { return layer->bias; }
+  realmatrix& GetLayerBias(PtrType layer) { return layer->bias; }
   template <typename PtrType>
-  dblmatrix& GetLayerNetInput(PtrType layer) { return layer->net_input; }
+  realmatrix& GetLayerNetInput(PtrType layer) { return layer->net_input; }
 
-  dblscalar* GetLayerActivationPtr(std::shared_ptr<Layer> layer) { return layer->activation.GetPtr(); }
-  dblscalar* GetLayerNetInputPtr(std::shared_ptr<Layer> layer) { return layer->activation.GetPtr(); }
+  realscalar* GetLayerActivationPtr(std::shared_ptr<Layer> layer) { return layer->activation.GetPtr(); }
+  realscalar* GetLayerNetInputPtr(std::shared_ptr<Layer> layer) { return layer->activation.GetPtr(); }
 
   //std::vector<Connection *>
   //GetLayerIncomingConnections(std::shared_ptr<Layer> layer) { return layer->incoming; }
@@ -98,14 +117,17 @@ class BackpropConnection;
 
 struct BackpropTrainingParameters
 {
-  dblscalar learning_rate;
-  dblscalar momentum;
-  dblscalar weight_decay;
+  realscalar learning_rate;
+  realscalar momentum;
+  realscalar weight_decay;
   bool      normalize_gradient;
   // stop when either we hit the maximum number of epochs, or the
   // total error falls below min_error.
   int       max_epochs;
-  dblscalar min_error;
+  realscalar min_error;
+  // epochs between min_error checks.  The error is only computed on
+  // those epochs and the ones an observer asks for.
+  int       error_check_interval = 1;
 };
 
 
@@ -119,18 +141,27 @@ public:
   void Train() override;
 
   void SetTrainingData(const std::vector<Batch>* td) { training_data = td; }
+
+  // the single arena holding the deltas and gradients of every layer and connection
+  const Workspace& GetWorkspace() const { return workspace; }
   
 private:
   NetworkTrainer ntr;
 
   std::vector<std::shared_ptr<BackpropLayer>> bp_layers;
   std::vector<std::shared_ptr<BackpropConnection>> bp_connections;
+  std::vector<BackpropLayer*> bp_trained_layers;   // those with a bias: all but the inputs
+  std::vector<int> target_col;                     // per layer, where an output's target starts
 
   std::shared_ptr<ErrorFunction> error_fn;
 
   BackpropTrainingParameters params;
 
   const std::vector<Batch>* training_data;
+
+  Workspace workspace;
+
+  void TrainPipelined(const realmatrix& targ, int rows);
 };
 
 
@@ -147,30 +178,60 @@ public:
 
   int Size() const { return layer->Size(); }
   int BatchSize() const { return layer->BatchSize(); }
+  bool IsInput() const { return layer->IsInput(); }
+  bool IsOutput() const { return layer->IsOutput(); }
 
-  void CalculateActivationDerivative();
-
-  void AccumulateBiasGradient()
+  // The steps of backprop work on the rows first_row .. first_row + rows - 1
+  // of the batch, so separate row ranges can be done at once; without a
+  // range they cover the whole batch.  The gradients of every range add up.
+  void AccumulateBiasGradient(int first_row, int rows)
   {
-    dblvector ones(layer->BatchSize(), 1.0);
-    accum_y_Atx(d_bias, delta, ones);
+    accum_A_BtC(d_bias, constrealview(ones).SubRows(first_row, rows), constrealview(delta).SubRows(first_row, rows));
   }
+  void AccumulateBiasGradient() { AccumulateBiasGradient(0, delta.Rows()); }
 
   void UpdateBias()
   {
     auto& bias = ntr.GetLayerBias(layer);
-    accum_y_alphax(bias, -learning_rate, d_bias);
+    accum_A_alphaB(bias, -learning_rate, d_bias);
+  }
+
+  void AddToWorkspace(Workspace& workspace, const std::string& name);
+
+  // as Layer::SetRows, for the delta and the buffers that follow its shape
+  void SetRows(int rows)
+  {
+    delta.SetRows(rows);
+    activation_df.SetRows(rows);
+    ones.SetRows(rows);
   }
 
-  void CalculateDelta();  // at hidden layers
+  void CalculateActivationDerivative(int first_row, int rows);
+
+  void CalculateDelta(int first_row, int rows);  // at hidden layers
+  void CalculateDelta() { CalculateDelta(0, delta.Rows()); }
+
+  // for output layer; target has a row for every row of the batch
+  void CalculateDelta(constrealview target, int first_row, int rows);
+  void CalculateDelta(constrealview target) { CalculateDelta(target, 0, delta.Rows()); }
 
-  void CalculateDelta(const dblmatrix& target); // for output layer
+  // true for an output layer whose activation and error function cancel,
+  // e.g. logistic + cross-entropy; its delta is then scale*(activation - target)
+  // with no activation_df buffer
+  bool UsesCanonicalDelta() const { return outgoing.empty() && canonical_delta_scale != 0; }
+
+  // true for ReLU-family layers, see ActivationFunction::StepDerivative
+  bool UsesStepDerivative() const { return step_derivative; }
+
+  // delta *= f', selected from the sign of the activation
+  void ScaleByStepDerivative(int first_row, int rows);
 
   void AddIncomingConnection(BackpropConnection* c) { incoming.push_back(c); }
   void AddOutgoingConnection(BackpropConnection* c) { outgoing.push_back(c); }
 
-  const dblmatrix& GetDelta() const { return delta; }
-  const dblmatrix& GetActivation() const { return activation; }
+  const realmatrix& GetDelta() const { return delta; }
+  constrealview GetActivation() const { return layer->GetActivation(); }
+  const realsparsematrix* GetSparseActivation() const { return layer->GetSparseActivation(); }
 
 private:
   NetworkTrainer& ntr;
@@ -178,15 +239,20 @@ private:
   std::vector<BackpropConnection*> incoming;
   std::vector<BackpropConnection*> outgoing;
   
-  double learning_rate;
+  realscalar learning_rate;
 
-  dblmatrix& activation;
-  dblmatrix activation_df; // derivative of activation function
-  dblmatrix delta;
+  realmatrix delta;
+  realmatrix activation_df; // f'(net_input), same layout as delta
 
-  dblvector d_bias;        // delta for bias
+  realmatrix d_bias;        // delta for bias, a single row
+  realmatrix ones;          // batch x 1, for summing delta over the batch
 
   const ErrorFunction* error_fn;
+  realscalar canonical_delta_scale;
+
+  bool step_derivative;
+  realscalar neg_slope;
+  realscalar pos_slope;
 };
 
 
@@ -205,24 +271,29 @@ public:
 
   void NguyenWidrowInitialization()
   {
-    dblscalar beta = 0.7*pow(layer_to->Size(), 1.0 / (layer_from->Size()));
+    realscalar beta = 0.7*std::pow(layer_to->Size(), 1.0 / (layer_from->Size()));
     weights.NormalizeEachRow(beta);
   }
 
-  void AccumulateNetDelta(dblmatrix& delta);
+  // delta holds the rows of the batch from first_row on
+  void AccumulateNetDelta(realview delta, int first_row = 0);
 
-  void AccumulateGradients();
+  // as in BackpropLayer
+  void AccumulateGradients(int first_row, int rows);
+  void AccumulateGradients() { AccumulateGradients(0, layer_to->GetDelta().Rows()); }
 
   void UpdateWeights();
 
+  void AddToWorkspace(Workspace& workspace, const std::string& name);
+
 private:
   std::shared_ptr<Connection> connection;
   BackpropLayer* layer_from;
   BackpropLayer* layer_to;
   
-  dblmatrix&     weights;
-  dblmatrix      delta_w;
-  dblmatrix      delta_w_previous;
+  realmatrix&     weights;
+  realmatrix      delta_w;
+  realmatrix      delta_w_previous;
 
   BackpropTrainingParameters params;
 };
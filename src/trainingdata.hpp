@@ -1,6 +1,7 @@
 #pragma once
 
 #include "matrix.hpp"
+#include "sparse.hpp"
 #include "input.hpp"
 
 namespace nn
@@ -10,26 +11,46 @@ namespace nn
 class Batch
 {
 public:
-  Batch(int batch_size, int input_length, int output_length)
+  // a sparse batch keeps its inputs only in CSR form, for encodings that
+  // are mostly zeros (one-hot categories)
+  Batch(int batch_size, int input_length, int output_length, bool sparse_input_use = false)
     : max_batch_size(batch_size),
       current_batch_size(0),
-      input(batch_size, input_length),
-      output(batch_size, output_length)
-  {}
+      sparse(sparse_input_use),
+      input(sparse ? 0 : batch_size, input_length, realmatrix::PaddedLd(input_length)),
+      sparse_input(sparse ? batch_size : 0, input_length),
+      output(batch_size, output_length, realmatrix::PaddedLd(output_length))
+  {
+    input.SetRows(0);
+    sparse_input.SetRows(0);
+    output.SetRows(0);
+  }
 
-  int AddPair(const dblvector& in, const dblvector& out)
+  int AddPair(const realvector& in, const realvector& out)
   {
     if (current_batch_size >= max_batch_size) {
       throw "Batch Full!";
     }
 
-    input.SetRowValues(current_batch_size, in);
-    output.SetRowValues(current_batch_size, out);
-    ++current_batch_size;
+    const int row = current_batch_size++;
+    if (sparse) {
+      sparse_input.SetRows(current_batch_size);
+      sparse_input.SetRowValues(row, in);
+    } else {
+      input.SetRows(current_batch_size);
+      input.SetRowValues(row, in);
+    }
+    output.SetRows(current_batch_size);
+    output.SetRowValues(row, out);
+    return current_batch_size;
   }
 
-  const dblmatrix& Input() const { return input; }
-  const dblmatrix& Output() const { return output; }
+  // The inputs and outputs hold only the pairs added so far, so a partly
+  // filled batch trains and scores on just those rows.
+  bool IsSparse() const { return sparse; }
+  const realmatrix& Input() const { return input; }
+  const realsparsematrix& SparseInput() const { return sparse_input; }
+  const realmatrix& Output() const { return output; }
 
   int MaxBatchSize() const { return max_batch_size; }
   int CurrentBatchSize() const { return current_batch_size; }
@@ -37,8 +58,10 @@ public:
 private:
   int max_batch_size;
   int current_batch_size;
-  dblmatrix input;
-  dblmatrix output;
+  bool sparse;
+  realmatrix input;
+  realsparsematrix sparse_input;
+  realmatrix output;
 };
 
 
@@ -50,14 +73,15 @@ public:
   TrainingData(size_t batch_size_use, size_t num_batches_use,
                size_t input_length_use, size_t output_length_use,
                const input::InputEncoder<InputType>* input_enc_use,
-               const input::InputEncoder<OutputType>* output_enc_use)
+               const input::InputEncoder<OutputType>* output_enc_use,
+               bool sparse_input = false)
     : batch_size(batch_size_use),
       input_length(input_length_use),
       output_length(output_length_use),
       num_batches(num_batches_use),
       num_patterns(0),
       batch_to_add_to(0),
-      batches(num_batches, Batch(batch_size, input_length, output_length)),
+      batches(num_batches, Batch(batch_size, input_length, output_length, sparse_input)),
       input_encoder(input_enc_use),
       output_encoder(output_enc_use)
   {
@@ -98,6 +98,33 @@ private:
 
 
 
+// Running sum with Kahan compensation, for error totals over many
+// batches and epochs
+class KahanSum
+{
+public:
+  KahanSum() : sum(0), compensation(0) {}
+
+  void Add(double x)
+  {
+    double y = x - compensation;
+    double t = sum + y;
+    compensation = (t - sum) - y;
+    sum = t;
+  }
+
+  double Value() const { return sum; }
+
+private:
+  double sum;
+  double compensation;
+};
+
+
+
+
+
+
 class Observer
 {
 public:
@@ -105,6 +132,11 @@ public:
 
   virtual void UpdateBatch() = 0;
   virtual void UpdateEpoch() = 0;
+
+  // Whether this observer reads the network's error during the given
+  // epoch.  Trainers skip the error computation on epochs where no
+  // observer needs it.
+  virtual bool NeedsError(int epoch) const { return true; }
 };
 
 
@@ -117,6 +149,16 @@ public:
   void NotifyBatch() { for (auto& obs : observers) { obs->UpdateBatch(); } }
   void NotifyEpoch() { for (auto& obs : observers) { obs->UpdateEpoch(); } }
 
+  bool ObserversNeedError(int epoch) const
+  {
+    for (auto& obs : observers) {
+      if (obs->NeedsError(epoch)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
 private:
   std::set<Observer*> observers;
 };
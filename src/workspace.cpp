@@ -0,0 +1,118 @@
+#include "workspace.hpp"
+
+#include <iomanip>
+#include <new>
+
+#include <cstring>
+#include <cstdint>
+
+#ifdef __linux__
+#  include <sys/mman.h>
+#endif
+
+
+namespace nn
+{
+
+namespace
+{
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+}
+
+
+
+void
+Workspace::Allocate()
+{
+  char*  old_arena = arena;
+  size_t old_bytes = arena_bytes;
+  bool   old_mapped = arena_is_mapped;
+
+  arena = nullptr;
+  arena_bytes = 0;
+  arena_is_mapped = false;
+
+  const size_t bytes = (total_bytes > 0) ? total_bytes : CACHE_LINE_SIZE;
+
+#ifdef __linux__
+  if (huge_pages) {
+    arena_bytes = RoundUp(bytes, HUGE_PAGE_SIZE);
+    // over-map by one huge page so the arena can start on a huge page boundary
+    void* p = mmap(nullptr, arena_bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+      char* base = static_cast<char*>(p);
+      char* aligned = base + (HUGE_PAGE_SIZE - reinterpret_cast<uintptr_t>(base) % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+      if (aligned > base) {
+        munmap(base, aligned - base);
+      }
+      char* end = aligned + arena_bytes;
+      char* map_end = base + arena_bytes + HUGE_PAGE_SIZE;
+      if (map_end > end) {
+        munmap(end, map_end - end);
+      }
+      madvise(aligned, arena_bytes, MADV_HUGEPAGE);
+      arena = aligned;
+      arena_is_mapped = true;   // anonymous mappings are already zeroed
+    }
+  }
+#endif
+
+  if (!arena) {
+    arena_bytes = RoundUp(bytes, CACHE_LINE_SIZE);
+    arena = AlignedAllocator<char>().allocate(arena_bytes);
+    std::memset(arena, 0, arena_bytes);
+  }
+
+  for (auto& buffer : buffers) {
+    buffer.bind(arena + buffer.offset);
+  }
+
+  if (old_arena) {
+#ifdef __linux__
+    if (old_mapped) {
+      munmap(old_arena, old_bytes);
+      return;
+    }
+#endif
+    AlignedAllocator<char>().deallocate(old_arena, old_bytes);
+  }
+}
+
+
+
+void
+Workspace::Release()
+{
+  if (!arena) {
+    return;
+  }
+#ifdef __linux__
+  if (arena_is_mapped) {
+    munmap(arena, arena_bytes);
+    arena = nullptr;
+    return;
+  }
+#endif
+  AlignedAllocator<char>().deallocate(arena, arena_bytes);
+  arena = nullptr;
+}
+
+
+
+void
+Workspace::Report(std::ostream& out) const
+{
+  for (auto& buffer : buffers) {
+    out << std::setw(32) << std::left << buffer.name << std::right
+        << std::setw(12) << buffer.bytes << " bytes" << std::endl;
+  }
+  out << std::setw(32) << std::left << "total" << std::right
+      << std::setw(12) << total_bytes << " bytes in " << buffers.size() << " buffers, "
+      << arena_bytes << " reserved" << (arena_is_mapped ? " (huge pages)" : "") << std::endl;
+}
+
+
+} // namespace nn
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "matrix.hpp"
+
+#include <vector>
+#include <functional>
+#include <string>
+#include <iostream>
+
+#include <algorithm>
+
+#include <cstddef>
+
+namespace nn
+{
+
+// Plans and owns one contiguous, cache-line aligned arena holding the
+// buffers of a network or trainer.  Matrices are registered with Add, which
+// only records their size; Allocate then makes a single allocation and
+// binds every registered matrix to its slice, carrying over any contents
+// it already had.  Registered matrices must not move, and must not be used
+// after the workspace is destroyed.
+class Workspace
+{
+public:
+  Workspace()
+    : arena(nullptr),
+      arena_bytes(0),
+      arena_is_mapped(false),
+      total_bytes(0),
+      huge_pages(false)
+  {}
+  ~Workspace() { Release(); }
+
+  Workspace(const Workspace&) = delete;
+  Workspace& operator=(const Workspace&) = delete;
+
+  // matrices that had no storage yet start out filled with fill_value.
+  // Every row of the matrix's capacity gets space, whatever its current
+  // row count.
+  template <typename T>
+  void Add(const std::string& name, Matrix<T>& m, T fill_value = 0)
+  {
+    size_t bytes = m.StorageCapacity() * sizeof(T);
+    buffers.push_back({ name, total_bytes, bytes,
+                        [&m, fill_value](void* storage) {
+                          bool had_storage = (m.GetPtr() != nullptr);
+                          m.Bind(static_cast<T*>(storage));
+                          if (!had_storage) {
+                            std::fill_n(m.GetPtr(), m.StorageCapacity(), fill_value);
+                          }
+                        } });
+    total_bytes += RoundUp(bytes, CACHE_LINE_SIZE);
+  }
+
+  // Backs the arena with transparent huge pages where the OS supports it.
+  // Takes effect at the next Allocate.
+  void UseHugePages(bool use) { huge_pages = use; }
+
+  // (re)allocates the arena and binds every registered matrix to it
+  void Allocate();
+
+  // forgets the registered matrices; the arena stays until the next Allocate
+  void Clear() { buffers.clear(); total_bytes = 0; }
+
+  size_t Bytes() const { return total_bytes; }         // bytes used by buffers
+  size_t ArenaBytes() const { return arena_bytes; }    // bytes actually reserved
+  size_t NumBuffers() const { return buffers.size(); }
+  bool IsAllocated() const { return arena != nullptr; }
+  bool UsesHugePages() const { return huge_pages; }
+
+  void Report(std::ostream& out) const;
+
+private:
+  struct Buffer
+  {
+    std::string name;
+    size_t offset;
+    size_t bytes;
+    std::function<void(void*)> bind;
+  };
+
+  std::vector<Buffer> buffers;
+
+  char*  arena;
+  size_t arena_bytes;
+  bool   arena_is_mapped;   // mmap'ed for huge pages rather than allocated
+  size_t total_bytes;
+  bool   huge_pages;
+
+  static size_t RoundUp(size_t n, size_t multiple) { return (n + multiple - 1) / multiple * multiple; }
+
+  void Release();
+};
+
+
+} // namespace nn
@@ -0,0 +1,61 @@
+#include "gtest/gtest.h"
+
+#include "../src/activation.hpp"
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+
+namespace
+{
+
+std::vector<std::shared_ptr<nn::ActivationFunction>> AllActivations()
+{
+  return { std::make_shared<nn::SigmoidActivation>(0, 1),
+           std::make_shared<nn::SigmoidActivation>(-1, 1, 2),
+           std::make_shared<nn::TanhActivation>(),
+           std::make_shared<nn::LinearActivation>(0.5),
+           std::make_shared<nn::ReLUActivation>(),
+           std::make_shared<nn::LeakyReLUActivation>(0.1),
+           std::make_shared<nn::SoftplusActivation>() };
+}
+
+}
+
+
+TEST(Activation, BatchedMatchesScalar)
+{
+  const size_t n = 37;
+  std::vector<nn::realscalar> x(n), fx(n), df(n);
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = -6 + 12 * nn::realscalar(i) / (n - 1);
+  }
+
+  for (auto& fn : AllActivations()) {
+    fn->Apply(&x[0], &fx[0], n);
+    fn->Derivative(&x[0], &fx[0], &df[0], n);
+
+    for (size_t i = 0; i < n; ++i) {
+      EXPECT_NEAR(fn->f(x[i]), fx[i], 1e-6) << "x = " << x[i];
+      EXPECT_NEAR(fn->df(x[i], fx[i]), df[i], 1e-6) << "x = " << x[i];
+    }
+  }
+}
+
+
+TEST(Activation, SoftmaxIsStable)
+{
+  nn::SoftmaxActivation softmax;
+  const nn::realscalar in[] = { 1000, 999, -1000, 998 };
+  nn::realscalar p[4];
+
+  // exp(1000) overflows without the shift by the maximum
+  nn::realscalar lse = softmax.ApplyRow(in, p, 4);
+  nn::realscalar z = 1 + std::exp(-1.0) + std::exp(-2.0);
+  EXPECT_NEAR(1 / z, p[0], 1e-6);
+  EXPECT_NEAR(std::exp(-1.0) / z, p[1], 1e-6);
+  EXPECT_EQ(0, p[2]);
+  EXPECT_NEAR(1000 + std::log(z), lse, 1e-4);
+  EXPECT_NEAR(1, p[0] + p[1] + p[2] + p[3], 1e-6);
+}
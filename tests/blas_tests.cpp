@@ -0,0 +1,170 @@
+#include "gtest/gtest.h"
+
+#include "../src/blas.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cmath>
+
+
+namespace
+{
+
+template <typename T>
+std::vector<T> RandomVector(size_t n, std::mt19937& rng)
+{
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  std::vector<T> v(n);
+  for (auto& x : v) {
+    x = T(dist(rng));
+  }
+  return v;
+}
+
+
+// C = alpha op(A) op(B) + beta C, the slow way
+template <typename T>
+void ReferenceGemm(nn::blas::Transpose ta, nn::blas::Transpose tb, int m, int n, int k,
+                   T alpha, const T* A, int lda, const T* B, int ldb, T beta, T* C, int ldc)
+{
+  for (int i = 0; i < m; ++i) {
+    for (int j = 0; j < n; ++j) {
+      double sum = 0;
+      for (int p = 0; p < k; ++p) {
+        double a = (ta == nn::blas::Trans) ? A[p*lda + i] : A[i*lda + p];
+        double b = (tb == nn::blas::Trans) ? B[j*ldb + p] : B[p*ldb + j];
+        sum += a*b;
+      }
+      C[i*ldc + j] = T(alpha*sum + beta*C[i*ldc + j]);
+    }
+  }
+}
+
+
+template <typename T>
+void CheckGemm(const nn::blas::Backend& backend, double tolerance)
+{
+  std::mt19937 rng(1234);
+  const int shapes[][3] = { { 1, 1, 1 }, { 3, 24, 4 }, { 7, 3, 24 }, { 33, 230, 290 }, { 5, 513, 17 } };
+  const nn::blas::Transpose trans[] = { nn::blas::NoTrans, nn::blas::Trans };
+
+  for (auto& shape : shapes) {
+    int m = shape[0], n = shape[1], k = shape[2];
+    for (auto ta : trans) {
+      for (auto tb : trans) {
+        // padded leading dimensions
+        int lda = ((ta == nn::blas::Trans) ? m : k) + 3;
+        int ldb = ((tb == nn::blas::Trans) ? k : n) + 5;
+        int ldc = n + 2;
+        int a_rows = (ta == nn::blas::Trans) ? k : m;
+        int b_rows = (tb == nn::blas::Trans) ? n : k;
+
+        auto A = RandomVector<T>(a_rows * lda, rng);
+        auto B = RandomVector<T>(b_rows * ldb, rng);
+        auto C = RandomVector<T>(m * ldc, rng);
+        auto expected = C;
+
+        ReferenceGemm<T>(ta, tb, m, n, k, T(0.5), &A[0], lda, &B[0], ldb, T(2), &expected[0], ldc);
+        backend.Gemm(ta, tb, m, n, k, T(0.5), &A[0], lda, &B[0], ldb, T(2), &C[0], ldc);
+
+        for (int i = 0; i < m; ++i) {
+          for (int j = 0; j < ldc; ++j) {
+            EXPECT_NEAR(expected[i*ldc + j], C[i*ldc + j], tolerance * (k + 1))
+              << backend.Name() << " m=" << m << " n=" << n << " k=" << k
+              << " ta=" << ta << " tb=" << tb;
+          }
+        }
+      }
+    }
+  }
+}
+
+
+template <typename T>
+void CheckLevel12(const nn::blas::Backend& backend, double tolerance)
+{
+  std::mt19937 rng(4321);
+  const int m = 37, n = 21, lda = 24;
+
+  auto A = RandomVector<T>(m * lda, rng);
+  auto x = RandomVector<T>(m, rng);
+  auto y = RandomVector<T>(n, rng);
+
+  // y = A^T x + y
+  auto expected = y;
+  for (int j = 0; j < n; ++j) {
+    for (int i = 0; i < m; ++i) {
+      expected[j] += A[i*lda + j] * x[i];
+    }
+  }
+  auto result = y;
+  backend.Gemv(nn::blas::Trans, m, n, T(1), &A[0], lda, &x[0], T(1), &result[0]);
+  for (int j = 0; j < n; ++j) {
+    EXPECT_NEAR(expected[j], result[j], tolerance * m) << backend.Name();
+  }
+
+  // x = A y, beta = 0 must ignore NaNs already in x
+  std::vector<T> ax(m, std::nan(""));
+  backend.Gemv(nn::blas::NoTrans, m, n, T(1), &A[0], lda, &y[0], T(0), &ax[0]);
+  for (int i = 0; i < m; ++i) {
+    double sum = 0;
+    for (int j = 0; j < n; ++j) {
+      sum += A[i*lda + j] * y[j];
+    }
+    EXPECT_NEAR(sum, ax[i], tolerance * n) << backend.Name();
+  }
+
+  // A += 2 x y^T
+  auto B = A;
+  backend.Ger(m, n, T(2), &x[0], &y[0], &B[0], lda);
+  for (int i = 0; i < m; ++i) {
+    for (int j = 0; j < n; ++j) {
+      EXPECT_NEAR(A[i*lda + j] + 2*x[i]*y[j], B[i*lda + j], tolerance) << backend.Name();
+    }
+  }
+
+  // axpy, scal, nrm2
+  auto z = x;
+  backend.Axpy(m, T(-1), &x[0], &z[0]);
+  backend.Scal(m, T(3), &z[0]);
+  for (int i = 0; i < m; ++i) {
+    EXPECT_EQ(T(0), z[i]) << backend.Name();
+  }
+
+  double norm = 0;
+  for (auto v : x) {
+    norm += double(v)*v;
+  }
+  EXPECT_NEAR(std::sqrt(norm), backend.Nrm2(m, &x[0]), tolerance) << backend.Name();
+
+  std::vector<T> big(10, T(1e30));
+  EXPECT_NEAR(std::sqrt(10.0), backend.Nrm2(10, &big[0]) / T(1e30), tolerance) << backend.Name();
+}
+
+}
+
+
+TEST(Blas, AvailableBackends)
+{
+  auto names = nn::blas::AvailableBackends();
+
+  EXPECT_NE(names.end(), std::find(names.begin(), names.end(), "native"));
+  EXPECT_NE(names.end(), std::find(names.begin(), names.end(), "native-generic"));
+  EXPECT_EQ(nullptr, nn::blas::GetBackend("no-such-backend"));
+  EXPECT_FALSE(nn::blas::SelectBackend("no-such-backend"));
+}
+
+
+TEST(Blas, BackendsMatchReference)
+{
+  for (auto& name : nn::blas::AvailableBackends()) {
+    auto backend = nn::blas::GetBackend(name);
+    ASSERT_NE(nullptr, backend);
+
+    CheckGemm<float>(*backend, 1e-5);
+    CheckGemm<double>(*backend, 1e-12);
+    CheckLevel12<float>(*backend, 1e-5);
+    CheckLevel12<double>(*backend, 1e-12);
+  }
+}
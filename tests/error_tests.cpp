@@ -0,0 +1,96 @@
+#include "gtest/gtest.h"
+
+#include "../src/error.hpp"
+#include "../src/network.hpp"
+#include "../src/utility.hpp"
+
+#include <memory>
+#include <random>
+#include <vector>
+
+
+namespace
+{
+
+double ElementwiseSum(const nn::ErrorFunction& fn, const nn::realscalar* a, const nn::realscalar* t, size_t n)
+{
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += fn.E(a[i], t[i]);
+  }
+  return sum;
+}
+
+}
+
+
+TEST(Error, BatchedSumMatchesElementwise)
+{
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+
+  const size_t max_n = 41;
+  std::vector<nn::realscalar> a(max_n), t(max_n);
+  for (size_t i = 0; i < max_n; ++i) {
+    a[i] = nn::realscalar(dist(rng));
+    t[i] = (i % 3 == 0) ? 1 : 0;
+  }
+  a[4] = 0;         // the cases CrossEntropyError::E leaves out
+  a[5] = 1;
+
+  nn::SquaredError squared;
+  nn::CrossEntropyError cross_entropy;
+  nn::CategoricalCrossEntropyError categorical;
+  a[3] = 0.25;      // categorical needs p > 0 where t = 1
+  for (const nn::ErrorFunction* fn : { (const nn::ErrorFunction*)&squared,
+                                       (const nn::ErrorFunction*)&cross_entropy,
+                                       (const nn::ErrorFunction*)&categorical }) {
+    for (size_t n = 0; n <= max_n; ++n) {
+      double expected = ElementwiseSum(*fn, &a[0], &t[0], n);
+      EXPECT_NEAR(expected, fn->Sum(&a[0], &t[0], n), 1e-5 * (1 + expected)) << "n = " << n;
+    }
+  }
+}
+
+
+TEST(Error, KahanSum)
+{
+  nn::utility::KahanSum sum;
+  double naive = 1;
+  sum.Add(1);
+  for (int i = 0; i < 1000000; ++i) {
+    sum.Add(1e-16);
+    naive += 1e-16;
+  }
+  EXPECT_EQ(1, naive);
+  EXPECT_NEAR(1 + 1e-10, sum.Value(), 1e-15);
+}
+
+
+TEST(Error, RowErrors)
+{
+  const int batch = 6;
+  nn::Network network({ 4, 5, 7 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::SigmoidActivation>(0, 1),
+                      std::make_shared<nn::CrossEntropyError>());
+
+  nn::realmatrix X(batch, 4, nn::realmatrix::PaddedLd(4));
+  nn::realmatrix T(batch, 7, nn::realmatrix::PaddedLd(7));
+  for (int row = 0; row < batch; ++row) {
+    X.SetEntry(row, row % 4, 1);
+    T.SetEntry(row, row % 7, 1);
+  }
+
+  const auto& output = network.FeedForward(X);
+  std::vector<nn::realscalar> row_errors(batch);
+  double total = network.TotalError(T, &row_errors[0]);
+
+  nn::CrossEntropyError cross_entropy;
+  double sum = 0;
+  for (int row = 0; row < batch; ++row) {
+    EXPECT_NEAR(ElementwiseSum(cross_entropy, output.GetRowPtr(row), T.GetRowPtr(row), 7), row_errors[row], 1e-5);
+    sum += row_errors[row];
+  }
+  EXPECT_NEAR(sum, total, 1e-6);
+}
@@ -0,0 +1,153 @@
+#include "gtest/gtest.h"
+
+#include "../src/fastmath.hpp"
+#include "../src/activation.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+
+
+namespace
+{
+
+using nn::fastmath::Accuracy;
+
+struct MaxError
+{
+  double exp;
+  double sigmoid;
+  double tanh;
+  double softplus;
+};
+
+
+double RelativeError(double approx, double ref)
+{
+  return ref == 0 ? std::fabs(approx) : std::fabs(approx - ref) / std::fabs(ref);
+}
+
+
+// max relative error of each function against libm in double, over a
+// linear grid and, where cancellation would show, a logarithmic one
+// towards 0
+template <Accuracy A, typename T>
+MaxError Measure()
+{
+  MaxError err = { 0, 0, 0, 0 };
+
+  for (double x = -80; x <= 80; x += 1e-3) {
+    T t = T(x);
+    err.exp = std::max(err.exp, RelativeError(nn::fastmath::Exp<A>(t), std::exp(double(t))));
+  }
+  auto sigmoid_tanh = [&err](T t) {
+    err.sigmoid = std::max(err.sigmoid, RelativeError(nn::fastmath::Sigmoid<A>(t), 1 / (1 + std::exp(-double(t)))));
+    err.tanh = std::max(err.tanh, RelativeError(nn::fastmath::Tanh<A>(t), std::tanh(double(t))));
+    const double softplus = std::max(double(t), 0.0) + std::log1p(std::exp(-std::fabs(double(t))));
+    err.softplus = std::max(err.softplus, RelativeError(nn::fastmath::Softplus<A>(t), softplus));
+  };
+  for (double x = -20; x <= 20; x += 1e-4) {
+    sigmoid_tanh(T(x));
+  }
+  for (double x = 1e-8; x < 2; x *= 1.001) {
+    sigmoid_tanh(T(x));
+    sigmoid_tanh(T(-x));
+  }
+
+  return err;
+}
+
+
+template <Accuracy A, typename T>
+MaxError Report(const char* name)
+{
+  auto err = Measure<A, T>();
+  std::cout << "[ fastmath ] " << std::setw(14) << std::left << name << std::right
+            << std::scientific << std::setprecision(2) << " max relative error:"
+            << " exp " << err.exp << "  sigmoid " << err.sigmoid
+            << "  tanh " << err.tanh << "  softplus " << err.softplus << std::defaultfloat << std::endl;
+  return err;
+}
+
+}
+
+
+TEST(FastMath, MaxErrorAgainstLibm)
+{
+  auto exact_f = Report<Accuracy::Exact, float>("float exact");
+  auto high_f  = Report<Accuracy::High, float>("float high");
+  auto fast_f  = Report<Accuracy::Fast, float>("float fast");
+  auto exact_d = Report<Accuracy::Exact, double>("double exact");
+  auto high_d  = Report<Accuracy::High, double>("double high");
+  auto fast_d  = Report<Accuracy::Fast, double>("double fast");
+
+  // float tiers are limited by float rounding
+  EXPECT_LT(exact_f.exp, 1e-7);
+  EXPECT_LT(high_f.exp, 5e-7);
+  EXPECT_LT(high_f.sigmoid, 5e-7);
+  EXPECT_LT(high_f.tanh, 5e-7);
+  EXPECT_LT(high_f.softplus, 5e-7);
+  EXPECT_LT(fast_f.exp, 1e-4);
+  EXPECT_LT(fast_f.sigmoid, 1e-4);
+  EXPECT_LT(fast_f.tanh, 1e-4);
+  EXPECT_LT(fast_f.softplus, 1e-4);
+
+  EXPECT_EQ(0, exact_d.exp);
+  EXPECT_LT(high_d.exp, 2e-7);
+  EXPECT_LT(high_d.sigmoid, 2e-7);
+  EXPECT_LT(high_d.tanh, 2e-7);
+  EXPECT_LT(high_d.softplus, 2e-7);
+  EXPECT_LT(fast_d.exp, 1e-4);
+  EXPECT_LT(fast_d.sigmoid, 1e-4);
+  EXPECT_LT(fast_d.tanh, 1e-4);
+  EXPECT_LT(fast_d.softplus, 1e-4);
+}
+
+
+TEST(FastMath, LogAgainstLibm)
+{
+  double high_f = 0, fast_f = 0, high_d = 0;
+  for (double x = 1e-30; x < 1e30; x *= 1.001) {
+    double ref = std::log(x);
+    double scale = std::max(1.0, std::fabs(ref));
+    high_f = std::max(high_f, std::fabs(nn::fastmath::Log<Accuracy::High>(float(x)) - std::log(double(float(x)))) / scale);
+    fast_f = std::max(fast_f, std::fabs(nn::fastmath::Log<Accuracy::Fast>(float(x)) - std::log(double(float(x)))) / scale);
+    high_d = std::max(high_d, std::fabs(nn::fastmath::Log<Accuracy::High>(x) - ref) / scale);
+  }
+
+  EXPECT_LT(high_f, 2e-6);
+  EXPECT_LT(fast_f, 1e-4);
+  EXPECT_LT(high_d, 1e-9);
+  EXPECT_EQ(0, nn::fastmath::Log<Accuracy::High>(1.0));
+}
+
+
+TEST(FastMath, SaturatesOutsideRange)
+{
+  EXPECT_NEAR(0, nn::fastmath::Sigmoid<Accuracy::Fast>(-1e30), 1e-30);
+  EXPECT_EQ(1, nn::fastmath::Sigmoid<Accuracy::Fast>(1e30f));
+  EXPECT_EQ(-1, nn::fastmath::Tanh<Accuracy::High>(-1000.0));
+  EXPECT_EQ(1, nn::fastmath::Tanh<Accuracy::High>(1000.0f));
+  EXPECT_GT(nn::fastmath::Exp<Accuracy::High>(100.0f), 1e37f);
+}
+
+
+TEST(FastMath, ActivationAccuracy)
+{
+  const size_t n = 101;
+  std::vector<nn::realscalar> x(n), exact(n), approx(n);
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = -10 + 20 * nn::realscalar(i) / (n - 1);
+  }
+
+  nn::SigmoidActivation sigmoid(-1, 1, 2);
+  nn::TanhActivation tanh;
+  for (nn::ActivationFunction* fn : { (nn::ActivationFunction*)&sigmoid, (nn::ActivationFunction*)&tanh }) {
+    fn->Apply(&x[0], &exact[0], n);
+    fn->SetAccuracy(Accuracy::Fast);
+    fn->Apply(&x[0], &approx[0], n);
+    for (size_t i = 0; i < n; ++i) {
+      EXPECT_NEAR(exact[i], approx[i], 2e-4) << "x = " << x[i];
+    }
+  }
+}
@@ -0,0 +1,173 @@
+#include "gtest/gtest.h"
+
+#include "../src/inference.hpp"
+#include "../src/network.hpp"
+#include "../src/train.hpp"
+#include "test_helpers.hpp"
+
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+
+TEST(Inference, MatchesFeedForward)
+{
+  const int batch = 8;
+  std::mt19937 rng(21);
+
+  std::vector<std::unique_ptr<nn::Network>> networks;
+  networks.emplace_back(new nn::Network({ 5, 9, 4 }, batch,
+                                        std::make_shared<nn::TanhActivation>(),
+                                        std::make_shared<nn::SigmoidActivation>(0, 1),
+                                        std::make_shared<nn::CrossEntropyError>()));
+  networks.emplace_back(new nn::Network({ 5, 17, 11, 3 }, batch,
+                                        std::make_shared<nn::ReLUActivation>(),
+                                        std::make_shared<nn::SoftmaxActivation>(),
+                                        std::make_shared<nn::CategoricalCrossEntropyError>()));
+  networks.emplace_back(new nn::Network(batch, std::make_shared<nn::SquaredError>()));
+  networks.back()->AddLayer<nn::LinearActivation>(5);
+  networks.back()->AddLayer<nn::TanhActivation>(6);
+  networks.back()->AddLayer<nn::LinearActivation, nn::SquaredError>(2);
+  networks.back()->AddDefaultConnections();
+
+  for (auto& network : networks) {
+    Randomize(*network, rng);
+    auto X = RandomMatrix(batch, 5, rng);
+    nn::realmatrix expected = network->FeedForward(X);
+
+    nn::InferenceModel model(*network);
+    EXPECT_EQ(5, model.InputSize());
+    EXPECT_EQ(expected.Cols(), model.OutputSize());
+
+    nn::realmatrix output(batch, model.OutputSize(), nn::realmatrix::PaddedLd(model.OutputSize()));
+    model.Predict(X, output);
+    ExpectNear(expected, output, 1e-6);
+
+    // any number of rows, and the result doesn't depend on the batch
+    nn::realmatrix one(1, model.OutputSize());
+    model.Predict(nn::constrealview(X).SubRows(3, 1), one);
+    for (int col = 0; col < model.OutputSize(); ++col) {
+      EXPECT_NEAR(expected.GetRowPtr(3)[col], one.GetRowPtr(0)[col], 1e-6);
+    }
+
+    // the model keeps its own copy of the weights
+    Randomize(*network, rng);
+    model.Predict(X, output);
+    ExpectNear(expected, output, 1e-6);
+  }
+}
+
+
+TEST(Inference, SparseInput)
+{
+  const int batch = 6;
+  std::mt19937 rng(4);
+  nn::Network network({ 12, 7, 3 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+  Randomize(network, rng);
+  nn::InferenceModel model(network);
+
+  nn::realmatrix X(batch, 12, nn::realmatrix::PaddedLd(12));
+  for (int row = 0; row < batch; ++row) {
+    X.SetEntry(row, (5*row) % 12, 1);
+  }
+  nn::realsparsematrix S(X);
+
+  nn::realmatrix dense(batch, 3), sparse(batch, 3);
+  model.Predict(X, dense);
+  model.Predict(S, sparse);
+  ExpectNear(dense, sparse, 1e-6);
+
+  nn::realmatrix wrong(batch, 4);
+  EXPECT_THROW(model.Predict(X, wrong), const char*);
+}
+
+
+// a pruned network scores from its sparse weights, which are all the
+// model keeps of them
+TEST(Inference, PrunedWeights)
+{
+  const int batch = 6;
+  std::mt19937 rng(83);
+  nn::Network network({ 12, 30, 3 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+  Randomize(network, rng);
+  nn::InferenceModel unpruned(network);
+
+  network.SetSparseBreakEven(1);
+  network.PruneToSparsity(0.9, true);
+  auto X = RandomMatrix(batch, 12, rng);
+  nn::realmatrix expected = network.FeedForward(X);
+
+  nn::InferenceModel model(network), shared(network, false);
+  EXPECT_LT(model.ParameterBytes(), unpruned.ParameterBytes() / 2);
+
+  nn::realmatrix output(batch, 3);
+  model.Predict(X, output);
+  ExpectNear(expected, output, 1e-6);
+  shared.Predict(X, output);
+  ExpectNear(expected, output, 1e-6);
+
+  for (int row = 0; row < batch; ++row) {
+    for (int col = 0; col < 12; ++col) {
+      if ((row + col) % 4 != 0) {
+        X.SetEntry(row, col, 0);
+      }
+    }
+  }
+  expected = network.FeedForward(X);
+  model.Predict(nn::realsparsematrix(X), output);
+  ExpectNear(expected, output, 1e-6);
+}
+
+
+// threads scoring concurrently against one model, each with its own
+// context, get the same results as a single thread
+TEST(Inference, ConcurrentContexts)
+{
+  const int batch = 16, num_threads = 8, rounds = 50;
+  std::mt19937 rng(12);
+  nn::Network network({ 10, 32, 24, 5 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::SoftmaxActivation>(),
+                      std::make_shared<nn::CategoricalCrossEntropyError>());
+  Randomize(network, rng);
+
+  for (bool copy_parameters : { true, false }) {
+    const nn::InferenceModel model(network, copy_parameters);
+    EXPECT_EQ(copy_parameters, model.ParameterBytes() > 0);
+
+    // a different number of rows per thread
+    std::vector<nn::realmatrix> inputs, expected, outputs;
+    nn::ExecutionContext serial(model);
+    for (int t = 0; t < num_threads; ++t) {
+      const int rows = 1 + t*2;
+      inputs.push_back(RandomMatrix(rows, 10, rng));
+      expected.emplace_back(rows, 5);
+      outputs.emplace_back(rows, 5);
+      model.Predict(serial, inputs.back(), expected.back());
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&, t]() {
+        nn::ExecutionContext context(model);
+        for (int r = 0; r < rounds; ++r) {
+          model.Predict(context, inputs[t], outputs[t]);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    for (int t = 0; t < num_threads; ++t) {
+      ExpectNear(expected[t], outputs[t], 0);
+    }
+  }
+}
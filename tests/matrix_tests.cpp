@@ -1,6 +1,10 @@
 #include "gtest/gtest.h"
 
 #include "../src/matrix.hpp"
+#include "../src/expression.hpp"
+
+#include <cstdint>
+#include <type_traits>
 
 nn::dblmatrix CreateMatrix(int rows, int cols)
 {
@@ -106,4 +110,152 @@ TEST(Matrix, accum_y_alphax)
   for (int i = 0; i < answer.size(); ++i) {
     EXPECT_EQ(answer[i], result[i]);
   }
-}
\ No newline at end of file
+}
+
+TEST(Matrix, accum_A_BC_float)
+{
+  nn::fltmatrix B(2, 3);
+  nn::fltmatrix C(3, 2);
+  nn::fltmatrix A(2, 2);
+
+  for (int i = 0; i < B.Size(); ++i) {
+    B.SetEntry(i, i + 1.0f);
+    C.SetEntry(i, i + 1.0f);
+  }
+
+  nn::accum_A_BC(A, B, C);
+
+  nn::fltvector answer{ 22, 28, 49, 64 };
+  const auto& result = A.GetRef();
+
+  EXPECT_EQ(answer.size(), result.size());
+  for (int i = 0; i < answer.size(); ++i) {
+    EXPECT_EQ(answer[i], result[i]);
+  }
+}
+
+
+TEST(Matrix, NormalizeEachRow)
+{
+  auto A = CreateMatrix(2, 2);
+
+  A.NormalizeEachRow(2.0);
+
+  for (int row = 0; row < A.Rows(); ++row) {
+    auto values = A.GetRowValues(row);
+    EXPECT_NEAR(4.0, values[0]*values[0] + values[1]*values[1], 1e-12);
+  }
+}
+
+
+TEST(Matrix, PaddedLeadingDimension)
+{
+  EXPECT_EQ(8, nn::dblmatrix::PaddedLd(3));
+  EXPECT_EQ(24, nn::dblmatrix::PaddedLd(24));
+  EXPECT_EQ(232, nn::dblmatrix::PaddedLd(230));
+  EXPECT_EQ(520, nn::dblmatrix::PaddedLd(512));
+  EXPECT_EQ(16, nn::fltmatrix::PaddedLd(3));
+
+  auto B = CreateMatrix(2, 3);
+  auto C = CreateMatrix(3, 2);
+  nn::dblmatrix A(2, 2, nn::dblmatrix::PaddedLd(2));
+  nn::dblmatrix Bp(2, 3, nn::dblmatrix::PaddedLd(3));
+  nn::dblmatrix Cp(3, 2, nn::dblmatrix::PaddedLd(2));
+
+  Bp.SetData(nn::dblvector(B.begin(), B.end()));
+  Cp.SetData(nn::dblvector(C.begin(), C.end()));
+
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(Bp.GetRowPtr(1)) % 64);
+
+  nn::accum_A_BC(A, Bp, Cp);
+
+  nn::dblvector answer{ 22, 28, 49, 64 };
+  for (int row = 0; row < A.Rows(); ++row) {
+    for (int col = 0; col < A.Cols(); ++col) {
+      EXPECT_EQ(answer[row * 2 + col], A.GetRowPtr(row)[col]);
+    }
+  }
+  EXPECT_DOUBLE_EQ(B.Norm(), Bp.Norm());
+}
+
+
+TEST(Matrix, MatrixView)
+{
+  auto B = CreateMatrix(4, 3);
+  auto C = CreateMatrix(3, 2);
+  nn::dblmatrix A(2, 4);
+
+  // rows 1-2 of B times C, written into columns 2-3 of A
+  nn::ConstMatrixView<double> B_rows = nn::ConstMatrixView<double>(B).SubRows(1, 2);
+  nn::MatrixView<double> A_cols = nn::MatrixView<double>(A).SubCols(2, 2);
+
+  EXPECT_EQ(4.0, B_rows(0, 0));
+  EXPECT_EQ(3, B_rows.LeadingDim());
+
+  nn::accum_A_BC(A_cols, B_rows, C);
+
+  nn::dblvector answer{ 0, 0, 49, 64, 0, 0, 76, 100 };
+  const auto& result = A.GetRef();
+
+  EXPECT_EQ(answer.size(), result.size());
+  for (int i = 0; i < answer.size(); ++i) {
+    EXPECT_EQ(answer[i], result[i]);
+  }
+
+  // a const matrix only gives read-only views
+  static_assert(std::is_constructible<nn::ConstMatrixView<double>, const nn::dblmatrix&>::value, "");
+  static_assert(!std::is_constructible<nn::MatrixView<double>, const nn::dblmatrix&>::value, "");
+}
+
+
+TEST(Matrix, SetRows)
+{
+  nn::dblmatrix A(4, 3, nn::dblmatrix::PaddedLd(3));
+  const double* storage = A.GetPtr();
+  A.SetEntry(3, 2, 7);
+
+  A.SetRows(2);
+  EXPECT_EQ(2, A.Rows());
+  EXPECT_EQ(4, A.Capacity());
+  EXPECT_EQ(2 * A.LeadingDim(), A.StorageSize());
+  EXPECT_EQ(storage, A.GetPtr());
+
+  // the rows past the end keep their contents
+  A.SetRows(4);
+  EXPECT_EQ(7, A.GetRowPtr(3)[2]);
+  EXPECT_THROW(A.SetRows(5), const char*);
+
+  // copies keep the capacity
+  A.SetRows(1);
+  nn::dblmatrix B(A);
+  EXPECT_EQ(1, B.Rows());
+  B.SetRows(4);
+  EXPECT_EQ(7, B.GetRowPtr(3)[2]);
+}
+
+
+TEST(Matrix, Expression)
+{
+  using namespace nn::expr;
+
+  auto B = CreateMatrix(2, 3);
+  nn::dblmatrix C(2, 3, nn::dblmatrix::PaddedLd(3));
+  C.SetData(nn::dblvector{ 1, 1, 1, 2, 2, 2 });
+
+  auto square = [](double x) { return x*x; };
+
+  // B = 2 B^2 - C, with B also an operand
+  B = 2.0 * Map(square, Ref(B)) - Ref(C);
+
+  nn::dblvector answer{ 1, 7, 17, 30, 48, 70 };
+  const auto& result = B.GetRef();
+  for (int i = 0; i < answer.size(); ++i) {
+    EXPECT_EQ(answer[i], result[i]);
+  }
+
+  ForEach([](double& b, double& c) { c += b; b = 0; }, B, C);
+
+  EXPECT_EQ(0.0, B.GetRowPtr(1)[2]);
+  EXPECT_EQ(72.0, C.GetRowPtr(1)[2]);
+  EXPECT_EQ(0.0, C.GetRowPtr(1)[3]);  // padding untouched
+}
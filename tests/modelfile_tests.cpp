@@ -0,0 +1,239 @@
+#include "gtest/gtest.h"
+
+#include "../src/modelfile.hpp"
+#include "../src/network.hpp"
+#include "../src/train.hpp"
+#include "test_helpers.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+
+
+namespace
+{
+
+const int batch = 4;
+
+std::string TempFile(const std::string& name)
+{
+  return testing::TempDir() + name;
+}
+
+// the loaded network gives the same outputs.  A DenseLayer loads as a
+// runtime Layer, which adds the bias in a different order.
+void ExpectSameOutputs(nn::Network& saved, nn::Network& loaded, int inputs, std::mt19937& rng)
+{
+  auto X = RandomMatrix(batch, inputs, rng);
+  nn::realmatrix expected = saved.FeedForward(X);
+  const auto& output = loaded.FeedForward(X);
+  ASSERT_EQ(expected.Cols(), output.Cols());
+  for (int row = 0; row < batch; ++row) {
+    for (int col = 0; col < output.Cols(); ++col) {
+      EXPECT_NEAR(expected.GetRowPtr(row)[col], output.GetRowPtr(row)[col], 1e-6);
+    }
+  }
+}
+
+}
+
+
+TEST(ModelFile, RoundTrip)
+{
+  std::mt19937 rng(3);
+  const std::string file_name = TempFile("bpnn_roundtrip.model");
+
+  nn::Network runtime({ 5, 9, 4 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::SigmoidActivation>(-1, 2, 0.5),
+                      std::make_shared<nn::CrossEntropyError>());
+  runtime.SetMathAccuracy(nn::fastmath::Accuracy::High);
+
+  nn::Network dense(batch, std::make_shared<nn::CategoricalCrossEntropyError>());
+  dense.AddLayer<nn::LinearActivation>(5, nn::realscalar(2));
+  dense.AddLayer<nn::LeakyReLUActivation>(17, nn::realscalar(0.2));
+  dense.AddLayer<nn::SoftplusActivation>(6);
+  dense.AddLayer<nn::SoftmaxActivation, nn::CategoricalCrossEntropyError>(3);
+  dense.AddDefaultConnections();
+
+  // two inputs and a skip connection past the hidden layer
+  nn::Network dag(batch, std::make_shared<nn::SquaredError>());
+  dag.AddLayer(2, std::make_shared<nn::LinearActivation>());
+  dag.AddLayer(3, std::make_shared<nn::LinearActivation>());
+  dag.AddLayer(7, std::make_shared<nn::TanhActivation>());
+  dag.AddLayer(4, std::make_shared<nn::LinearActivation>());
+  dag.AddConnection(0, 2);
+  dag.AddConnection(1, 2);
+  dag.AddConnection(2, 3);
+  dag.AddConnection(1, 3);
+
+  for (auto network : { &runtime, &dense, &dag }) {
+    Randomize(*network, rng);
+    network->Save(file_name);
+
+    for (bool map_weights : { true, false }) {
+      nn::Network loaded(file_name, batch, map_weights);
+      EXPECT_EQ(map_weights, loaded.HasMappedWeights());
+      EXPECT_EQ(network->NumInputs(), loaded.NumInputs());
+      ExpectSameOutputs(*network, loaded, 5, rng);
+
+      // mapped weights are used in place, starting on a page
+      nn::train::NetworkTrainer ntr(loaded);
+      auto weights = ntr.GetConnections()[0]->GetWeights().GetPtr();
+      EXPECT_EQ(map_weights, reinterpret_cast<uintptr_t>(weights) % nn::MODEL_FILE_ALIGNMENT == 0);
+    }
+  }
+  std::remove(file_name.c_str());
+}
+
+
+TEST(ModelFile, MappedWeightsAreReadOnly)
+{
+  std::mt19937 rng(4);
+  const std::string file_name = TempFile("bpnn_readonly.model");
+
+  nn::Network network({ 3, 5, 2 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+  Randomize(network, rng);
+  network.Save(file_name);
+
+  nn::train::BackpropTrainingParameters params = { 0.1, 0, 0, false, 1, 0 };
+  nn::Network mapped(file_name, batch);
+  EXPECT_THROW(nn::train::BackpropTrainingAlgorithm bp(mapped, params), const char*);
+
+  nn::Network copied(file_name, batch, false);
+  EXPECT_NO_THROW(nn::train::BackpropTrainingAlgorithm bp(copied, params));
+
+  // a mapped network can be saved again
+  const std::string copy_name = TempFile("bpnn_readonly_copy.model");
+  mapped.Save(copy_name);
+  nn::Network reloaded(copy_name, batch);
+  ExpectSameOutputs(network, reloaded, 3, rng);
+
+  std::remove(file_name.c_str());
+  std::remove(copy_name.c_str());
+}
+
+
+// pruned connections are saved compressed, and load pruned with the
+// kernel they were saved with
+TEST(ModelFile, PrunedRoundTrip)
+{
+  const std::string dense_file = TempFile("bpnn_dense.model");
+  const std::string pruned_file = TempFile("bpnn_pruned.model");
+  std::mt19937 rng(89);
+
+  nn::Network network({ 20, 40, 5 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+  Randomize(network, rng);
+  network.Save(dense_file);
+  network.SetSparseBreakEven(1);
+  network.PruneToSparsity(0.9);
+  network.Save(pruned_file);
+
+  auto file_size = [](const std::string& file_name) {
+    std::ifstream in(file_name, std::ios::binary | std::ios::ate);
+    return size_t(in.tellg());
+  };
+  EXPECT_LT(file_size(pruned_file), file_size(dense_file) / 2);
+
+  nn::Network loaded(pruned_file, batch);
+  ASSERT_EQ(network.NumConnections(), loaded.NumConnections());
+  for (size_t c = 0; c < loaded.NumConnections(); ++c) {
+    EXPECT_TRUE(loaded.GetConnection(c).UsesSparseWeights());
+    EXPECT_EQ(network.GetConnection(c).Density(), loaded.GetConnection(c).Density());
+  }
+  ExpectSameOutputs(network, loaded, 20, rng);
+
+  network.SetSparseBreakEven(0);
+  network.Save(pruned_file);
+  nn::Network loaded_dense(pruned_file, batch);
+  for (size_t c = 0; c < loaded_dense.NumConnections(); ++c) {
+    EXPECT_TRUE(loaded_dense.GetConnection(c).IsPruned());
+    EXPECT_FALSE(loaded_dense.GetConnection(c).UsesSparseWeights());
+  }
+
+  // row starts that don't begin at 0
+  {
+    std::string contents;
+    {
+      std::ifstream in(pruned_file, std::ios::binary);
+      contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    nn::ConnectionRecord record;
+    std::memcpy(&record, contents.data() + sizeof(nn::FileHeader) + 3 * sizeof(nn::LayerRecord), sizeof(record));
+    const uint32_t row_start = 1;
+    std::memcpy(&contents[record.weights_offset + record.nonzeros * sizeof(nn::realscalar)], &row_start, sizeof(row_start));
+    std::ofstream out(pruned_file, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size());
+  }
+  EXPECT_THROW(nn::Network loaded(pruned_file, batch), const char*);
+
+  std::remove(dense_file.c_str());
+  std::remove(pruned_file.c_str());
+}
+
+
+TEST(ModelFile, RejectsBadFiles)
+{
+  const std::string file_name = TempFile("bpnn_bad.model");
+
+  EXPECT_THROW(nn::Network loaded(TempFile("bpnn_missing.model")), const char*);
+
+  {
+    std::ofstream out(file_name, std::ios::binary);
+    out << "not a model file at all, but long enough to hold a header.........";
+  }
+  EXPECT_THROW(nn::Network loaded(file_name), const char*);
+
+  // truncated: a valid file cut short
+  nn::Network network({ 3, 5, 2 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+  network.Save(file_name);
+  std::string contents;
+  {
+    std::ifstream in(file_name, std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  {
+    std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size() - 8);
+  }
+  EXPECT_THROW(nn::Network loaded(file_name), const char*);
+
+  // an activation accuracy past the last one
+  {
+    std::string bad = contents;
+    const uint32_t accuracy = 7;
+    bad.replace(sizeof(nn::FileHeader) + offsetof(nn::LayerRecord, accuracy), sizeof(accuracy),
+                reinterpret_cast<const char*>(&accuracy), sizeof(accuracy));
+    std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+    out.write(bad.data(), bad.size());
+  }
+  EXPECT_THROW(nn::Network loaded(file_name), const char*);
+
+  // an empty layer, and one too large for an int
+  for (uint32_t size : { uint32_t(0), uint32_t(0x80000000u) }) {
+    std::string bad = contents;
+    bad.replace(sizeof(nn::FileHeader) + offsetof(nn::LayerRecord, size), sizeof(size),
+                reinterpret_cast<const char*>(&size), sizeof(size));
+    std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+    out.write(bad.data(), bad.size());
+    out.close();
+    EXPECT_THROW(nn::Network loaded(file_name), const char*);
+  }
+
+  std::remove(file_name.c_str());
+}
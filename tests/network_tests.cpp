@@ -0,0 +1,902 @@
+#include "gtest/gtest.h"
+
+#include "../src/network.hpp"
+#include "../src/train.hpp"
+#include "../src/trainingdata.hpp"
+#include "test_helpers.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <utility>
+
+
+namespace
+{
+
+const int batch = 5;
+const int in = 4, hid = 6, out = 3;
+
+std::unique_ptr<nn::Network> RuntimeNetwork()
+{
+  return std::unique_ptr<nn::Network>(new nn::Network({ in, hid, out }, batch,
+                                                      std::make_shared<nn::TanhActivation>(),
+                                                      std::make_shared<nn::SigmoidActivation>(0, 1),
+                                                      std::make_shared<nn::CrossEntropyError>()));
+}
+
+std::unique_ptr<nn::Network> SpecializedNetwork()
+{
+  std::unique_ptr<nn::Network> network(new nn::Network(batch, std::make_shared<nn::CrossEntropyError>()));
+  network->AddLayer<nn::LinearActivation>(in);
+  network->AddLayer<nn::TanhActivation>(hid);
+  network->AddLayer<nn::SigmoidActivation, nn::CrossEntropyError>(out, 0, 1);
+  network->AddDefaultConnections();
+  return network;
+}
+
+// same random weights and biases in both networks
+void SetWeights(nn::Network& a, nn::Network& b)
+{
+  std::mt19937 rng(17);
+  nn::train::NetworkTrainer ta(a), tb(b);
+
+  for (size_t c = 0; c < ta.GetConnections().size(); ++c) {
+    auto& w = ta.GetConnections()[c]->GetWeights();
+    auto W = RandomMatrix(w.Rows(), w.Cols(), rng);
+    w = W;
+    tb.GetConnections()[c]->GetWeights() = W;
+  }
+  for (size_t l = 1; l < ta.GetLayers().size(); ++l) {
+    auto& bias = ta.GetLayerBias(ta.GetLayers()[l].get());
+    auto B = RandomMatrix(1, bias.Cols(), rng);
+    bias = B;
+    tb.GetLayerBias(tb.GetLayers()[l].get()) = B;
+  }
+}
+
+// same outputs, error and weights after a few epochs of backprop; returns
+// the number of trainer workspace buffers of each
+std::pair<size_t, size_t> ExpectSameTraining(nn::Network& a, nn::Network& b)
+{
+  std::mt19937 rng(5);
+  auto X = RandomMatrix(batch, in, rng);
+  nn::realmatrix T(batch, out, nn::realmatrix::PaddedLd(out));
+  for (int row = 0; row < batch; ++row) {
+    T.SetEntry(row, row % out, 1);
+  }
+
+  nn::realmatrix expected = a.FeedForward(X);
+  ExpectNear(expected, b.FeedForward(X), 1e-5);
+  EXPECT_NEAR(a.TotalError(T), b.TotalError(T), 1e-4);
+
+  std::vector<nn::Batch> data(1, nn::Batch(batch, in, out));
+  for (int row = 0; row < batch; ++row) {
+    data[0].AddPair(nn::realvector(X.GetRowPtr(row), X.GetRowPtr(row) + in),
+                    nn::realvector(T.GetRowPtr(row), T.GetRowPtr(row) + out));
+  }
+
+  nn::train::BackpropTrainingParameters params = { 0.1, 0.5, 0, false, 2, 0 };
+  nn::train::BackpropTrainingAlgorithm bp_a(a, params), bp_b(b, params);
+  bp_a.SetTrainingData(&data);
+  bp_b.SetTrainingData(&data);
+  bp_a.Train();
+  bp_b.Train();
+
+  nn::train::NetworkTrainer ta(a), tb(b);
+  for (size_t c = 0; c < ta.GetConnections().size(); ++c) {
+    ExpectNear(ta.GetConnections()[c]->GetWeights(), tb.GetConnections()[c]->GetWeights(), 1e-5);
+  }
+  for (size_t l = 1; l < ta.GetLayers().size(); ++l) {
+    ExpectNear(ta.GetLayerBias(ta.GetLayers()[l].get()), tb.GetLayerBias(tb.GetLayers()[l].get()), 1e-5);
+  }
+
+  return std::make_pair(bp_a.GetWorkspace().NumBuffers(), bp_b.GetWorkspace().NumBuffers());
+}
+
+}
+
+
+TEST(Network, SpecializedLayersMatchRuntime)
+{
+  auto runtime = RuntimeNetwork();
+  auto specialized = SpecializedNetwork();
+  SetWeights(*runtime, *specialized);
+
+  auto buffers = ExpectSameTraining(*runtime, *specialized);
+
+  // no activation_df buffers in the specialized trainer
+  EXPECT_LT(buffers.second, buffers.first);
+}
+
+
+// the runtime ReLU layers take the step-derivative path, DenseLayer inlines df
+template <typename Act, typename... Args>
+void ExpectReLUFamilyMatches(bool step_derivative, Args... act_args)
+{
+  nn::Network runtime({ in, hid, out }, batch,
+                      std::make_shared<Act>(act_args...),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+
+  nn::Network specialized(batch, std::make_shared<nn::SquaredError>());
+  specialized.AddLayer<nn::LinearActivation>(in);
+  specialized.AddLayer<Act>(hid, act_args...);
+  specialized.AddLayer<nn::LinearActivation, nn::SquaredError>(out);
+  specialized.AddDefaultConnections();
+  SetWeights(runtime, specialized);
+
+  auto buffers = ExpectSameTraining(runtime, specialized);
+
+  // with a canonical linear output, only a non-step hidden layer needs activation_df
+  EXPECT_EQ(buffers.second + (step_derivative ? 0 : 1), buffers.first);
+}
+
+
+TEST(Network, ReLUFamilyMatchesSpecialized)
+{
+  ExpectReLUFamilyMatches<nn::ReLUActivation>(true);
+  ExpectReLUFamilyMatches<nn::LeakyReLUActivation>(true, nn::realscalar(0.1));
+  ExpectReLUFamilyMatches<nn::SoftplusActivation>(false);
+}
+
+
+TEST(Network, PartialBatch)
+{
+  std::mt19937 rng(8);
+  auto runtime = RuntimeNetwork();
+  auto specialized = SpecializedNetwork();
+  SetWeights(*runtime, *specialized);
+
+  auto X = RandomMatrix(batch, in, rng);
+  for (auto network : { runtime.get(), specialized.get() }) {
+    nn::realmatrix full = network->FeedForward(X);
+
+    const auto& partial = network->FeedForward(nn::constrealview(X).SubRows(0, 2));
+    ASSERT_EQ(2, partial.Rows());
+    for (int row = 0; row < 2; ++row) {
+      for (int col = 0; col < out; ++col) {
+        EXPECT_NEAR(full.GetRowPtr(row)[col], partial.GetRowPtr(row)[col], 1e-6);
+      }
+    }
+    EXPECT_EQ(1, network->FeedForward(nn::constrealview(X).Row(4)).Rows());
+
+    auto too_many = RandomMatrix(batch + 1, in, rng);
+    EXPECT_THROW(network->FeedForward(too_many), const char*);
+  }
+}
+
+
+// the trainer plans the workspace of a network built layer by layer
+TEST(Backprop, TrainsHandBuiltNetwork)
+{
+  nn::Network network(batch, std::make_shared<nn::SquaredError>());
+  network.AddLayer(in, std::make_shared<nn::LinearActivation>());
+  network.AddLayer(hid, std::make_shared<nn::TanhActivation>());
+  network.AddLayer(out, std::make_shared<nn::LinearActivation>());
+  network.AddDefaultConnections();
+
+  std::mt19937 rng(41);
+  std::vector<nn::Batch> data(1, nn::Batch(batch, in, out));
+  auto X = RandomMatrix(batch, in, rng), T = RandomMatrix(batch, out, rng);
+  for (int row = 0; row < batch; ++row) {
+    data[0].AddPair(nn::realvector(X.GetRowPtr(row), X.GetRowPtr(row) + in),
+                    nn::realvector(T.GetRowPtr(row), T.GetRowPtr(row) + out));
+  }
+
+  nn::train::BackpropTrainingParameters params = { 0.05, 0.5, 0, false, 20, 0 };
+  nn::train::BackpropTrainingAlgorithm bp(network, params);
+  bp.InitializeNetwork();
+  bp.SetTrainingData(&data);
+  network.FeedForward(X);
+  const auto before = network.TotalError(T);
+  bp.Train();
+  network.FeedForward(X);
+  EXPECT_LT(network.TotalError(T), before);
+}
+
+
+// a batch with 3 of its 8 rows filled trains exactly like a full batch of 3
+TEST(Backprop, PartialBatchIgnoresEmptyRows)
+{
+  const int filled = 3, capacity = 8;
+  std::mt19937 rng(9);
+
+  auto make = [](int batch_size) {
+    return std::unique_ptr<nn::Network>(new nn::Network({ in, hid, out }, batch_size,
+                                                        std::make_shared<nn::TanhActivation>(),
+                                                        std::make_shared<nn::SigmoidActivation>(0, 1),
+                                                        std::make_shared<nn::CrossEntropyError>()));
+  };
+  auto padded = make(capacity);
+  auto exact = make(filled);
+  SetWeights(*padded, *exact);
+
+  std::vector<nn::Batch> padded_data(1, nn::Batch(capacity, in, out));
+  std::vector<nn::Batch> exact_data(1, nn::Batch(filled, in, out));
+  auto X = RandomMatrix(filled, in, rng);
+  for (int row = 0; row < filled; ++row) {
+    nn::realvector x(X.GetRowPtr(row), X.GetRowPtr(row) + in), t(out, 0);
+    t[row % out] = 1;
+    padded_data[0].AddPair(x, t);
+    exact_data[0].AddPair(x, t);
+  }
+  EXPECT_EQ(filled, padded_data[0].Input().Rows());
+
+  nn::train::BackpropTrainingParameters params = { 0.1, 0.5, 0, false, 3, 0 };
+  nn::train::BackpropTrainingAlgorithm bp_padded(*padded, params), bp_exact(*exact, params);
+  bp_padded.SetTrainingData(&padded_data);
+  bp_exact.SetTrainingData(&exact_data);
+  bp_padded.Train();
+  bp_exact.Train();
+
+  nn::train::NetworkTrainer tp(*padded), te(*exact);
+  for (size_t c = 0; c < tp.GetConnections().size(); ++c) {
+    ExpectNear(tp.GetConnections()[c]->GetWeights(), te.GetConnections()[c]->GetWeights(), 1e-6);
+  }
+  for (size_t l = 1; l < tp.GetLayers().size(); ++l) {
+    ExpectNear(tp.GetLayerBias(tp.GetLayers()[l].get()), te.GetLayerBias(te.GetLayers()[l].get()), 1e-6);
+  }
+}
+
+
+TEST(Network, SoftmaxCrossEntropyGradient)
+{
+  auto network = std::unique_ptr<nn::Network>(new nn::Network({ in, hid, out }, batch,
+                                                              std::make_shared<nn::TanhActivation>(),
+                                                              std::make_shared<nn::SoftmaxActivation>(),
+                                                              std::make_shared<nn::CategoricalCrossEntropyError>()));
+  auto runtime = RuntimeNetwork();
+  SetWeights(*network, *runtime);
+
+  std::mt19937 rng(5);
+  auto X = RandomMatrix(batch, in, rng);
+  nn::realmatrix T(batch, out, nn::realmatrix::PaddedLd(out));
+  for (int row = 0; row < batch - 1; ++row) {      // the last row is empty
+    T.SetEntry(row, row % out, 1);
+  }
+
+  nn::train::NetworkTrainer ntr(*network);
+  auto output_layer = ntr.GetLayers().back();
+  auto error_fn = ntr.GetErrorFunction().get();
+
+  network->FeedForward(X);
+  const auto& p = output_layer->GetActivationMatrix();
+  nn::realscalar loss = network->TotalError(T);
+  for (int row = 0; row < batch; ++row) {
+    EXPECT_NEAR(1, std::accumulate(p.GetRowPtr(row), p.GetRowPtr(row) + out, 0.0), 1e-6);
+  }
+
+  nn::realmatrix delta(batch, out, nn::realmatrix::PaddedLd(out));
+  output_layer->OutputDelta(T, error_fn, delta);
+
+  // dE/d(bias) is the column sum of the delta.  A step of cbrt(epsilon)
+  // balances the central difference's truncation and rounding errors,
+  // which are then both about its square.
+  auto& bias = ntr.GetLayerBias(output_layer.get());
+  const nn::realscalar h = std::cbrt(std::numeric_limits<nn::realscalar>::epsilon());
+  const double tolerance = 100*h*h;
+  for (int col = 0; col < out; ++col) {
+    nn::realscalar analytic = 0;
+    for (int row = 0; row < batch; ++row) {
+      analytic += delta.GetRowPtr(row)[col];
+    }
+
+    bias.GetRowPtr(0)[col] += h;
+    network->FeedForward(X);
+    nn::realscalar plus = network->TotalError(T);
+    bias.GetRowPtr(0)[col] -= 2*h;
+    network->FeedForward(X);
+    nn::realscalar minus = network->TotalError(T);
+    bias.GetRowPtr(0)[col] += h;
+
+    EXPECT_NEAR(analytic, (plus - minus) / (2*h), tolerance*std::max(1.0, std::abs(double(analytic))));
+  }
+  EXPECT_LT(0, loss);
+
+  // the same layer from the templated API
+  nn::Network templated(batch, std::make_shared<nn::CategoricalCrossEntropyError>());
+  templated.AddLayer<nn::TanhActivation>(in);
+  templated.AddLayer<nn::TanhActivation>(hid);
+  templated.AddLayer<nn::SoftmaxActivation, nn::CategoricalCrossEntropyError>(out);
+  templated.AddDefaultConnections();
+  SetWeights(templated, *runtime);
+  ExpectNear(network->FeedForward(X), templated.FeedForward(X), 1e-6);
+  EXPECT_NEAR(loss, templated.TotalError(T), 1e-6);
+
+  // the softmax layer only pairs with categorical cross-entropy, and only
+  // as an output layer
+  EXPECT_THROW(nn::Network({ in, hid, out }, batch,
+                           std::make_shared<nn::TanhActivation>(),
+                           std::make_shared<nn::SoftmaxActivation>(),
+                           std::make_shared<nn::SquaredError>()), const char*);
+  EXPECT_THROW(nn::Network({ in, hid, out }, batch,
+                           std::make_shared<nn::SoftmaxActivation>(),
+                           std::make_shared<nn::SoftmaxActivation>(),
+                           std::make_shared<nn::CategoricalCrossEntropyError>()), const char*);
+  nn::Network hand_built(batch, std::make_shared<nn::CategoricalCrossEntropyError>());
+  hand_built.AddLayer<nn::TanhActivation>(in);
+  hand_built.AddLayer<nn::SoftmaxActivation, nn::CategoricalCrossEntropyError>(hid);
+  hand_built.AddLayer<nn::TanhActivation>(out);
+  hand_built.AddDefaultConnections();
+  EXPECT_THROW(hand_built.FeedForward(X), const char*);
+}
+
+
+// logistic + cross-entropy and linear + squared error give delta = scale*(a - t)
+TEST(Backprop, CanonicalOutputDeltaMatchesGeneric)
+{
+  std::mt19937 rng(3);
+  auto X = RandomMatrix(batch, in, rng);
+  nn::realmatrix T(batch, out, nn::realmatrix::PaddedLd(out));
+  for (int row = 0; row < batch; ++row) {
+    T.SetEntry(row, row % out, 1);
+  }
+
+  struct Pairing
+  {
+    std::shared_ptr<nn::ActivationFunction> act;
+    std::shared_ptr<nn::ErrorFunction> err;
+    bool canonical;
+  };
+  const Pairing pairings[] = {
+    { std::make_shared<nn::SigmoidActivation>(0, 1), std::make_shared<nn::CrossEntropyError>(), true },
+    { std::make_shared<nn::SigmoidActivation>(0, 1, 2), std::make_shared<nn::CrossEntropyError>(), true },
+    { std::make_shared<nn::LinearActivation>(0.5), std::make_shared<nn::SquaredError>(), true },
+    { std::make_shared<nn::SigmoidActivation>(0, 1), std::make_shared<nn::SquaredError>(), false },
+    { std::make_shared<nn::SigmoidActivation>(-1, 1), std::make_shared<nn::CrossEntropyError>(), false },
+  };
+
+  for (auto& pairing : pairings) {
+    nn::Network network({ in, hid, out }, batch, std::make_shared<nn::TanhActivation>(), pairing.act, pairing.err);
+    auto runtime = RuntimeNetwork();
+    SetWeights(network, *runtime);
+
+    nn::train::NetworkTrainer ntr(network);
+    nn::train::BackpropTrainingParameters params = { 0.1, 0.5, 0, false, 1, 0 };
+    auto layers = ntr.GetLayers();
+    std::vector<std::unique_ptr<nn::train::BackpropLayer>> bp_layers;
+    for (auto& layer : layers) {
+      bp_layers.emplace_back(new nn::train::BackpropLayer(ntr, params, layer.get(), pairing.err.get()));
+    }
+    auto connections = ntr.GetConnections();
+    std::vector<std::unique_ptr<nn::train::BackpropConnection>> bp_connections;
+    for (size_t c = 0; c < connections.size(); ++c) {
+      bp_connections.emplace_back(new nn::train::BackpropConnection(connections[c], bp_layers[c].get(),
+                                                                    bp_layers[c + 1].get(), params));
+    }
+    nn::Workspace workspace;
+    for (size_t l = 1; l < bp_layers.size(); ++l) {
+      bp_layers[l]->AddToWorkspace(workspace, "layer" + std::to_string(l));
+    }
+    workspace.Allocate();
+
+    auto& output = *bp_layers.back();
+    EXPECT_EQ(pairing.canonical, output.UsesCanonicalDelta());
+    EXPECT_FALSE(bp_layers[1]->UsesCanonicalDelta());
+    EXPECT_EQ(pairing.canonical ? 7u : 8u, workspace.NumBuffers());
+
+    network.FeedForward(X);
+    output.CalculateDelta(T);
+
+    // Layer::OutputDelta is the per-element dE * f' reference
+    nn::realmatrix expected(batch, out, nn::realmatrix::PaddedLd(out));
+    layers.back()->OutputDelta(T, pairing.err.get(), expected);
+    ExpectNear(expected, output.GetDelta(), 1e-5);
+  }
+}
+
+
+namespace
+{
+
+// records the network's last error after every batch
+class ErrorRecorder : public nn::utility::Observer
+{
+public:
+  ErrorRecorder(const nn::Network& network_use, int frequency_use) : network(network_use), frequency(frequency_use) {}
+
+  void UpdateBatch() override { errors.push_back(network.GetLastError()); }
+  void UpdateEpoch() override {}
+  bool NeedsError(int epoch) const override { return epoch % frequency == 0; }
+
+  std::vector<double> errors;
+
+private:
+  const nn::Network& network;
+  int frequency;
+};
+
+}
+
+
+TEST(Backprop, ErrorOnlyWhenNeeded)
+{
+  auto network = RuntimeNetwork();
+  auto other = RuntimeNetwork();
+  SetWeights(*network, *other);
+
+  std::mt19937 rng(5);
+  auto X = RandomMatrix(batch, in, rng);
+  std::vector<nn::Batch> data(1, nn::Batch(batch, in, out));
+  for (int row = 0; row < batch; ++row) {
+    nn::realvector t(out, 0);
+    t[row % out] = 1;
+    data[0].AddPair(nn::realvector(X.GetRowPtr(row), X.GetRowPtr(row) + in), t);
+  }
+
+  ErrorRecorder recorder(*network, 2);
+  network->Attach(&recorder);
+
+  // no min_error, so only the recorder's epochs compute the error
+  nn::train::BackpropTrainingParameters params = { 0.1, 0.5, 0, false, 4, 0 };
+  nn::train::BackpropTrainingAlgorithm bp(*network, params);
+  bp.SetTrainingData(&data);
+  bp.Train();
+
+  ASSERT_EQ(5u, recorder.errors.size());
+  EXPECT_NE(0, recorder.errors[0]);
+  EXPECT_EQ(recorder.errors[0], recorder.errors[1]);   // not recomputed
+  EXPECT_NE(recorder.errors[1], recorder.errors[2]);
+  EXPECT_EQ(recorder.errors[2], recorder.errors[3]);
+  EXPECT_NE(recorder.errors[3], recorder.errors[4]);
+  network->Detatch(&recorder);
+
+  // skipping the error doesn't change training
+  nn::train::BackpropTrainingAlgorithm bp_other(*other, params);
+  bp_other.SetTrainingData(&data);
+  bp_other.Train();
+  nn::train::NetworkTrainer ta(*network), tb(*other);
+  for (size_t c = 0; c < ta.GetConnections().size(); ++c) {
+    ExpectNear(ta.GetConnections()[c]->GetWeights(), tb.GetConnections()[c]->GetWeights(), 1e-12);
+  }
+
+  // the min_error check runs on epochs 0, 3, 6, ...; this one stops at the first
+  params.min_error = 1e6;
+  params.error_check_interval = 3;
+  params.max_epochs = 10;
+  ErrorRecorder never(*network, 1000);
+  network->Attach(&never);
+  nn::train::BackpropTrainingAlgorithm bp_stop(*network, params);
+  bp_stop.SetTrainingData(&data);
+  bp_stop.Train();
+  EXPECT_EQ(1u, never.errors.size());
+  network->Detatch(&never);
+}
+
+
+
+namespace
+{
+
+// two inputs, two outputs, a skip connection from input a to output c and
+// one from input b to output d:
+//
+//   a(0) -> h(2), g(3), c(4)     b(1) -> g(3), d(5)
+//   h(2) -> c(4)                 g(3) -> c(4), d(5)
+std::unique_ptr<nn::Network> DagNetwork()
+{
+  std::unique_ptr<nn::Network> network(new nn::Network(batch, std::make_shared<nn::SquaredError>()));
+  network->AddLayer(3, std::make_shared<nn::LinearActivation>());
+  network->AddLayer(2, std::make_shared<nn::LinearActivation>());
+  network->AddLayer(4, std::make_shared<nn::TanhActivation>());
+  network->AddLayer<nn::SigmoidActivation>(3, -1, 1);
+  network->AddLayer(2, std::make_shared<nn::LinearActivation>());
+  network->AddLayer<nn::LinearActivation>(1);
+  for (auto c : { std::make_pair(0, 2), std::make_pair(0, 3), std::make_pair(1, 3), std::make_pair(2, 4),
+                  std::make_pair(3, 4), std::make_pair(0, 4), std::make_pair(3, 5), std::make_pair(1, 5) }) {
+    network->AddConnection(c.first, c.second);
+  }
+
+  std::mt19937 rng(23);
+  nn::train::NetworkTrainer ntr(*network);
+  for (auto& c : ntr.GetConnections()) {
+    c->GetWeights() = RandomMatrix(c->Rows(), c->Cols(), rng);
+  }
+  for (auto& layer : ntr.GetLayers()) {
+    if (!layer->IsInput()) {
+      ntr.GetLayerBias(layer.get()) = RandomMatrix(1, layer->Size(), rng);
+    }
+  }
+  return network;
+}
+
+std::vector<nn::Batch> DagData(int num_batches)
+{
+  std::mt19937 rng(29);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  std::vector<nn::Batch> data(num_batches, nn::Batch(batch, 5, 3));
+  for (auto& b : data) {
+    for (int row = 0; row < batch; ++row) {
+      nn::realvector x(5), t(3);
+      for (auto& v : x) v = dist(rng);
+      for (auto& v : t) v = dist(rng);
+      b.AddPair(x, t);
+    }
+  }
+  return data;
+}
+
+}
+
+
+TEST(Network, DagTopology)
+{
+  auto network = DagNetwork();
+  EXPECT_EQ(2u, network->NumInputs());
+  EXPECT_EQ(2u, network->NumOutputs());
+  EXPECT_EQ(5, network->InputSize());
+  EXPECT_EQ(3, network->OutputSize());
+
+  // c is the same as the sum of its three connections
+  std::mt19937 rng(31);
+  auto X = RandomMatrix(batch, 5, rng);
+  network->FeedForward(X);
+  nn::train::NetworkTrainer ntr(*network);
+  const auto& layers = ntr.GetLayers();
+  nn::realmatrix expected(batch, 2, nn::realmatrix::PaddedLd(2));
+  for (int row = 0; row < batch; ++row) {
+    for (int col = 0; col < 2; ++col) {
+      double sum = ntr.GetLayerBias(layers[4].get()).GetRowPtr(0)[col];
+      for (auto& c : ntr.GetConnections()) {
+        if (ntr.GetConnectionToLayer(c) != layers[4].get()) {
+          continue;
+        }
+        auto from = ntr.GetConnectionFromLayer(c)->GetActivation();
+        for (int k = 0; k < c->Cols(); ++k) {
+          sum += c->GetWeights().GetRowPtr(col)[k] * from.GetRowPtr(row)[k];
+        }
+      }
+      expected.SetEntry(row, col, sum);
+    }
+  }
+  ExpectNear(expected, network->GetOutput(0), 1e-5);
+  EXPECT_EQ(&network->GetOutput(1), &layers[5]->GetActivationMatrix());
+}
+
+
+TEST(Network, AddConnectionRejectsBadEdges)
+{
+  auto network = DagNetwork();
+  EXPECT_THROW(network->AddConnection(4, 0), const char*);   // cycle through the skip
+  EXPECT_THROW(network->AddConnection(5, 3), const char*);   // cycle
+  EXPECT_THROW(network->AddConnection(2, 2), const char*);
+  EXPECT_THROW(network->AddConnection(0, 2), const char*);   // already connected
+  EXPECT_THROW(network->AddConnection(0, 6), const char*);
+  EXPECT_EQ(2u, network->NumOutputs());
+
+  network->AddConnection(2, 5);
+  EXPECT_EQ(2u, network->NumOutputs());
+
+  std::mt19937 rng(3);
+  auto X = RandomMatrix(batch, 4, rng);
+  EXPECT_THROW(network->FeedForward(X), const char*);        // input needs 5 columns
+}
+
+
+// one step of backprop with plain SGD moves every weight and bias by
+// -learning_rate times its derivative, which must match finite differences
+TEST(Backprop, DagGradientMatchesFiniteDifferences)
+{
+  // see SoftmaxCrossEntropyGradient for the step
+  const double rate = 0.01, h = std::cbrt(std::numeric_limits<nn::realscalar>::epsilon());
+  const double tolerance = 100*h*h;
+  auto data = DagData(1);
+  const auto& X = data[0].Input();
+  const auto& T = data[0].Output();
+
+  auto trained = DagNetwork();
+  nn::train::BackpropTrainingParameters params = { nn::realscalar(rate), 0, 0, false, 0, 0 };
+  nn::train::BackpropTrainingAlgorithm bp(*trained, params);
+  bp.SetTrainingData(&data);
+  bp.Train();
+
+  auto network = DagNetwork();
+  nn::train::NetworkTrainer ntr(*network), ttr(*trained);
+  auto error = [&]() {
+    network->FeedForward(X);
+    return double(network->TotalError(T));
+  };
+  auto check = [&](nn::realmatrix& p, const nn::realmatrix& stepped) {
+    for (int row = 0; row < p.Rows(); ++row) {
+      for (int col = 0; col < p.Cols(); ++col) {
+        nn::realscalar& v = p.GetRowPtr(row)[col];
+        const nn::realscalar v0 = v;
+        v = v0 + h;
+        double up = error();
+        v = v0 - h;
+        double down = error();
+        v = v0;
+        double numeric = (up - down) / (2*h);
+        double backprop = (v0 - stepped.GetRowPtr(row)[col]) / rate;
+        EXPECT_NEAR(numeric, backprop, tolerance*std::max(1.0, std::abs(numeric)));
+      }
+    }
+  };
+
+  for (size_t c = 0; c < ntr.GetConnections().size(); ++c) {
+    check(ntr.GetConnections()[c]->GetWeights(), ttr.GetConnections()[c]->GetWeights());
+  }
+  for (size_t l = 0; l < ntr.GetLayers().size(); ++l) {
+    if (!ntr.GetLayers()[l]->IsInput()) {
+      check(ntr.GetLayerBias(ntr.GetLayers()[l].get()), ttr.GetLayerBias(ttr.GetLayers()[l].get()));
+    }
+  }
+}
+
+
+// AddConnection leaves the workspace to be planned again, which the
+// trainer does
+TEST(Backprop, TrainsHandBuiltDag)
+{
+  nn::Network network(batch, std::make_shared<nn::SquaredError>());
+  network.AddLayer(3, std::make_shared<nn::LinearActivation>());
+  network.AddLayer(2, std::make_shared<nn::LinearActivation>());
+  network.AddLayer(4, std::make_shared<nn::TanhActivation>());
+  network.AddLayer(3, std::make_shared<nn::LinearActivation>());
+  network.AddConnection(0, 2);
+  network.AddConnection(1, 2);
+  network.AddConnection(2, 3);
+  network.AddConnection(0, 3);
+
+  std::mt19937 rng(43);
+  std::vector<nn::Batch> data(1, nn::Batch(batch, 5, 3));
+  auto X = RandomMatrix(batch, 5, rng), T = RandomMatrix(batch, 3, rng);
+  for (int row = 0; row < batch; ++row) {
+    data[0].AddPair(nn::realvector(X.GetRowPtr(row), X.GetRowPtr(row) + 5),
+                    nn::realvector(T.GetRowPtr(row), T.GetRowPtr(row) + 3));
+  }
+
+  nn::train::BackpropTrainingParameters params = { 0.05, 0.5, 0, false, 20, 0 };
+  nn::train::BackpropTrainingAlgorithm bp(network, params);
+  bp.InitializeNetwork();
+  bp.SetTrainingData(&data);
+  network.FeedForward(X);
+  const auto before = network.TotalError(T);
+  bp.Train();
+  network.FeedForward(X);
+  EXPECT_LT(network.TotalError(T), before);
+}
+
+
+// running the layers of a level side by side gives the same result
+TEST(Backprop, DagThreadPoolMatchesSerial)
+{
+  auto data = DagData(3);
+  nn::train::BackpropTrainingParameters params = { 0.05, 0.5, 0.001, false, 10, 0 };
+
+  auto serial = DagNetwork();
+  nn::train::BackpropTrainingAlgorithm bp_serial(*serial, params);
+  bp_serial.SetTrainingData(&data);
+  bp_serial.Train();
+
+  auto parallel = DagNetwork();
+  parallel->SetThreadPool(std::make_shared<nn::utility::ThreadPool>(3));
+  nn::train::BackpropTrainingAlgorithm bp_parallel(*parallel, params);
+  bp_parallel.SetTrainingData(&data);
+  bp_parallel.Train();
+
+  nn::train::NetworkTrainer ts(*serial), tp(*parallel);
+  for (size_t c = 0; c < ts.GetConnections().size(); ++c) {
+    ExpectNear(ts.GetConnections()[c]->GetWeights(), tp.GetConnections()[c]->GetWeights(), 0);
+  }
+  for (int i = 0; i < 2; ++i) {
+    serial->FeedForward(data[0].Input());
+    parallel->FeedForward(data[0].Input());
+    ExpectNear(serial->GetOutput(i), parallel->GetOutput(i), 0);
+  }
+}
+
+
+// a worker still finishing one Run mustn't take tasks of the next, whatever
+// their counts
+TEST(ThreadPool, AlternatingRunsRunEachTaskOnce)
+{
+  nn::utility::ThreadPool pool(3);
+  std::vector<std::atomic<int>> counts(7);
+  for (int run = 0; run < 5000; ++run) {
+    const int n = run % 2 == 0 ? 7 : 2;
+    for (auto& count : counts) count = 0;
+    pool.Run(n, [&](int i) { ++counts[i]; std::this_thread::yield(); });
+    for (int i = 0; i < 7; ++i) {
+      ASSERT_EQ(i < n ? 1 : 0, counts[i].load()) << "run " << run << ", task " << i;
+    }
+  }
+}
+
+
+
+namespace
+{
+
+// a chain deep enough for several pipeline stages, with the same weights
+// every time
+std::unique_ptr<nn::Network> DeepNetwork(int batch_size)
+{
+  std::unique_ptr<nn::Network> network(new nn::Network({ 7, 9, 12, 9, 8, 4 }, batch_size,
+                                                       std::make_shared<nn::TanhActivation>(),
+                                                       std::make_shared<nn::SigmoidActivation>(0, 1),
+                                                       std::make_shared<nn::CrossEntropyError>()));
+  std::mt19937 rng(37);
+  nn::train::NetworkTrainer ntr(*network);
+  for (auto& c : ntr.GetConnections()) {
+    c->GetWeights() = RandomMatrix(c->Rows(), c->Cols(), rng);
+  }
+  for (auto& layer : ntr.GetLayers()) {
+    if (!layer->IsInput()) {
+      ntr.GetLayerBias(layer.get()) = RandomMatrix(1, layer->Size(), rng);
+    }
+  }
+  return network;
+}
+
+}
+
+
+TEST(Network, PipelinedFeedForward)
+{
+  const int batch_size = 40;
+  auto whole = DeepNetwork(batch_size);
+  auto pipelined = DeepNetwork(batch_size);
+  pipelined->SetThreadPool(std::make_shared<nn::utility::ThreadPool>(2));
+  pipelined->SetPipeline(8);
+  EXPECT_EQ(3u, pipelined->NumPipelineStages());
+  pipelined->SetPipeline(8, 5);
+  EXPECT_EQ(5u, pipelined->NumPipelineStages());
+  pipelined->SetPipeline(8, 9);                    // one level per stage at most
+  EXPECT_EQ(5u, pipelined->NumPipelineStages());
+  pipelined->SetPipeline(8);
+
+  std::mt19937 rng(41);
+  auto X = RandomMatrix(batch_size, 7, rng);
+  for (int rows : { 40, 37, 8, 3 }) {            // the last micro-batch partly full, one, a short one
+    auto part = nn::constrealview(X).SubRows(0, rows);
+    nn::realmatrix expected = whole->FeedForward(part);
+    ExpectNear(expected, pipelined->FeedForward(part), 1e-12);
+  }
+
+  pipelined->SetPipeline(0);
+  EXPECT_EQ(0u, pipelined->NumPipelineStages());
+}
+
+
+// the same weights as training on whole batches, for a chain and a DAG
+TEST(Backprop, PipelinedTrainingMatchesWhole)
+{
+  const int batch_size = 40;
+  std::mt19937 rng(43);
+  std::vector<nn::Batch> data(2, nn::Batch(batch_size, 7, 4));
+  for (auto& b : data) {
+    for (int row = 0; row < (&b == &data[0] ? batch_size : 29); ++row) {
+      auto x = RandomMatrix(1, 7, rng);
+      nn::realvector t(4, 0);
+      t[row % 4] = 1;
+      b.AddPair(nn::realvector(x.GetRowPtr(0), x.GetRowPtr(0) + 7), t);
+    }
+  }
+  nn::train::BackpropTrainingParameters params = { 0.05, 0.5, 0.001, false, 6, 0 };
+
+  auto train = [&](nn::Network& network, const std::vector<nn::Batch>& td) {
+    nn::train::BackpropTrainingAlgorithm bp(network, params);
+    bp.SetTrainingData(&td);
+    bp.Train();
+  };
+  // the micro-batches' gradients are summed in a different order
+  auto expect_same_weights = [](nn::Network& a, nn::Network& b) {
+    nn::train::NetworkTrainer ta(a), tb(b);
+    for (size_t c = 0; c < ta.GetConnections().size(); ++c) {
+      ExpectNear(ta.GetConnections()[c]->GetWeights(), tb.GetConnections()[c]->GetWeights(),
+                 1e3*std::numeric_limits<nn::realscalar>::epsilon());
+    }
+  };
+
+  auto whole = DeepNetwork(batch_size);
+  auto pipelined = DeepNetwork(batch_size);
+  pipelined->SetThreadPool(std::make_shared<nn::utility::ThreadPool>(3));
+  pipelined->SetPipeline(6);
+  train(*whole, data);
+  train(*pipelined, data);
+  expect_same_weights(*whole, *pipelined);
+
+  auto dag_data = DagData(2);
+  auto dag_whole = DagNetwork();
+  auto dag_pipelined = DagNetwork();
+  dag_pipelined->SetThreadPool(std::make_shared<nn::utility::ThreadPool>(1));
+  dag_pipelined->SetPipeline(2);
+  EXPECT_EQ(2u, dag_pipelined->NumPipelineStages());
+  train(*dag_whole, dag_data);
+  train(*dag_pipelined, dag_data);
+  expect_same_weights(*dag_whole, *dag_pipelined);
+}
+
+
+// magnitude pruning within each connection or over the whole network; the
+// sparse kernel gives what the dense one does with the pruned weights
+TEST(Network, PruneToSparsity)
+{
+  const int batch_size = 10;
+  std::mt19937 rng(73);
+  auto X = RandomMatrix(batch_size, 7, rng);
+
+  auto network = DeepNetwork(batch_size);
+  network->SetSparseBreakEven(0);
+  size_t expected = 0, total = 0;
+  for (size_t c = 0; c < network->NumConnections(); ++c) {
+    const size_t size = network->GetConnection(c).Size();
+    expected += size_t(0.75*size);
+    total += size;
+  }
+  EXPECT_EQ(expected, network->PruneToSparsity(0.75, true));
+  for (size_t c = 0; c < network->NumConnections(); ++c) {
+    const auto& connection = network->GetConnection(c);
+    EXPECT_TRUE(connection.IsPruned());
+    EXPECT_FALSE(connection.UsesSparseWeights());
+    EXPECT_NEAR(0.25, connection.Density(), 1.0/connection.Size());
+  }
+  nn::realmatrix dense = network->FeedForward(X);
+
+  network->SetSparseBreakEven(1);
+  for (size_t c = 0; c < network->NumConnections(); ++c) {
+    EXPECT_TRUE(network->GetConnection(c).UsesSparseWeights());
+  }
+  ExpectNear(dense, network->FeedForward(X), 1e-5);
+
+  auto global = DeepNetwork(batch_size);
+  global->SetSparseBreakEven(0);
+  EXPECT_EQ(size_t(0.9*total), global->PruneToSparsity(0.9));
+  EXPECT_EQ(0u, global->PruneToSparsity(0.5));     // already sparser
+  EXPECT_EQ(0u, global->Prune(0));
+  EXPECT_THROW(global->PruneToSparsity(1.5), const char*);
+}
+
+
+// fine-tuning a pruned network leaves the pruned weights at zero, and the
+// sparse weights follow the trained ones
+TEST(Backprop, PrunedWeightsStayPruned)
+{
+  const int batch_size = 10;
+  std::mt19937 rng(79);
+  std::vector<nn::Batch> data(1, nn::Batch(batch_size, 7, 4));
+  for (int row = 0; row < batch_size; ++row) {
+    auto x = RandomMatrix(1, 7, rng);
+    nn::realvector t(4, 0);
+    t[row % 4] = 1;
+    data[0].AddPair(nn::realvector(x.GetRowPtr(0), x.GetRowPtr(0) + 7), t);
+  }
+
+  auto network = DeepNetwork(batch_size);
+  network->SetSparseBreakEven(1);
+  network->PruneToSparsity(0.8, true);
+  std::vector<double> density;
+  for (size_t c = 0; c < network->NumConnections(); ++c) {
+    density.push_back(network->GetConnection(c).Density());
+  }
+
+  nn::train::BackpropTrainingParameters params = { 0.05, 0.5, 0.001, false, 5, 0 };
+  nn::train::BackpropTrainingAlgorithm bp(*network, params);
+  bp.SetTrainingData(&data);
+  bp.Train();
+
+  for (size_t c = 0; c < network->NumConnections(); ++c) {
+    const auto& connection = network->GetConnection(c);
+    const auto& weights = connection.GetWeights();
+    int nonzeros = 0;
+    for (int row = 0; row < weights.Rows(); ++row) {
+      for (int col = 0; col < weights.Cols(); ++col) {
+        nonzeros += weights.GetRowPtr(row)[col] != 0;
+      }
+    }
+    EXPECT_EQ(density[c], connection.Density());
+    EXPECT_LE(nonzeros, connection.GetSparseWeights().NonZeros());
+  }
+
+  auto X = data[0].Input();
+  nn::realmatrix sparse = network->FeedForward(X);
+  network->SetSparseBreakEven(0);
+  ExpectNear(sparse, network->FeedForward(X), 1e-5);
+}
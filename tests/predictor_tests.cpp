@@ -0,0 +1,158 @@
+#include "gtest/gtest.h"
+
+#include "../src/predictor.hpp"
+#include "../src/network.hpp"
+#include "../src/train.hpp"
+#include "test_helpers.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <random>
+#include <vector>
+
+
+namespace
+{
+
+const int batch = 8;
+const int in = 3, hid = 5, out = 2;
+
+std::unique_ptr<nn::Network> RandomNetwork()
+{
+  std::unique_ptr<nn::Network> network(new nn::Network({ in, hid, out }, batch,
+                                                       std::make_shared<nn::TanhActivation>(),
+                                                       std::make_shared<nn::LinearActivation>(),
+                                                       std::make_shared<nn::SquaredError>()));
+  std::mt19937 rng(67);
+  Randomize(*network, rng);
+  return network;
+}
+
+std::vector<nn::realvector> RandomPatterns(int n)
+{
+  std::mt19937 rng(71);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  std::vector<nn::realvector> patterns(n, nn::realvector(in));
+  for (auto& pattern : patterns) {
+    for (auto& v : pattern) v = dist(rng);
+  }
+  return patterns;
+}
+
+// each pattern through the network on its own
+std::vector<nn::realvector> OneByOne(nn::Network& network, const std::vector<nn::realvector>& patterns)
+{
+  std::vector<nn::realvector> outputs;
+  nn::realmatrix X(1, in);
+  for (const auto& pattern : patterns) {
+    X.SetRowValues(0, pattern);
+    const auto& Y = network.FeedForward(X);
+    outputs.emplace_back(Y.GetRowPtr(0), Y.GetRowPtr(0) + out);
+  }
+  return outputs;
+}
+
+struct Point
+{
+  double x, y, z;
+};
+
+struct Prediction
+{
+  double a, b;
+};
+
+}
+
+
+// a full batch runs at once, whatever the delay
+TEST(Predictor, CoalescesRequests)
+{
+  auto network = RandomNetwork();
+  auto patterns = RandomPatterns(2*batch);
+  auto expected = OneByOne(*network, patterns);
+
+  nn::BatchingPredictor predictor(*network, 0, std::chrono::seconds(10));
+  EXPECT_EQ(batch, predictor.MaxBatch());
+  std::vector<std::future<nn::realvector>> results;
+  for (const auto& pattern : patterns) {
+    results.push_back(predictor.Submit(pattern));
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    auto result = results[i].get();
+    ASSERT_EQ(size_t(out), result.size());
+    for (int col = 0; col < out; ++col) {
+      EXPECT_NEAR(expected[i][col], result[col], 1e-5);
+    }
+  }
+
+  auto stats = predictor.GetStats();
+  EXPECT_EQ(patterns.size(), stats.requests);
+  EXPECT_EQ(2u, stats.batches);
+  EXPECT_EQ(double(batch), stats.mean_batch_size);
+
+  EXPECT_THROW(predictor.Submit(nn::realvector(in + 1)), const char*);
+  EXPECT_THROW(nn::BatchingPredictor(*network, batch + 1), const char*);
+}
+
+
+// a lone request waits out max_delay for company, then runs alone
+TEST(Predictor, PartialBatchRunsAfterDelay)
+{
+  auto network = RandomNetwork();
+  auto patterns = RandomPatterns(1);
+  auto expected = OneByOne(*network, patterns);
+
+  nn::BatchingPredictor predictor(*network, 4, std::chrono::milliseconds(2));
+  auto result = predictor.Submit(patterns[0]).get();
+  EXPECT_NEAR(expected[0][0], result[0], 1e-5);
+
+  auto stats = predictor.GetStats();
+  EXPECT_EQ(1u, stats.batches);
+  EXPECT_GE(stats.p50_latency, 2000.0);
+}
+
+
+TEST(Predictor, EncodedStructs)
+{
+  auto network = RandomNetwork();
+  auto patterns = RandomPatterns(3);
+  auto expected = OneByOne(*network, patterns);
+
+  nn::input::InputEncoder<Point> point_encoder;
+  nn_ADD_FIELD_ENCODER(point_encoder, Point, x, std::make_shared<nn::input::DoubleDefaultEncoder>());
+  nn_ADD_FIELD_ENCODER(point_encoder, Point, y, std::make_shared<nn::input::DoubleDefaultEncoder>());
+  nn_ADD_FIELD_ENCODER(point_encoder, Point, z, std::make_shared<nn::input::DoubleDefaultEncoder>());
+  nn::input::InputEncoder<Prediction> prediction_encoder;
+  nn_ADD_FIELD_ENCODER(prediction_encoder, Prediction, a, std::make_shared<nn::input::DoubleDefaultEncoder>());
+  nn_ADD_FIELD_ENCODER(prediction_encoder, Prediction, b, std::make_shared<nn::input::DoubleDefaultEncoder>());
+
+  nn::BatchingPredictor predictor(*network, 0, std::chrono::milliseconds(1));
+  std::vector<std::future<Prediction>> results;
+  for (const auto& p : patterns) {
+    results.push_back(predictor.Submit(point_encoder, Point{ p[0], p[1], p[2] }, prediction_encoder));
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    Prediction prediction = results[i].get();
+    EXPECT_NEAR(expected[i][0], prediction.a, 1e-5);
+    EXPECT_NEAR(expected[i][1], prediction.b, 1e-5);
+  }
+}
+
+
+TEST(Predictor, LoadGenerator)
+{
+  auto network = RandomNetwork();
+  auto patterns = RandomPatterns(32);
+
+  nn::BatchingPredictor predictor(*network, 0, std::chrono::microseconds(200));
+  auto stats = nn::GenerateLoad(predictor, patterns, 4, 50);
+  EXPECT_EQ(200u, stats.requests);
+  EXPECT_LE(stats.batches, stats.requests);
+  EXPECT_GE(stats.mean_batch_size, 1.0);
+  EXPECT_LE(stats.p50_latency, stats.p99_latency);
+  EXPECT_LE(stats.p99_latency, stats.max_latency);
+  EXPECT_GT(stats.requests_per_second, 0.0);
+}
@@ -0,0 +1,197 @@
+#include "gtest/gtest.h"
+
+#include "../src/recurrent.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <random>
+
+
+namespace
+{
+
+const int in = 3, hid = 5, out = 2;
+const int sequences = 4, steps = 6;
+
+void Randomize(nn::realmatrix& m, std::mt19937& rng, double range)
+{
+  std::uniform_real_distribution<double> dist(-range, range);
+  for (int row = 0; row < m.Rows(); ++row) {
+    for (int col = 0; col < m.Cols(); ++col) {
+      m.SetEntry(row, col, nn::realscalar(dist(rng)));
+    }
+  }
+}
+
+std::unique_ptr<nn::SimpleRecurrentNetwork> Network(int max_steps)
+{
+  std::unique_ptr<nn::SimpleRecurrentNetwork> network(
+    new nn::SimpleRecurrentNetwork(in, hid, out, sequences, max_steps,
+                                   std::make_shared<nn::TanhActivation>(),
+                                   std::make_shared<nn::LinearActivation>(),
+                                   std::make_shared<nn::SquaredError>()));
+  std::mt19937 rng(47);
+  Randomize(network->GetInputWeights(), rng, 0.7);
+  Randomize(network->GetContextWeights(), rng, 0.7);
+  Randomize(network->GetOutputWeights(), rng, 0.7);
+  Randomize(network->GetHiddenBias(), rng, 0.5);
+  Randomize(network->GetOutputBias(), rng, 0.5);
+  return network;
+}
+
+nn::SequenceBatch RandomSequences(std::mt19937& rng)
+{
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  nn::SequenceBatch batch(sequences, steps, in, out);
+  for (int s = 0; s < sequences; ++s) {
+    for (int t = 0; t < steps; ++t) {
+      nn::realvector x(in), y(out);
+      for (auto& v : x) v = dist(rng);
+      for (auto& v : y) v = dist(rng);
+      batch.SetStep(s, t, x, y);
+    }
+  }
+  return batch;
+}
+
+}
+
+
+// running the sequences in two segments carries the context between them
+TEST(Recurrent, SegmentsCarryContext)
+{
+  std::mt19937 rng(53);
+  auto batch = RandomSequences(rng);
+  nn::constrealview X(batch.Input());
+
+  auto whole = Network(steps);
+  nn::realmatrix expected = whole->FeedForward(X, steps);
+
+  auto split = Network(steps / 2);
+  const int half = steps / 2 * sequences;
+  nn::realmatrix first = split->FeedForward(X.SubRows(0, half), steps / 2);
+  const auto& second = split->FeedForward(X.SubRows(half, X.Rows() - half), steps - steps / 2);
+  for (int row = 0; row < X.Rows(); ++row) {
+    const auto& part = row < half ? first : second;
+    for (int col = 0; col < out; ++col) {
+      EXPECT_NEAR(expected.GetRowPtr(row)[col], part.GetRowPtr(row % half)[col], 1e-12);
+    }
+  }
+
+  // starting over gives the first segment again
+  split->ResetContext(sequences);
+  const auto& again = split->FeedForward(X.SubRows(0, half), steps / 2);
+  for (int row = 0; row < half; ++row) {
+    EXPECT_EQ(first.GetRowPtr(row)[0], again.GetRowPtr(row)[0]);
+  }
+
+  EXPECT_THROW(split->FeedForward(X, steps), const char*);   // more than max_steps
+}
+
+
+// one step of BPTT with plain SGD moves every weight and bias by
+// -learning_rate times its derivative over the whole sequence
+TEST(Recurrent, BpttGradientMatchesFiniteDifferences)
+{
+  // a step of cbrt(epsilon) balances the central difference's truncation
+  // and rounding errors, which are then both about its square
+  const double rate = 0.01, h = std::cbrt(std::numeric_limits<nn::realscalar>::epsilon());
+  const double tolerance = 100*h*h;
+  std::mt19937 rng(59);
+  std::vector<nn::SequenceBatch> data(1, RandomSequences(rng));
+  nn::constrealview X(data[0].Input()), T(data[0].Output());
+
+  auto trained = Network(steps);
+  nn::train::BackpropTrainingParameters params = { nn::realscalar(rate), 0, 0, false, 0, 0 };
+  nn::train::BpttTrainingAlgorithm bptt(*trained, params);
+  bptt.SetTrainingData(&data);
+  bptt.Train();
+
+  auto network = Network(steps);
+  auto error = [&]() {
+    network->ResetContext(sequences);
+    network->FeedForward(X, steps);
+    return double(network->TotalError(T));
+  };
+  auto check = [&](nn::realmatrix& p, const nn::realmatrix& stepped) {
+    for (int row = 0; row < p.Rows(); ++row) {
+      for (int col = 0; col < p.Cols(); ++col) {
+        nn::realscalar& v = p.GetRowPtr(row)[col];
+        const nn::realscalar v0 = v;
+        v = v0 + h;
+        double up = error();
+        v = v0 - h;
+        double down = error();
+        v = v0;
+        double numeric = (up - down) / (2*h);
+        double bptt = (v0 - stepped.GetRowPtr(row)[col]) / rate;
+        EXPECT_NEAR(numeric, bptt, tolerance*std::max(1.0, std::abs(numeric)));
+      }
+    }
+  };
+
+  check(network->GetInputWeights(), trained->GetInputWeights());
+  check(network->GetContextWeights(), trained->GetContextWeights());
+  check(network->GetOutputWeights(), trained->GetOutputWeights());
+  check(network->GetHiddenBias(), trained->GetHiddenBias());
+  check(network->GetOutputBias(), trained->GetOutputBias());
+}
+
+
+// the target is the input of the step before, which only the context can
+// supply; truncating BPTT to segments of 4 steps still learns it
+TEST(Recurrent, LearnsToDelay)
+{
+  std::mt19937 rng(61);
+  std::uniform_int_distribution<int> bit(0, 1);
+  std::vector<nn::SequenceBatch> data;
+  for (int b = 0; b < 4; ++b) {
+    nn::SequenceBatch batch(8, 12, 1, 1);
+    for (int s = 0; s < 8; ++s) {
+      nn::realscalar previous = 0;
+      for (int t = 0; t < 12; ++t) {
+        nn::realscalar x = bit(rng) ? 1 : -1;
+        batch.SetStep(s, t, { x }, { previous });
+        previous = x;
+      }
+    }
+    data.push_back(batch);
+  }
+
+  nn::SimpleRecurrentNetwork network(1, 8, 1, 8, 4,
+                                     std::make_shared<nn::TanhActivation>(),
+                                     std::make_shared<nn::LinearActivation>(),
+                                     std::make_shared<nn::SquaredError>());
+  nn::train::BackpropTrainingParameters params = { 0.01, 0.5, 0, false, 0, 1e-9 };
+  nn::train::BpttTrainingAlgorithm bptt(network, params);
+  bptt.InitializeNetwork();
+  bptt.SetTrainingData(&data);
+  bptt.Train();
+  const double initial = bptt.GetLastError();
+
+  params.max_epochs = 300;
+  nn::train::BpttTrainingAlgorithm more(network, params);
+  more.SetTrainingData(&data);
+  more.Train();
+  EXPECT_LT(more.GetLastError(), 0.05*initial);
+}
+
+
+// softmax only as the output, and only with categorical cross-entropy
+TEST(Recurrent, RejectsMisplacedSoftmax)
+{
+  EXPECT_THROW(nn::SimpleRecurrentNetwork(in, hid, out, sequences, steps,
+                                          std::make_shared<nn::SoftmaxActivation>(),
+                                          std::make_shared<nn::SoftmaxActivation>(),
+                                          std::make_shared<nn::CategoricalCrossEntropyError>()), const char*);
+  EXPECT_THROW(nn::SimpleRecurrentNetwork(in, hid, out, sequences, steps,
+                                          std::make_shared<nn::TanhActivation>(),
+                                          std::make_shared<nn::SoftmaxActivation>(),
+                                          std::make_shared<nn::SquaredError>()), const char*);
+  EXPECT_NO_THROW(nn::SimpleRecurrentNetwork(in, hid, out, sequences, steps,
+                                             std::make_shared<nn::TanhActivation>(),
+                                             std::make_shared<nn::SoftmaxActivation>(),
+                                             std::make_shared<nn::CategoricalCrossEntropyError>()));
+}
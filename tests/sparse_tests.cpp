@@ -0,0 +1,143 @@
+#include "gtest/gtest.h"
+
+#include "../src/sparse.hpp"
+#include "../src/network.hpp"
+#include "../src/train.hpp"
+#include "test_helpers.hpp"
+
+#include <random>
+
+
+namespace
+{
+
+// a one-hot style batch: a couple of ones per row and an empty row
+nn::realmatrix OneHotBatch(int rows, int cols)
+{
+  nn::realmatrix A(rows, cols, nn::realmatrix::PaddedLd(cols));
+  for (int row = 0; row < rows - 1; ++row) {
+    A.SetEntry(row, (3*row) % cols, 1);
+    A.SetEntry(row, (7*row + 1) % cols, 0.5);
+  }
+  return A;
+}
+
+nn::realscalar At(const nn::realmatrix& A, int row, int col)
+{
+  return A.GetRowPtr(row)[col];
+}
+
+}
+
+
+TEST(Sparse, FromDense)
+{
+  auto A = OneHotBatch(5, 11);
+  nn::realsparsematrix S(A);
+
+  EXPECT_EQ(5, S.Rows());
+  EXPECT_EQ(11, S.Cols());
+  EXPECT_EQ(8, S.NonZeros());
+  EXPECT_EQ(S.RowStart(4), S.RowStart(5));
+
+  auto B = S.ToDense();
+  for (int row = 0; row < 5; ++row) {
+    for (int col = 0; col < 11; ++col) {
+      EXPECT_EQ(At(A, row, col), At(B, row, col));
+    }
+  }
+}
+
+
+TEST(Sparse, MatchesDenseKernels)
+{
+  const int batch = 6, in = 19, out = 7;
+  std::mt19937 rng(99);
+  auto X = OneHotBatch(batch, in);
+  nn::realsparsematrix S(X);
+  auto W = RandomMatrix(out, in, rng);
+  auto D = RandomMatrix(batch, out, rng);
+
+  // forward: A += S W^T
+  auto dense = RandomMatrix(batch, out, rng);
+  auto sparse = dense;
+  nn::accum_A_BCt(dense, X, W);
+  nn::accum_A_SBt(sparse, S, W);
+
+  for (int row = 0; row < batch; ++row) {
+    for (int col = 0; col < out; ++col) {
+      EXPECT_NEAR(At(dense, row, col), At(sparse, row, col), 1e-5);
+    }
+  }
+
+  // gradient: dW += D^T S
+  auto dw_dense = RandomMatrix(out, in, rng);
+  auto dw_sparse = dw_dense;
+  nn::accum_A_BtC(dw_dense, D, X);
+  nn::accum_A_BtS(dw_sparse, D, S);
+
+  for (int row = 0; row < out; ++row) {
+    for (int col = 0; col < in; ++col) {
+      EXPECT_NEAR(At(dw_dense, row, col), At(dw_sparse, row, col), 1e-5);
+    }
+  }
+}
+
+
+// pruned weights: A += B S^T over batches that do and don't fill the
+// kernel's blocks of four rows
+TEST(Sparse, SparseWeightsKernel)
+{
+  const int in = 23, out = 9;
+  std::mt19937 rng(99);
+  auto W = RandomMatrix(out, in, rng);
+  for (int row = 0; row < out; ++row) {
+    for (int col = 0; col < in; ++col) {
+      if ((row + 2*col) % 3 != 0 || row == 4) {
+        W.SetEntry(row, col, 0);
+      }
+    }
+  }
+  nn::realsparsematrix S(W);
+
+  for (int batch : { 1, 4, 7 }) {
+    auto X = RandomMatrix(batch, in, rng);
+    auto dense = RandomMatrix(batch, out, rng);
+    auto sparse = dense;
+    nn::accum_A_BCt(dense, X, W);
+    nn::accum_A_BSt(sparse, X, S);
+
+    for (int row = 0; row < batch; ++row) {
+      for (int col = 0; col < out; ++col) {
+        EXPECT_NEAR(At(dense, row, col), At(sparse, row, col), 1e-5);
+      }
+    }
+  }
+
+  EXPECT_GE(nn::SparseBreakEven(), 0.0);
+  EXPECT_LT(nn::SparseBreakEven(), 1.0);
+}
+
+
+TEST(Sparse, NetworkFeedForward)
+{
+  const int batch = 4;
+  std::mt19937 rng(99);
+  nn::Network network({ 9, 5, 3 }, batch,
+                      std::make_shared<nn::TanhActivation>(),
+                      std::make_shared<nn::LinearActivation>(),
+                      std::make_shared<nn::SquaredError>());
+
+  auto X = OneHotBatch(batch, 9);
+  nn::realsparsematrix S(X);
+  nn::train::NetworkTrainer(network).GetConnections()[0]->GetWeights() = RandomMatrix(5, 9, rng);
+
+  nn::realmatrix dense = network.FeedForward(X);
+  const auto& sparse = network.FeedForward(S);
+
+  for (int row = 0; row < batch; ++row) {
+    for (int col = 0; col < 3; ++col) {
+      EXPECT_NEAR(At(dense, row, col), At(sparse, row, col), 1e-5);
+    }
+  }
+}
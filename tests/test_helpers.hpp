@@ -0,0 +1,51 @@
+#pragma once
+
+// Matrix and network helpers shared by the test files.
+
+#include "gtest/gtest.h"
+
+#include "../src/network.hpp"
+#include "../src/train.hpp"
+
+#include <random>
+
+
+// uniform in [-1, 1), with padded rows
+inline nn::realmatrix RandomMatrix(int rows, int cols, std::mt19937& rng)
+{
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+
+  nn::realmatrix A(rows, cols, nn::realmatrix::PaddedLd(cols));
+  for (int row = 0; row < rows; ++row) {
+    for (int col = 0; col < cols; ++col) {
+      A.SetEntry(row, col, nn::realscalar(dist(rng)));
+    }
+  }
+  return A;
+}
+
+// random weights and biases for every connection and non-input layer
+inline void Randomize(nn::Network& network, std::mt19937& rng)
+{
+  nn::train::NetworkTrainer ntr(network);
+  for (auto& c : ntr.GetConnections()) {
+    c->GetWeights() = RandomMatrix(c->Rows(), c->Cols(), rng);
+  }
+  for (auto& layer : ntr.GetLayers()) {
+    if (!layer->IsInput()) {
+      auto& bias = ntr.GetLayerBias(layer.get());
+      bias = RandomMatrix(1, bias.Cols(), rng);
+    }
+  }
+}
+
+inline void ExpectNear(const nn::realmatrix& A, const nn::realmatrix& B, double tol)
+{
+  ASSERT_EQ(A.Rows(), B.Rows());
+  ASSERT_EQ(A.Cols(), B.Cols());
+  for (int row = 0; row < A.Rows(); ++row) {
+    for (int col = 0; col < A.Cols(); ++col) {
+      EXPECT_NEAR(A.GetRowPtr(row)[col], B.GetRowPtr(row)[col], tol) << "(" << row << ", " << col << ")";
+    }
+  }
+}
@@ -0,0 +1,76 @@
+#include "gtest/gtest.h"
+
+#include "../src/workspace.hpp"
+
+#include <cstdint>
+
+
+TEST(Workspace, BindsMatricesToOneArena)
+{
+  nn::dblmatrix A(3, 5, nn::dblmatrix::PaddedLd(5));
+  A.SetEntry(2, 4, 7.0);
+  nn::dblmatrix B(4, 2, 0, nullptr);
+  nn::fltmatrix C(2, 3, 0, nullptr);
+
+  nn::Workspace workspace;
+  workspace.Add("A", A);
+  workspace.Add("B", B, 1.0);
+  workspace.Add("C", C);
+  EXPECT_EQ(3u, workspace.NumBuffers());
+  EXPECT_FALSE(workspace.IsAllocated());
+
+  workspace.Allocate();
+  EXPECT_TRUE(workspace.IsAllocated());
+  EXPECT_GE(workspace.ArenaBytes(), workspace.Bytes());
+
+  // existing contents are carried over, new matrices get the fill value
+  EXPECT_TRUE(A.IsExternal());
+  EXPECT_EQ(7.0, A.GetRowPtr(2)[4]);
+  for (auto x : B) {
+    EXPECT_EQ(1.0, x);
+  }
+  for (auto x : C) {
+    EXPECT_EQ(0.0f, x);
+  }
+
+  // laid out one after another, each on a cache line
+  const char* a = reinterpret_cast<const char*>(A.GetPtr());
+  const char* b = reinterpret_cast<const char*>(B.GetPtr());
+  const char* c = reinterpret_cast<const char*>(C.GetPtr());
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(a) % nn::CACHE_LINE_SIZE);
+  EXPECT_EQ(a + A.StorageSize() * sizeof(double), b);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(c) % nn::CACHE_LINE_SIZE);
+  EXPECT_LT(b, c);
+
+  // moving to a new arena keeps the contents
+  workspace.UseHugePages(true);
+  workspace.Allocate();
+  EXPECT_EQ(7.0, A.GetRowPtr(2)[4]);
+  EXPECT_EQ(1.0, B.GetRowPtr(3)[1]);
+}
+
+
+TEST(Workspace, AssignmentWritesThrough)
+{
+  nn::dblmatrix A(2, 3, 0, nullptr);
+  nn::Workspace workspace;
+  workspace.Add("A", A);
+  workspace.Allocate();
+  const double* storage = A.GetPtr();
+
+  nn::dblmatrix B(2, 3);
+  B.SetEntry(1, 2, 5.0);
+  A = B;
+  EXPECT_EQ(storage, A.GetPtr());
+  EXPECT_EQ(5.0, A.GetRowPtr(1)[2]);
+
+  // and never leave the workspace for another shape
+  EXPECT_THROW(A = nn::dblmatrix(3, 2), const char*);
+  EXPECT_EQ(storage, A.GetPtr());
+
+  // copies own their storage
+  nn::dblmatrix C(A);
+  EXPECT_FALSE(C.IsExternal());
+  EXPECT_NE(storage, C.GetPtr());
+  EXPECT_EQ(5.0, C.GetRowPtr(1)[2]);
+}